@@ -0,0 +1,184 @@
+#include "DescriptorIndex.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <climits>
+#include <iostream>
+
+using namespace cv;
+using namespace std;
+
+namespace thymio_tracker
+{
+
+static inline unsigned short getSubstring(const uchar* descriptor, int table)
+{
+    return (unsigned short)(descriptor[2*table] | (descriptor[2*table+1] << 8));
+}
+
+void DescriptorIndex::build(const std::vector<cv::Mat>& descriptors)
+{
+    mNbLandmarks = descriptors.size();
+    mNbBytes = 0;
+    int nbDescriptors = 0;
+    for(unsigned int l=0;l<descriptors.size();l++)
+    {
+        if(descriptors[l].empty())
+            continue;
+        if(descriptors[l].type() != CV_8U || (mNbBytes && descriptors[l].cols != mNbBytes))
+        {
+            std::cerr << "Landmark " << l << " has descriptors of another type or length" << std::endl;
+            throw std::runtime_error("DescriptorIndex::build > descriptors are not binary or have different lengths!");
+        }
+        mNbBytes = descriptors[l].cols;
+        nbDescriptors += descriptors[l].rows;
+    }
+    if(mNbBytes % 2)
+        throw std::runtime_error("DescriptorIndex::build > descriptor length has to be a multiple of 16 bits!");
+    mNbTables = mNbBytes/2;
+
+    //stack all the descriptors
+    mDescriptors.create(nbDescriptors, mNbBytes, CV_8U);
+    mLandmarks.resize(nbDescriptors);
+    mIndexesInLandmark.resize(nbDescriptors);
+    mLandmarkStart.resize(descriptors.size()+1);
+    mLandmarkStart[0] = 0;
+    for(unsigned int l=0, id=0;l<descriptors.size();l++)
+    {
+        for(int i=0;i<descriptors[l].rows;i++, id++)
+        {
+            descriptors[l].row(i).copyTo(mDescriptors.row(id));
+            mLandmarks[id] = l;
+            mIndexesInLandmark[id] = i;
+        }
+        mLandmarkStart[l+1] = id;
+    }
+
+    //sort the descriptors by substring in each table (counting sort, stable so the ids stay sorted in each bucket)
+    mBucketStart.assign(mNbTables, std::vector<unsigned int>(65536+1));
+    mIds.assign(mNbTables, std::vector<unsigned int>(nbDescriptors));
+    std::vector<unsigned int> nextInBucket(65536);
+    for(int t=0;t<mNbTables;t++)
+    {
+        std::vector<unsigned int>& bucketStart = mBucketStart[t];
+        std::fill(bucketStart.begin(), bucketStart.end(), 0);
+        for(int id=0;id<nbDescriptors;id++)
+            bucketStart[getSubstring(mDescriptors.ptr<uchar>(id), t)+1]++;
+        for(int k=0;k<65536;k++)
+            bucketStart[k+1] += bucketStart[k];
+        std::copy(bucketStart.begin(), bucketStart.end()-1, nextInBucket.begin());
+        for(int id=0;id<nbDescriptors;id++)
+            mIds[t][nextInBucket[getSubstring(mDescriptors.ptr<uchar>(id), t)]++] = id;
+    }
+}
+
+void DescriptorIndex::match(const cv::Mat& queryDescriptors, std::vector<std::vector<Match> >& matchesPerLandmark,
+                            const std::vector<unsigned char>* landmarkMask) const
+{
+    matchesPerLandmark.assign(mNbLandmarks, std::vector<Match>());
+    if(mLandmarks.empty() || queryDescriptors.empty())
+        return;
+    if(queryDescriptors.type() != CV_8U || queryDescriptors.cols != mNbBytes)
+        throw std::runtime_error("DescriptorIndex::match > query descriptors do not match the indexed ones!");
+
+    //the descriptors closer than 2 bits per substring are all checked, the ones closer than 4 bits per
+    //substring with a probability above 95%: the second closest is assumed to be at least that far if none was found
+    const int checkedDistance = 4*mNbTables;
+
+    //landmarks to match, and position of their descriptors in the scratch buffers
+    std::vector<int> selected;
+    std::vector<unsigned int> scratchStart(1, 0);
+    for(int l=0;l<mNbLandmarks;l++)
+        if(!landmarkMask || (*landmarkMask)[l])
+        {
+            selected.push_back(l);
+            scratchStart.push_back(scratchStart.back() + mLandmarkStart[l+1] - mLandmarkStart[l]);
+        }
+    if(scratchStart.back() == 0)
+        return;
+    //without mask the scratch position of a descriptor is its id
+    const bool allLandmarks = (int)selected.size() == mNbLandmarks;
+
+    //last query which checked each descriptor of the selected landmarks
+    std::vector<int> checkedBy(scratchStart.back(), -1);
+    //two closest of each landmark for the current query, and the landmarks which had candidates
+    Match none;
+    none.queryIdx = -1;
+    std::vector<Match> best(mNbLandmarks, none);
+    std::vector<int> touched;
+    touched.reserve(selected.size());
+
+    for(int q=0;q<queryDescriptors.rows;q++)
+    {
+        const uchar* query = queryDescriptors.ptr<uchar>(q);
+        touched.clear();
+
+        //distance of the candidate id, at position pos in the scratch buffers, to the query
+        auto check = [&](unsigned int id, unsigned int pos)
+        {
+            if(checkedBy[pos] == q)
+                return;
+            checkedBy[pos] = q;
+
+            int distance = hammingDistance(query, mDescriptors.ptr<uchar>(id), mNbBytes);
+            int l = mLandmarks[id];
+            Match& m = best[l];
+            if(m.queryIdx != q)
+            {
+                touched.push_back(l);
+                m.queryIdx = q;
+                m.trainIdx = -1;
+                m.distance = INT_MAX;
+                m.secondDistance = INT_MAX;
+            }
+            if(distance < m.distance)
+            {
+                m.secondDistance = m.distance;
+                m.distance = distance;
+                m.trainIdx = mIndexesInLandmark[id];
+            }
+            else if(distance < m.secondDistance)
+                m.secondDistance = distance;
+        };
+
+        for(int t=0;t<mNbTables;t++)
+        {
+            const std::vector<unsigned int>& ids = mIds[t];
+            const std::vector<unsigned int>& bucketStart = mBucketStart[t];
+            unsigned short queryKey = getSubstring(query, t);
+            //the substring itself and the ones which differ by one bit
+            for(int b=-1;b<16;b++)
+            {
+                unsigned short key = (b<0) ? queryKey : (unsigned short)(queryKey ^ (1<<b));
+                std::vector<unsigned int>::const_iterator first = ids.begin() + bucketStart[key];
+                std::vector<unsigned int>::const_iterator last = ids.begin() + bucketStart[key+1];
+                if(first == last)
+                    continue;
+                if(allLandmarks)
+                {
+                    for(std::vector<unsigned int>::const_iterator it = first; it != last; ++it)
+                        check(*it, *it);
+                    continue;
+                }
+                //ids are sorted in the bucket: only visit the range of each selected landmark
+                for(unsigned int s=0;s<selected.size();s++)
+                {
+                    unsigned int landmarkFirst = mLandmarkStart[selected[s]];
+                    unsigned int landmarkLast = mLandmarkStart[selected[s]+1];
+                    for(std::vector<unsigned int>::const_iterator it = std::lower_bound(first, last, landmarkFirst);
+                        it != last && *it < landmarkLast; ++it)
+                        check(*it, scratchStart[s] + *it - landmarkFirst);
+                }
+            }
+        }
+
+        for(unsigned int i=0;i<touched.size();i++)
+        {
+            Match m = best[touched[i]];
+            m.secondDistance = std::min(m.secondDistance, checkedDistance);
+            matchesPerLandmark[touched[i]].push_back(m);
+        }
+    }
+}
+
+}
@@ -0,0 +1,69 @@
+//index of the binary descriptors of all the landmarks, to match the descriptors of an image against
+//all of them at once instead of brute force matching against each landmark in turn
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/hal/hal.hpp>
+
+#include <vector>
+
+namespace thymio_tracker
+{
+
+//nb of different bits of two binary descriptors
+inline int hammingDistance(const uchar* a, const uchar* b, int nbBytes)
+{
+    return cv::hal::normHamming(a, b, nbBytes);
+}
+
+//multi-index hashing (Norouzi et al., Fast Search in Hamming Space with Multi-Index Hashing):
+//the descriptors are cut in 16 bit substrings, each one indexes a table. The candidates of a query are
+//the descriptors which have at least one substring within 1 bit of the query one, so all the descriptors
+//closer than 2 bits per substring are found for sure, and the farther ones with a high probability
+class DescriptorIndex
+{
+public:
+    //closest descriptor of a landmark to a query descriptor
+    struct Match
+    {
+        int queryIdx;
+        int trainIdx;//index of the descriptor in the landmark
+        int distance;
+        //distance of the second closest candidate of the landmark, bounded by the distance under which
+        //almost all the descriptors are candidates, so that the ratio test is not too permissive
+        int secondDistance;
+    };
+
+    DescriptorIndex() : mNbBytes(0), mNbTables(0), mNbLandmarks(0) {}
+
+    //index the descriptors (CV_8U, one per row, same length for all) of each landmark
+    void build(const std::vector<cv::Mat>& descriptors);
+
+    bool empty() const {return mLandmarks.empty();}
+    int getNbLandmarks() const {return mNbLandmarks;}
+
+    //for each query descriptor, the closest descriptor of each landmark among the candidates
+    //matchesPerLandmark[l] lists the matches to landmark l, ordered by query
+    //landmarkMask: if not null, only the landmarks l with landmarkMask[l] != 0 are matched
+    void match(const cv::Mat& queryDescriptors, std::vector<std::vector<Match> >& matchesPerLandmark,
+               const std::vector<unsigned char>* landmarkMask = 0) const;
+
+private:
+    int mNbBytes;
+    int mNbTables;
+    int mNbLandmarks;
+
+    //all the descriptors, with their landmark and index in it
+    //the descriptors of landmark l are the ones from mLandmarkStart[l] to mLandmarkStart[l+1]-1
+    cv::Mat mDescriptors;
+    std::vector<int> mLandmarks;
+    std::vector<int> mIndexesInLandmark;
+    std::vector<unsigned int> mLandmarkStart;
+
+    //one table per substring: ids of the descriptors sorted by value of the substring then by id (so by landmark),
+    //the ones with substring k are from mBucketStart[t][k] to mBucketStart[t][k+1]-1
+    std::vector<std::vector<unsigned int> > mBucketStart;
+    std::vector<std::vector<unsigned int> > mIds;
+};
+
+}
@@ -0,0 +1,89 @@
+#include "FeatureBackend.hpp"
+
+#include <stdexcept>
+#include <iostream>
+
+using namespace cv;
+using namespace std;
+
+namespace thymio_tracker
+{
+
+//FAST detection, then the ORB descriptor of the keypoints without orientation (FAST does not give one)
+class FastBriefExtractor : public cv::Feature2D
+{
+public:
+    FastBriefExtractor(int threshold, int maxNbKeypoints)
+        : mMaxNbKeypoints(maxNbKeypoints)
+        , mDetector(FastFeatureDetector::create(threshold, true))
+        , mDescriptor(ORB::create())
+    {}
+
+    void detectAndCompute(InputArray image, InputArray mask, std::vector<KeyPoint>& keypoints,
+                          OutputArray descriptors, bool useProvidedKeypoints = false)
+    {
+        if(!useProvidedKeypoints)
+        {
+            mDetector->detect(image, keypoints, mask);
+            //strongest corners only, FAST finds a lot of them on textured images
+            if(mMaxNbKeypoints > 0)
+                KeyPointsFilter::retainBest(keypoints, mMaxNbKeypoints);
+        }
+        if(descriptors.needed())
+            mDescriptor->compute(image, keypoints, descriptors);
+    }
+
+    int descriptorSize() const {return mDescriptor->descriptorSize();}
+    int descriptorType() const {return mDescriptor->descriptorType();}
+    int defaultNorm() const {return NORM_HAMMING;}
+
+private:
+    int mMaxNbKeypoints;
+    Ptr<FastFeatureDetector> mDetector;
+    Ptr<ORB> mDescriptor;
+};
+
+std::string featureTypeName(FeatureType type)
+{
+    switch(type)
+    {
+        case FEATURE_BRISK: return "brisk";
+        case FEATURE_ORB: return "orb";
+        case FEATURE_FAST_BRIEF: return "fast_brief";
+    }
+    throw std::runtime_error("featureTypeName > unknown feature type!");
+}
+
+FeatureType featureTypeFromName(const std::string& name)
+{
+    if(name == "brisk")
+        return FEATURE_BRISK;
+    if(name == "orb")
+        return FEATURE_ORB;
+    if(name == "fast_brief")
+        return FEATURE_FAST_BRIEF;
+
+    std::cerr << "Unknown feature type " << name << std::endl;
+    throw std::runtime_error("featureTypeFromName > unknown feature type!");
+}
+
+int featureDescriptorSize(FeatureType type)
+{
+    return (type == FEATURE_BRISK) ? 64 : 32;
+}
+
+cv::Ptr<cv::Feature2D> createFeatureExtractor(FeatureType type, bool forTemplate)
+{
+    switch(type)
+    {
+        case FEATURE_BRISK:
+            return forTemplate ? BRISK::create(60) : BRISK::create();
+        case FEATURE_ORB:
+            return forTemplate ? ORB::create(1000) : ORB::create(500);
+        case FEATURE_FAST_BRIEF:
+            return forTemplate ? makePtr<FastBriefExtractor>(30, 1000) : makePtr<FastBriefExtractor>(20, 500);
+    }
+    throw std::runtime_error("createFeatureExtractor > unknown feature type!");
+}
+
+}
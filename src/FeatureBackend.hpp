@@ -0,0 +1,30 @@
+//feature detectors and binary descriptors which can be used for the landmarks
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+
+#include <string>
+
+namespace thymio_tracker
+{
+
+enum FeatureType
+{
+    FEATURE_BRISK,
+    FEATURE_ORB,
+    FEATURE_FAST_BRIEF//FAST corners with upright BRIEF descriptors (ORB sampling pattern), the cheapest
+};
+
+//name of the type in the landmark and config files: "brisk", "orb" or "fast_brief"
+std::string featureTypeName(FeatureType type);
+FeatureType featureTypeFromName(const std::string& name);
+
+//length in bytes of the descriptors of a type
+int featureDescriptorSize(FeatureType type);
+
+//detector and descriptor of a type: forTemplate for the landmark images (tools/landmark),
+//else with the settings of the detection in the frames
+cv::Ptr<cv::Feature2D> createFeatureExtractor(FeatureType type, bool forTemplate = false);
+
+}
@@ -18,11 +18,15 @@
 #include <opencv2/features2d.hpp>
 
 #include "Generic.hpp"
+#include "GeometricHash.hpp"
 
 namespace thymio_tracker
 {
 
-class GHscale
+typedef GeometricHashWorkspace<cv::Point3f> GHscaleWorkspace;
+
+//3 dimensions table (position and relative scale) with votes interpolated between neigboring bins
+class GHscale : public GeometricHash<3,float>
 {
 public:
     //constructor
@@ -32,19 +36,19 @@ public:
     
     //set Hashing table, could do that autonomously from model, but as we have one object we code it the hard way
     void initHashTable(int _nbIds, cv::Point3i _nbBinsPerDim=cv::Point3i(40,40,5));
+    //same for several models sharing the table: the ids of model m are stored in the table
+    //from getModelIdOffset(m) to getModelIdOffset(m+1)-1
+    void initHashTable(const std::vector<int>& _nbIdsPerModel, cv::Point3i _nbBinsPerDim=cv::Point3i(40,40,5));
     //train GH with model projected in several positions to be more robust to perspective effects
     //Input: list of points for each pose, the 3 coordinates in each points correspond to the position of point in image plane in meters
     //and to inverse depth
     void setModel(std::vector<cv::Point3f> *projPoints, int nbPoses);
     //extract blobs, get there 3D position, check which point they correspond to in HashTable
+    //all the models are voted for in the same pass, the model of each match is stored in DetectionGH::model
     void getModelPointsFromImage(const cv::Mat& img, std::vector<DetectionGH> &matches) const;
     void getModelPointsFromImage(const std::vector<cv::KeyPoint> &blobs, std::vector<DetectionGH> &matches) const;
-
-    //GH io
-    void saveToStream(std::ostream& stream) const;
-    void loadFromStream(std::istream& stream);
-    void saveToFileStorage(cv::FileStorage& fs) const;
-    void loadFromFileStorage(cv::FileStorage& fs);
+    //same using buffers owned by the caller, to be used for every frame
+    void getModelPointsFromImage(const std::vector<cv::KeyPoint> &blobs, std::vector<DetectionGH> &matches, GHscaleWorkspace& workspace) const;
 
 private:
     //camera calibration
@@ -53,32 +57,6 @@ private:
     cv::Ptr<cv::SimpleBlobDetector> sbd;
     //extract the blob position and scales for getModelPointsFromImage
     void extractBlobs(const cv::Mat& input, std::vector<cv::KeyPoint> &blobs) const;
-    //unproject blobs from image space to "world space"
-    //void convertToWorldFrame(vector<KeyPoint> &blobs,Mat &cameraMatrix, Mat &distCoeffs,vector<Point3f> &points3d);
-    //get the nbPtBasis closest points to p
-    void getClosestNeigbors(unsigned int p, const std::vector<cv::Point3f>& mVerticesDes, std::vector<unsigned int>& idNeigbors) const;
-    //made to do some testing: compute hashTable corresponding to a special base and save data to display
-    //void getSignatureBasis(vector<Point3f> &mVerticesDes, vector<int> &basisId, char *filename);
-    //smoothes votes in HastTable: indeed current base will differ from model base due to measurement erros => if many bins might read votes in one bin that is just neigboring the one we actually want to read. Can also allow for perspective distortion if depth blobs are omitted
-    void blurHashTable();
-
-
-    //attributes
-    //HashTable: each cell stores a number of vote for each point id
-    int nbIds;
-    cv::Point3i nbBinPerDim;
-    float *HashTable;//binx first, biny, binscale, id
-    
-    //function to navigate in HT:
-    cv::Point3f poseRelMin, poseRelMax;
-    cv::Point3f toCell(const cv::Point3f& relativePos) const;
-    //add some votes _v (eg 1 for one vote) in bin bin for point id. (for training)
-    void addVoteToBin(const cv::Point3f& bin,const int &id, const float _v);
-    //get the votes for each id corresponding to one bin. (for matching)
-    void readVotesFromBin(const cv::Point3f& bin,float *votes) const;
-    
-    //number of neigbors considered for each point to define bases
-    unsigned int nbPtBasis;
 };
 
 }
@@ -85,6 +85,40 @@ Mat ProjectZ1_Jac_Dp(const Point3f& mvLastDistCam)
 }
 
 cv::Point2f Pointxy(const cv::Point3f& _m){return cv::Point2f(_m.x,_m.y);}
+cv::Point2f Pointxy(const cv::Point2f& _m){return _m;}
+
+Matx33d deviceOrientationToCamera(const Mat& deviceOrientation)
+{
+    Mat orientation;
+    deviceOrientation.convertTo(orientation, CV_64F);
+
+    Matx33d R;
+    for(int i=0;i<3;i++)R(0, i) = -orientation.at<double>(i, 1);
+    for(int i=0;i<3;i++)R(1, i) = -orientation.at<double>(i, 0);
+    for(int i=0;i<3;i++)R(2, i) = -orientation.at<double>(i, 2);
+    return R;
+}
+
+void updateDeviceRotation(DeviceRotation& deviceRotation, const Mat& deviceOrientation)
+{
+    Matx33d orientation = deviceOrientationToCamera(deviceOrientation);
+    //first orientation: no motion to measure yet
+    deviceRotation.hasInterFrame = deviceRotation.hasOrientation;
+    if(deviceRotation.hasOrientation)
+        deviceRotation.interFrame = orientation * deviceRotation.orientation.t();
+    deviceRotation.orientation = orientation;
+    deviceRotation.hasOrientation = true;
+}
+
+Point2f rotatePixel(const Mat& _cameraMatrix, const Matx33d& rotation, const Point2f& _x)
+{
+    Point2f m = toMeters(_cameraMatrix, _x);
+    Vec3d ray = rotation * Vec3d(m.x, m.y, 1.);
+    //behind the camera: cannot be seen anymore, keep previous position
+    if(ray[2] <= 0)
+        return _x;
+    return toPixels(_cameraMatrix, Point2f(ray[0]/ray[2], ray[1]/ray[2]));
+}
 
 
 bool testDirectionBasis(Point2f basis1,Point2f basis2)
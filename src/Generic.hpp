@@ -73,7 +73,20 @@ struct DetectionGH {
     int id;//estimated id from GH
     float nbVotes;//nb votes for id
     int discriminativePower;//nb votes best - nb votes second best
-    DetectionGH(cv::Point2f _p, int _id, int _nv, int _d): position(_p), id(_id), nbVotes(_nv), discriminativePower(_d) {};
+    int model;//model the id belongs to when several models share the GH table
+    DetectionGH(cv::Point2f _p, int _id, int _nv, int _d, int _m = 0): position(_p), id(_id), nbVotes(_nv), discriminativePower(_d), model(_m) {};
+} ;
+
+//orientation of the device given by its IMU
+struct DeviceRotation {
+    cv::Matx33d orientation;//transforms world coordinates into camera ones, world z axis pointing up
+    cv::Matx33d interFrame;//rotation of the camera since previous image, transforms previous camera coordinates into current ones
+    bool hasOrientation;
+    bool hasInterFrame;//false for the first image with orientation
+
+    DeviceRotation(): hasOrientation(false), hasInterFrame(false) {};
+    //up direction (world z axis) expressed in camera frame
+    cv::Vec3d upInCamera() const {return cv::Vec3d(orientation(0,2),orientation(1,2),orientation(2,2));}
 } ;
 
 //get the calibration from an open file
@@ -94,6 +107,15 @@ cv::Point2f toImagePlane(const cv::Point3f& _x);
 cv::Mat ProjectZ1_Jac_Dp(const cv::Point3f& mvLastDistCam);
 //get x,y coordinates of Point3f
 cv::Point2f Pointxy(const cv::Point3f& _m);
+cv::Point2f Pointxy(const cv::Point2f& _m);
+
+//rotation matrix of the device (as given by android sensor manager, the inverse of what we want with
+//x and y axes switched and all axes inverted) to the rotation from world to camera coordinates
+cv::Matx33d deviceOrientationToCamera(const cv::Mat& deviceOrientation);
+//update the device rotation with the orientation of the new image
+void updateDeviceRotation(DeviceRotation& deviceRotation, const cv::Mat& deviceOrientation);
+//position in current image of a point at infinity seen at _x in previous image, the camera having rotated by rotation
+cv::Point2f rotatePixel(const cv::Mat& _cameraMatrix, const cv::Matx33d& rotation, const cv::Point2f& _x);
 
 //check direction triangle
 bool testDirectionBasis(cv::Point2f basis1,cv::Point2f basis2);
@@ -0,0 +1,721 @@
+//Geometric hashing core shared by GH and GHscale
+//for each point: get the nbPtBasis closest points,
+//consider all positively oriented triangles in this set of points as a basis
+//and project the other points in it to vote in the table.
+//
+//The table is specialized at compile time:
+// - Dims: dimension of the table, 2 for the position of the points in the basis,
+//   3 when the relative scale (inverse depth ratio / blob size ratio) is added
+// - BinT: type of the votes, integral types vote in the nearest bin only,
+//   floating point types spread the votes in the 2^Dims neigboring bins (multilinear interpolation)
+//The number of ids and of bins per dimension stay runtime values as they come from the trained file.
+
+#pragma once
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <cstdlib>
+
+#include <opencv2/core.hpp>
+
+#include "Generic.hpp"
+
+namespace thymio_tracker
+{
+
+//type of the points given to the table for each dimension
+template<int Dims> struct GHPointType;
+template<> struct GHPointType<2> { typedef cv::Point2f type; };
+template<> struct GHPointType<3> { typedef cv::Point3f type; };
+
+//coordinates of point _pi in the basis with origin _pp, _basisInv being the inverse of the basis vectors matrix
+inline cv::Vec2f relativeCoordinates(const cv::Matx22f& _basisInv, const cv::Point2f& _pp, const cv::Point2f& _pi)
+{
+    cv::Point2f relCoord=_basisInv*(_pi-_pp);
+    return cv::Vec2f(relCoord.x,relCoord.y);
+}
+//same with the relative scale as third coordinate
+inline cv::Vec3f relativeCoordinates(const cv::Matx22f& _basisInv, const cv::Point3f& _pp, const cv::Point3f& _pi)
+{
+    cv::Point2f relCoord=_basisInv*(Pointxy(_pi-_pp));
+    return cv::Vec3f(relCoord.x,relCoord.y,_pi.z/_pp.z);
+}
+
+//scratch buffers of a query, kept by the caller from one frame to the next
+//so that once they have grown to the size of the scene no allocation is done anymore
+template<class PointT>
+struct GeometricHashWorkspace
+{
+    std::vector<PointT> points;//blobs in meters (with their size for the scaled version)
+    std::vector<float> votes;//votes for each id of the table
+    std::vector<std::pair<int,float> > neigborDists;//to sort the neigbors of one point
+    std::vector<unsigned int> idNeigbors;
+    std::vector<int> bestMatchOfId;//position in matches of the detection of each id, -1 if none
+    std::vector<std::pair<unsigned int,unsigned int> > bases;//neigbors defining the bases of one point
+    std::vector<unsigned int> pointOfMatch;//point of each match
+    std::vector<unsigned char> matchComplete;//if the votes of the point of each match were not stopped early
+};
+
+template<int Dims, typename BinT>
+class GeometricHash
+{
+public:
+    typedef typename GHPointType<Dims>::type Point;
+    typedef cv::Vec<float,Dims> Coords;
+    typedef cv::Vec<int,Dims> Bins;
+    typedef GeometricHashWorkspace<Point> Workspace;
+
+    //integral votes go to the nearest bin, floating votes are interpolated between the neigboring bins
+    static const bool Interpolate = !std::numeric_limits<BinT>::is_integer;
+    static const int NbCorners = Interpolate ? (1<<Dims) : 1;
+
+    GeometricHash() : nbIds(0), mMaxBinVotes(0), nbPtBasis(2), mEarlyExit(false) {}
+    virtual ~GeometricHash() {}
+
+    //set Hashing table, the ids of model m are stored in the table
+    //from getModelIdOffset(m) to getModelIdOffset(m+1)-1
+    void initHashTable(const std::vector<int>& _nbIdsPerModel, const Bins& _nbBinsPerDim);
+    //train with the models projected in several positions to be more robust to perspective effects
+    //projPoints[m] is the list of points for each pose of model m
+    void setModels(const std::vector<std::vector<Point>*>& projPoints, int nbPoses);
+    //check which id each point corresponds to, points are in meters, blobs give the position in the image
+    //of each point for the output, all the models are voted for in the same pass
+    void getModelPoints(const std::vector<cv::KeyPoint>& blobs, const std::vector<Point>& points,
+                        std::vector<DetectionGH>& matches, Workspace& workspace) const;
+    //smoothes votes in HastTable: indeed current base will differ from model base due to measurement erros => if many bins might read votes in one bin that is just neigboring the one we actually want to read. Can also allow for perspective distortion if depth blobs are omitted
+    void blurHashTable(int _radius);
+
+    //incremental voting: stop accumulating the votes of a point as soon as its best id cannot change anymore.
+    //Same ids as without it; when two points get the same id their votes are finished before keeping the best one.
+    //The votes and discriminative powers of the other matches are the ones accumulated when the point was stopped,
+    //lower than without it, which changes the order in which the matches are tried by the pose estimation.
+    void setEarlyExit(bool _earlyExit){mEarlyExit=_earlyExit;}
+    //max number of votes stored for one id in one bin, ie max votes one projected point can give to an id
+    float getMaxBinVotes() const {return mMaxBinVotes;}
+
+    //number of neigbors considered for each point to define bases
+    void setNbPtBasis(unsigned int _nbPtBasis){nbPtBasis=_nbPtBasis;}
+    unsigned int getNbPtBasis() const {return nbPtBasis;}
+
+    //table description
+    int getNbIds() const {return nbIds;}
+    const Bins& getNbBinsPerDim() const {return nbBinPerDim;}
+    size_t getTableSize() const {return HashTable.size();}
+
+    //models stored in the table
+    int getNbModels() const {return mModelIdOffsets.size()-1;}
+    int getModelIdOffset(int _model) const {return mModelIdOffsets[_model];}
+    int getNbIdsInModel(int _model) const {return mModelIdOffsets[_model+1]-mModelIdOffsets[_model];}
+
+    //GH io
+    void saveToStream(std::ostream& stream) const;
+    void loadFromStream(std::istream& stream);
+    void saveToFileStorage(cv::FileStorage& fs) const;
+    void loadFromFileStorage(cv::FileStorage& fs);
+
+protected:
+    //get the nbPtBasis closest points to p
+    void getClosestNeigbors(unsigned int p, const std::vector<Point>& mVerticesDes, std::vector<unsigned int>& idNeigbors, std::vector<std::pair<int,float> >& pairIdDist) const;
+    //accumulate in workspace.votes the votes of point p from all its bases,
+    //returns true if stopped early because the best id could not change anymore
+    bool voteForPoint(unsigned int p, const std::vector<Point>& mPoints, bool earlyExit, Workspace& workspace) const;
+    //get model and id in model from id in table
+    void toModelId(int _tableId, int& _model, int& _id) const;
+    //set the offsets of the model ids and the number of ids
+    void setModelIdOffsets(const std::vector<int>& _nbIdsPerModel);
+    //allocate the table and set the strides once nbIds and nbBinPerDim are known
+    void allocateTable();
+    //to call each time the votes of the table are modified
+    void updateMaxBinVotes();
+
+    //function to navigate in HT:
+    //get the index of the first cell and the weight of each corner to read/write for a relative position,
+    //returns false if out of the table
+    bool toCell(const Coords& relativePos, int& firstCell, float* cornerWeights) const;
+    //add some votes _v (eg 1 for one vote) for point id. (for training)
+    void addVoteToBin(const Coords& relativePos, int id, float _v);
+    //get the votes for each id corresponding to one position. (for matching)
+    void readVotesFromBin(const Coords& relativePos, float *votes) const;
+
+    //attributes
+    //HashTable: each cell stores a number of vote for each point id
+    int nbIds;
+    //ids are namespaced by model: first id of each model in the table, last element is nbIds
+    std::vector<int> mModelIdOffsets;
+    Bins nbBinPerDim;
+    std::vector<BinT> HashTable;//first dimension first, ..., id
+    //offset in the table between two neigboring bins in each dimension
+    int mStrides[Dims];
+    //offset of each corner read/written by one vote from the first cell
+    int mCornerOffsets[NbCorners];
+
+    //bound on the votes given by one read, for early exit
+    float mMaxBinVotes;
+
+    //limits of the relative coordinates covered by the table
+    Coords poseRelMin, poseRelMax;
+
+    //number of neigbors considered for each point to define bases
+    unsigned int nbPtBasis;
+
+    //incremental voting
+    bool mEarlyExit;
+};
+
+//get the best id and the votes of the best and second best ids
+inline void getTwoBestVotes(const float *votes, int nbVotes, int& idBest, float& best, float& secondBest)
+{
+    idBest=-1;
+    best=0;
+    secondBest=0;
+    for(int id=0;id<nbVotes;id++)
+        if(votes[id]>best)
+        {
+            secondBest=best;
+            idBest=id;
+            best=votes[id];
+        }
+        else if(votes[id]>secondBest)
+            secondBest=votes[id];
+}
+
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::setModelIdOffsets(const std::vector<int>& _nbIdsPerModel)
+{
+    //ids of all the models are stored one after the other in the table
+    mModelIdOffsets.assign(1,0);
+    for(unsigned int m=0;m<_nbIdsPerModel.size();m++)
+        mModelIdOffsets.push_back(mModelIdOffsets.back()+_nbIdsPerModel[m]);
+
+    nbIds=mModelIdOffsets.back();
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::allocateTable()
+{
+    //last dimension is the id
+    mStrides[Dims-1]=getNbIds();
+    for(int d=Dims-2;d>=0;d--)
+        mStrides[d]=mStrides[d+1]*nbBinPerDim[d+1];
+
+    //corners ordered with the last dimension varying first
+    for(int c=0;c<NbCorners;c++)
+    {
+        mCornerOffsets[c]=0;
+        if(Interpolate)
+            for(int d=0;d<Dims;d++)
+                if((c>>(Dims-1-d))&1)
+                    mCornerOffsets[c]+=mStrides[d];
+    }
+
+    //init all bins to 0 votes
+    HashTable.assign((size_t)mStrides[0]*nbBinPerDim[0],BinT(0));
+    mMaxBinVotes=0;
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::updateMaxBinVotes()
+{
+    //corner weights sum to one so one read gives at most the max of the table to one id
+    mMaxBinVotes=0;
+    for(size_t i=0;i<HashTable.size();i++)
+        if(HashTable[i]>mMaxBinVotes)
+            mMaxBinVotes=HashTable[i];
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::initHashTable(const std::vector<int>& _nbIdsPerModel, const Bins& _nbBinsPerDim)
+{
+    setModelIdOffsets(_nbIdsPerModel);
+    nbBinPerDim=_nbBinsPerDim;
+    allocateTable();
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::toModelId(int _tableId, int& _model, int& _id) const
+{
+    _model=0;
+    while(_tableId>=mModelIdOffsets[_model+1])
+        _model++;
+    _id=_tableId-mModelIdOffsets[_model];
+}
+
+template<int Dims, typename BinT>
+bool GeometricHash<Dims,BinT>::toCell(const Coords& relativePos, int& firstCell, float* cornerWeights) const
+{
+    float e[Dims];
+    firstCell=0;
+    for(int d=0;d<Dims;d++)
+    {
+        float bin=(float)nbBinPerDim[d]*(relativePos[d]-poseRelMin[d])/(poseRelMax[d]-poseRelMin[d]);
+        if(Interpolate)
+        {
+            //need the next bin as well
+            if(!(bin>=0 && bin<nbBinPerDim[d]-1))
+                return false;
+            int E=(int)bin;
+            e[d]=bin-E;
+            firstCell+=E*mStrides[d];
+        }
+        else
+        {
+            //nearest bin
+            int E=(int)bin;
+            if(!(E>=0 && E<nbBinPerDim[d]))
+                return false;
+            firstCell+=E*mStrides[d];
+        }
+    }
+
+    //Simple spline
+    for(int c=0;c<NbCorners;c++)
+    {
+        cornerWeights[c]=1.f;
+        if(Interpolate)
+            for(int d=0;d<Dims;d++)
+                cornerWeights[c]*=((c>>(Dims-1-d))&1) ? e[d] : 1.f-e[d];
+    }
+    return true;
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::addVoteToBin(const Coords& relativePos, int id, float _v)
+{
+    int firstCell;
+    float weights[NbCorners];
+    if(toCell(relativePos,firstCell,weights))
+        for(int c=0;c<NbCorners;c++)
+            HashTable[firstCell+mCornerOffsets[c]+id]+=weights[c]*_v;
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::readVotesFromBin(const Coords& relativePos, float *votes) const
+{
+    int firstCell;
+    float weights[NbCorners];
+    if(toCell(relativePos,firstCell,weights))
+    {
+        const int nbIdsTable=getNbIds();
+        //each corner is a contiguous list of votes for all the ids
+        for(int c=0;c<NbCorners;c++)
+        {
+            const BinT *cell=&HashTable[firstCell+mCornerOffsets[c]];
+            const float w=weights[c];
+            for(int id=0;id<nbIdsTable;id++)
+                votes[id]+=w*cell[id];
+        }
+    }
+}
+
+struct sort_pair_wrt_second {
+    bool operator()(const std::pair<int,float> &left, const std::pair<int,float> &right) {
+        return left.second < right.second;
+    }
+};
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::getClosestNeigbors(unsigned int p, const std::vector<Point>& mVerticesDes, std::vector<unsigned int>& idNeigbors, std::vector<std::pair<int,float> >& pairIdDist) const
+{
+    //create pairs of point indexes and corresponding distance and sort with respect to deistance
+    pairIdDist.clear();
+    for(unsigned int i=0;i<mVerticesDes.size();i++)
+        if(i!=p)
+    {
+        std::pair<int,float> newPair;
+        newPair.first=i;
+        newPair.second=cv::norm(Pointxy(mVerticesDes[i]-mVerticesDes[p]));
+        pairIdDist.push_back(newPair);
+    }
+
+    //sort it
+    std::sort(pairIdDist.begin(), pairIdDist.end(), sort_pair_wrt_second());
+
+    //return first elements
+    idNeigbors.clear();
+    for(unsigned int i=0;i<pairIdDist.size() && i<nbPtBasis;i++)
+        idNeigbors.push_back(pairIdDist[i].first);
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::setModels(const std::vector<std::vector<Point>*>& projPoints, int nbPoses)
+{
+    std::vector<unsigned int> idNeigbors;
+    std::vector<std::pair<int,float> > pairIdDist;
+
+    //get hash table limits
+    //initialise with default mean value (0,0) coordinates and relScale of 1
+    for(int d=0;d<Dims;d++)
+        poseRelMin[d]=poseRelMax[d]=(d<2)?0.f:1.f;
+
+    //two passes: first get all the bases and project all point and set limits accordingly to support,
+    //then now that we have margin, fill tables with votes
+    for(int pass=0;pass<2;pass++)
+    {
+        if(pass==1)
+        {
+            //add margins
+            float marginRel=0.1;
+            for(int d=0;d<Dims;d++)
+            {
+                float diffRel=poseRelMax[d]-poseRelMin[d];
+                poseRelMin[d]=poseRelMin[d]-marginRel*diffRel;
+                poseRelMax[d]=poseRelMax[d]+marginRel*diffRel;
+            }
+        }
+
+        for(unsigned int m=0;m<projPoints.size();m++)
+        for(int idpose=0;idpose<nbPoses;idpose++)
+        {
+            const std::vector<Point> &mProjs=projPoints[m][idpose];
+            //loop through all points
+            for(unsigned int p=0;p<mProjs.size();p++)
+            {
+                //for each point have to find the nbPtBasis closest points
+                getClosestNeigbors(p,mProjs,idNeigbors,pairIdDist);
+
+                //for each positively oriented possible triangle in closest neigbors
+                //define basis and project all points on it to fill HT
+                for(unsigned int tp2=0;tp2<idNeigbors.size();tp2++)
+                {
+                    //get index of point 2 in mVerticesDes
+                    unsigned int p2=idNeigbors[tp2];
+                    //define first basis vector
+                    cv::Point2f basis1= Pointxy(mProjs[p2]-mProjs[p]);
+
+                    for(unsigned int tp3=0;tp3<idNeigbors.size();tp3++)
+                        if(p2!=idNeigbors[tp3])
+                        {
+                            unsigned int p3=idNeigbors[tp3];
+                            //define second basis
+                            cv::Point2f basis2= Pointxy(mProjs[p3]-mProjs[p]);
+
+                            //check direction of triangle
+                            if(testDirectionBasis(basis1,basis2))
+                            {
+                                //put basis in a 2x2 matrix to inverse it and express all other points i this basis
+                                cv::Matx22f tBasis(basis1.x,basis2.x,basis1.y,basis2.y);
+                                cv::Matx22f tBasisInv=tBasis.inv();
+
+                                //good basis => project all points and fill HT
+                                for(unsigned int i=0;i<mProjs.size();i++)
+                                    if(i!=p && i!=p2 && i!=p3)
+                                    {
+                                        //project in current basis
+                                        Coords relFull=relativeCoordinates(tBasisInv,mProjs[p],mProjs[i]);
+
+                                        if(pass==0)
+                                        {
+                                            //readjust limits
+                                            for(int d=0;d<Dims;d++)
+                                            {
+                                                if(relFull[d]<poseRelMin[d])poseRelMin[d]=relFull[d];
+                                                if(relFull[d]>poseRelMax[d])poseRelMax[d]=relFull[d];
+                                            }
+                                        }
+                                        else
+                                        {
+                                            //update HT with vote for p, ids of model m start at its offset in the table
+                                            addVoteToBin(relFull,mModelIdOffsets[m]+p,1.);
+                                        }
+                                    }
+                            }
+                        }
+                }
+            }
+        }
+    }
+
+    //probably would benefit from HT smoothing...
+    //=> not any more as we do that with perspective transformation knowledge
+    //actually could estimate variance of computed coordinates in local basis and blur using computed variance
+    //blurHashTable();
+    updateMaxBinVotes();
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::blurHashTable(int _radius)
+{
+    if(_radius<=0)
+        return;
+
+    //separable blur: one dimension after the other
+    std::vector<float> buff;
+    for(int d=0;d<Dims;d++)
+    {
+        buff.resize(nbBinPerDim[d]);
+        //go through all the lines along dimension d, ie cells with coordinate 0 in d
+        for(size_t start=0;start<HashTable.size();start++)
+            if((start/mStrides[d])%nbBinPerDim[d]==0)
+            {
+                for(int k=0;k<nbBinPerDim[d];k++)
+                {
+                    float res=0;
+                    for(int k2=-_radius;k2<=_radius;k2++)
+                    {
+                        int kc=k+k2;
+                        if(kc>=0 && kc<nbBinPerDim[d])
+                        {
+                            //just set pyramidal coef eg for radius = 2 => [1 2 3 2 1]
+                            int coef = 1+_radius-std::abs(k2);
+                            res+=coef * HashTable[start+kc*mStrides[d]];
+                        }
+                    }
+                    buff[k]=res;
+                }
+                for(int k=0;k<nbBinPerDim[d];k++)
+                    HashTable[start+k*mStrides[d]]=buff[k];
+            }
+    }
+    updateMaxBinVotes();
+}
+
+template<int Dims, typename BinT>
+bool GeometricHash<Dims,BinT>::voteForPoint(unsigned int p, const std::vector<Point>& mPoints, bool earlyExit, Workspace& workspace) const
+{
+    const int nbIdsTable=getNbIds();
+
+    //init all votes to 0
+    workspace.votes.assign(nbIdsTable, 0.f);
+    float *votesId=&workspace.votes[0];
+
+    //for each point have to find the nbPtBasis closest points
+    std::vector<unsigned int>& idNeigbors = workspace.idNeigbors;
+    getClosestNeigbors(p, mPoints, idNeigbors, workspace.neigborDists);
+
+    //positively oriented possible triangles in closest neigbors, only one of (p2,p3) and (p3,p2) is
+    std::vector<std::pair<unsigned int,unsigned int> >& bases = workspace.bases;
+    bases.clear();
+    for(unsigned int tp2=0;tp2<idNeigbors.size();tp2++)
+        for(unsigned int tp3=0;tp3<idNeigbors.size();tp3++)
+            if(idNeigbors[tp2]!=idNeigbors[tp3] &&
+               testDirectionBasis(Pointxy(mPoints[idNeigbors[tp2]]-mPoints[p]),Pointxy(mPoints[idNeigbors[tp3]]-mPoints[p])))
+                bases.push_back(std::make_pair(idNeigbors[tp2],idNeigbors[tp3]));
+
+    //for early exit: number of reads done and still to come, each basis reads all the other points
+    const unsigned int nbReadsPerBasis=(mPoints.size()>3)?mPoints.size()-3:0;
+    unsigned int remainingReads=bases.size()*nbReadsPerBasis;
+    unsigned int doneReads=0;
+
+    //define basis and project all points on it to read HT
+    for(unsigned int b=0;b<bases.size();b++)
+    {
+        unsigned int p2=bases[b].first;
+        unsigned int p3=bases[b].second;
+
+        //put basis in a 2x2 matrix to inverse it and express all other points i this basis
+        cv::Point2f basis1= Pointxy(mPoints[p2]-mPoints[p]);
+        cv::Point2f basis2= Pointxy(mPoints[p3]-mPoints[p]);
+        cv::Matx22f tBasis(basis1.x,basis2.x,basis1.y,basis2.y);
+        cv::Matx22f tBasisInv=tBasis.inv();
+
+        for(unsigned int i=0;i<mPoints.size();i++)
+            if(i!=p && i!=p2 && i!=p3)
+            {
+                //project in current basis and read HT with vote for p
+                readVotesFromBin(relativeCoordinates(tBasisInv,mPoints[p],mPoints[i]), votesId);
+
+                remainingReads--;
+                doneReads++;
+                //any id got at most mMaxBinVotes from each read done and can get as much from each remaining read,
+                //so the best id can only be out of reach once more reads are done than remain
+                if(earlyExit && doneReads>remainingReads)
+                {
+                    int idBest;
+                    float best,secondBest;
+                    getTwoBestVotes(votesId,nbIdsTable,idBest,best,secondBest);
+                    //nobody can catch up with the best id
+                    if(best>0 && secondBest+remainingReads*mMaxBinVotes<best)
+                        return true;
+                }
+            }
+    }
+    return false;
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::getModelPoints(const std::vector<cv::KeyPoint>& blobs, const std::vector<Point>& mPoints,
+                                                    std::vector<DetectionGH>& matches, Workspace& workspace) const
+{
+    const int nbIdsTable=getNbIds();
+
+    //empty output vectors
+    matches.clear();
+
+    //no detection for any id yet
+    workspace.bestMatchOfId.assign(nbIdsTable, -1);
+    workspace.pointOfMatch.clear();
+    workspace.matchComplete.clear();
+
+    //loop through all points
+    for(unsigned int p=0;p<mPoints.size();p++)
+    {
+        //for each point need to accumulate votes from HT
+        bool stopped=voteForPoint(p, mPoints, mEarlyExit, workspace);
+        const float *votesId=&workspace.votes[0];
+
+        //if had votes, then find the id with max value
+        //and second best id to compute discriminative power
+        int idPointEstim;
+        float nbVotesForId,nbVotesForSecondBest;
+        getTwoBestVotes(votesId,nbIdsTable,idPointEstim,nbVotesForId,nbVotesForSecondBest);
+
+        //add the point&id pair to output if id not already in list; if it is then need to check which one has most votes
+        if(nbVotesForId>0)
+        {
+            //ids are voted for in the whole table, get back the model and the id in the model
+            int modelEstim,idInModel;
+            toModelId(idPointEstim,modelEstim,idInModel);
+
+            int posInList=workspace.bestMatchOfId[idPointEstim];
+            if (posInList != -1)//point exist, check which one is the best
+            {
+                //votes of points stopped early are not comparable: finish them before (same best ids)
+                if(stopped)
+                {
+                    voteForPoint(p, mPoints, false, workspace);
+                    getTwoBestVotes(votesId,nbIdsTable,idPointEstim,nbVotesForId,nbVotesForSecondBest);
+                }
+                if(!workspace.matchComplete[posInList])
+                {
+                    //overwrites the votes of p, keep its counts
+                    voteForPoint(workspace.pointOfMatch[posInList], mPoints, false, workspace);
+                    int idExisting;
+                    float nbVotesExisting,nbVotesSecondExisting;
+                    getTwoBestVotes(votesId,nbIdsTable,idExisting,nbVotesExisting,nbVotesSecondExisting);
+                    matches[posInList].nbVotes=nbVotesExisting;
+                    matches[posInList].discriminativePower=nbVotesExisting-nbVotesSecondExisting;
+                    workspace.matchComplete[posInList]=1;
+                }
+                if(matches[posInList].nbVotes<nbVotesForId)//if new one better than existing one, then replace it
+                {
+                    matches[posInList].position=blobs[p].pt;
+                    matches[posInList].id=idInModel;
+                    matches[posInList].nbVotes=nbVotesForId;
+                    matches[posInList].discriminativePower=nbVotesForId-nbVotesForSecondBest;
+                    workspace.pointOfMatch[posInList]=p;
+                }
+            }
+            else
+            {
+                DetectionGH newMatch(blobs[p].pt,idInModel,nbVotesForId,nbVotesForId-nbVotesForSecondBest,modelEstim);
+                workspace.bestMatchOfId[idPointEstim]=matches.size();
+                workspace.pointOfMatch.push_back(p);
+                workspace.matchComplete.push_back(!stopped);
+                matches.push_back(newMatch);
+            }
+        }
+    }
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::saveToStream(std::ostream& os) const
+{
+    os.write((char *)&nbIds, sizeof(int));
+    for(int d=0;d<Dims;d++)
+        os.write((char *)&nbBinPerDim[d], sizeof(int));
+    os.write((char *)&poseRelMin[0], sizeof(float)); os.write((char *)&poseRelMin[1], sizeof(float));
+    os.write((char *)&poseRelMax[0], sizeof(float)); os.write((char *)&poseRelMax[1], sizeof(float));
+    for(int d=2;d<Dims;d++)
+    {
+        os.write((char *)&poseRelMin[d], sizeof(float)); os.write((char *)&poseRelMax[d], sizeof(float));
+    }
+
+    //stored id by id
+    const size_t nbCells=HashTable.size()/nbIds;
+    for(int id=0;id<nbIds;id++)
+        for(size_t c=0;c<nbCells;c++)
+            os.write((char *)&HashTable[c*nbIds + id], sizeof(BinT));
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::loadFromStream(std::istream& is)
+{
+    int nbIdsRead;
+    is.read((char *)&nbIdsRead, sizeof(int));
+    for(int d=0;d<Dims;d++)
+        is.read((char *)&nbBinPerDim[d], sizeof(int));
+    is.read((char *)&poseRelMin[0], sizeof(float)); is.read((char *)&poseRelMin[1], sizeof(float));
+    is.read((char *)&poseRelMax[0], sizeof(float)); is.read((char *)&poseRelMax[1], sizeof(float));
+    for(int d=2;d<Dims;d++)
+    {
+        is.read((char *)&poseRelMin[d], sizeof(float)); is.read((char *)&poseRelMax[d], sizeof(float));
+    }
+
+    //stream format only stores one model
+    setModelIdOffsets(std::vector<int>(1,nbIdsRead));
+    allocateTable();
+
+    const size_t nbCells=HashTable.size()/nbIds;
+    for(int id=0;id<nbIds;id++)
+        for(size_t c=0;c<nbCells;c++)
+            is.read((char *)&HashTable[c*nbIds + id], sizeof(BinT));
+    updateMaxBinVotes();
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::saveToFileStorage(cv::FileStorage& fs) const
+{
+    cv::write(fs, "nbIds", nbIds);
+    cv::write(fs, "nbBinPerDim", nbBinPerDim);
+    cv::write(fs, "poseRelMin", poseRelMin);
+    cv::write(fs, "poseRelMax", poseRelMax);
+
+    //number of ids of each model sharing the table
+    std::vector<int> nbIdsPerModel;
+    for(int m=0;m<getNbModels();m++)
+        nbIdsPerModel.push_back(getNbIdsInModel(m));
+    cv::write(fs, "nbIdsPerModel", nbIdsPerModel);
+    //the bases used for the queries have to be the ones used for training
+    cv::write(fs, "nbPtBasis", (int)nbPtBasis);
+
+    //convert array into Matrix
+    cv::Mat HTmat = cv::Mat(1, (int)HashTable.size(), cv::DataType<BinT>::type, (void*)&HashTable[0]);
+    cv::write(fs, "HTmat",HTmat);
+
+    fs.release();
+}
+
+template<int Dims, typename BinT>
+void GeometricHash<Dims,BinT>::loadFromFileStorage(cv::FileStorage& fs)
+{
+    int nbIdsRead;
+    cv::read(fs["nbIds"], nbIdsRead,0);
+    cv::read(fs["nbBinPerDim"], nbBinPerDim,Bins());
+    cv::read(fs["poseRelMin"], poseRelMin,Coords());
+    cv::read(fs["poseRelMax"], poseRelMax,Coords());
+
+    //files trained before multi model support only store one model
+    std::vector<int> nbIdsPerModel;
+    if(fs["nbIdsPerModel"].empty())
+        nbIdsPerModel.push_back(nbIdsRead);
+    else
+        fs["nbIdsPerModel"] >> nbIdsPerModel;
+
+    //files trained before it was tunable used 2 neigbors
+    int nbPtBasisRead;
+    cv::read(fs["nbPtBasis"], nbPtBasisRead, 2);
+    nbPtBasis=nbPtBasisRead;
+
+    setModelIdOffsets(nbIdsPerModel);
+    if(nbIds!=nbIdsRead)
+        throw std::runtime_error("GeometricHash::loadFromFileStorage > nbIdsPerModel does not match nbIds!");
+    allocateTable();
+
+    //convert array into Matrix
+    cv::Mat HTmat;
+    cv::read(fs["HTmat"],HTmat);
+    if(HTmat.total()!=HashTable.size() || HTmat.type()!=cv::DataType<BinT>::type)
+        throw std::runtime_error("GeometricHash::loadFromFileStorage > HTmat does not match table size!");
+
+    const BinT *buff = (const BinT*)(HTmat.data);
+    std::copy(buff, buff+HashTable.size(), HashTable.begin());
+    updateMaxBinVotes();
+
+    fs.release();
+}
+
+}
@@ -1,8 +1,10 @@
 
 #include "Landmark.hpp"
+#include "PatchKernel.hpp"
 
 #include <stdexcept>
 #include <numeric>
+#include <algorithm>
 
 #include <opencv2/core.hpp>
 #include <opencv2/calib3d.hpp>
@@ -10,80 +12,416 @@
 #include <opencv2/video.hpp>
 
 #include <iostream>
+#include <fstream>
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace thymio_tracker
 {
 
-Landmark Landmark::fromFileStorage(cv::FileStorage& fs)
+//pyramid of the template for active search
+static void buildPyramid(const cv::Mat& image, std::vector<cv::Mat>& pyramid)
+{
+    //cv::buildOpticalFlowPyramid(image, mPyramid, cv::Size(21, 21), 0);
+    //compute number of levels
+    int minDim = (image.size().height<image.size().width)?image.size().height:image.size().width;
+    int nbLevels = 0;
+    do{minDim = minDim/2;nbLevels++;}while(minDim>40);
+
+    //fill pyramid
+    pyramid.resize(nbLevels);
+    image.copyTo(pyramid[0]);
+    for(int l=1;l<nbLevels;l++)
+        cv::pyrDown( pyramid[l-1], pyramid[l], cv::Size( pyramid[l-1].cols/2, pyramid[l-1].rows/2 ) );
+}
+
+Landmark Landmark::fromFileStorage(cv::FileStorage& fs, bool loadTemplate)
 {
     cv::Mat image;
+    cv::Size imageSize;
     
     std::vector<cv::KeyPoint> keypoints;
     cv::Mat descriptors;
     // cv::Size2f realSize;
     std::vector<float> realSize;
     
-    cv::BFMatcher matcher(cv::NORM_HAMMING);
-    
     cv::read(fs["keypoints"], keypoints);
     cv::read(fs["descriptors"], descriptors);
-    // cv::read(fs["image_size"], imageSize);
+    cv::read(fs["image_size"], imageSize, cv::Size());
     cv::read(fs["real_size"], realSize);
-    cv::read(fs["image"], image);
+    //without the size, the image has to be read to know it
+    if(loadTemplate || imageSize.area() == 0)
+    {
+        cv::read(fs["image"], image);
+        if(image.empty())
+            throw std::runtime_error("Could not load image data");
+        imageSize = image.size();
+    }
 
-    if(image.empty())
-        throw std::runtime_error("Could not load image data");
-    
-    return Landmark(image, keypoints, descriptors, cv::Size2f(realSize[0], realSize[1]));
+    //files written before the backend was recorded are BRISK ones
+    std::string featureTypeName;
+    cv::read(fs["feature_type"], featureTypeName, "brisk");
+    FeatureType featureType = featureTypeFromName(featureTypeName);
+
+    if(!descriptors.empty() && (descriptors.type() != CV_8U || descriptors.cols != featureDescriptorSize(featureType)))
+    {
+        std::cerr << "Descriptors of " << descriptors.cols << " bytes in a " << featureTypeName << " landmark" << std::endl;
+        throw std::runtime_error("Landmark::fromFileStorage > descriptors do not match the feature type!");
+    }
+
+    std::vector<cv::Mat> pyramid;
+    if(loadTemplate)
+        buildPyramid(image, pyramid);
+    return Landmark(pyramid, imageSize, keypoints, descriptors, cv::Size2f(realSize[0], realSize[1]), featureType,
+                    std::shared_ptr<const void>());
+}
+
+Landmark Landmark::fromFile(const std::string& filename, bool loadTemplate)
+{
+    if(isBinaryFile(filename))
+    {
+        Landmark landmark = fromBinaryFile(filename, loadTemplate);
+        landmark.mSource = filename;
+        return landmark;
+    }
+
+    //FileStorage parses the whole document, image included, when it is opened: the template is kept
+    //since it would have to be parsed again to be loaded, only binary files are loaded lazily
+    cv::FileStorage fs(filename, cv::FileStorage::READ);
+    if(!fs.isOpened())
+    {
+        std::cerr << "Could not open " << filename << std::endl;
+        throw std::runtime_error("Marker file not found");
+    }
+    Landmark landmark = fromFileStorage(fs, true);
+    landmark.mSource = filename;
+    return landmark;
 }
 
 Landmark::Landmark(const cv::Mat& image,
                     const std::vector<cv::KeyPoint>& keypoints,
                     const cv::Mat& descriptors,
-                    const cv::Size2f& realSize)
+                    const cv::Size2f& realSize,
+                    FeatureType featureType)
     : mImage(image)
+    , mImageSize(image.size())
     , mKeypoints(keypoints)
     , mKeypointPos(keypoints.size())
     , mDescriptors(descriptors)
+    , mFeatureType(featureType)
     , mRealSize(realSize)
     , mMatcher(cv::NORM_HAMMING)
 {
-    //create iamge pyramid for active search
-    //cv::buildOpticalFlowPyramid(image, mPyramid, cv::Size(21, 21), 0);
-    //compute number of levels
-    int minDim = (mImage.size().height<mImage.size().width)?mImage.size().height:mImage.size().width;
-    int nbLevels = 0;
-    do{minDim = minDim/2;nbLevels++;}while(minDim>40);
-
-    //fill pyramid
-    mPyramid.resize(nbLevels);
-    image.copyTo(mPyramid[0]);
-    for(int l=1;l<nbLevels;l++)
-        pyrDown( mPyramid[l-1], mPyramid[l], cv::Size( mPyramid[l-1].cols/2, mPyramid[l-1].rows/2 ) );
-
+    buildPyramid(image, mPyramid);
     
     std::transform(mKeypoints.begin(), mKeypoints.end(), mKeypointPos.begin(),
         [](const cv::KeyPoint& kp){return kp.pt;});
 }
 
+Landmark::Landmark(const std::vector<cv::Mat>& pyramid,
+                    const cv::Size& imageSize,
+                    const std::vector<cv::KeyPoint>& keypoints,
+                    const cv::Mat& descriptors,
+                    const cv::Size2f& realSize,
+                    FeatureType featureType,
+                    const std::shared_ptr<const void>& storage)
+    : mImage(pyramid.empty() ? cv::Mat() : pyramid[0])
+    , mImageSize(imageSize)
+    , mPyramid(pyramid)
+    , mStorage(storage)
+    , mKeypoints(keypoints)
+    , mKeypointPos(keypoints.size())
+    , mDescriptors(descriptors)
+    , mFeatureType(featureType)
+    , mRealSize(realSize)
+    , mMatcher(cv::NORM_HAMMING)
+{
+    std::transform(mKeypoints.begin(), mKeypoints.end(), mKeypointPos.begin(),
+        [](const cv::KeyPoint& kp){return kp.pt;});
+}
+
+void Landmark::loadTemplate()
+{
+    if(isTemplateLoaded() || mSource.empty())
+        return;
+
+    //the template comes from the same file as the rest of the landmark, which is already loaded
+    if(isBinaryFile(mSource))
+    {
+        Landmark loaded = fromBinaryFile(mSource, true);
+        mImage = loaded.mImage;
+        mPyramid = loaded.mPyramid;
+        mStorage = loaded.mStorage;
+        return;
+    }
+
+    cv::FileStorage fs(mSource, cv::FileStorage::READ);
+    if(!fs.isOpened())
+    {
+        std::cerr << "Could not open " << mSource << std::endl;
+        throw std::runtime_error("Landmark::loadTemplate > Marker file not found!");
+    }
+    cv::Mat image;
+    cv::read(fs["image"], image);
+    if(image.empty())
+        throw std::runtime_error("Landmark::loadTemplate > Could not load image data!");
+    buildPyramid(image, mPyramid);
+    mImage = mPyramid[0];
+}
+
+void Landmark::releaseTemplate()
+{
+    if(!isTemplateLoaded() || mSource.empty())
+        return;
+
+    //the descriptors can point to the mapped file, they stay
+    if(mStorage && !mDescriptors.empty())
+        mDescriptors = mDescriptors.clone();
+    mImage.release();
+    mPyramid.clear();
+    mStorage.reset();
+    mAligner.clear();
+}
+
+size_t Landmark::getTemplateMemory() const
+{
+    size_t memory = 0;
+    for(auto& level : mPyramid)
+        memory += level.total()*level.elemSize();
+    return memory + mAligner.memory();
+}
+
+//layout of the binary landmark files: the header, then each section starts on a multiple of
+//binaryAlignment bytes from the start of the file. Written with the byte order of the machine which converts them.
+static const char binaryMagic[4] = {'T', 'T', 'L', 'M'};
+static const int binaryVersion = 1;
+static const int binaryAlignment = 64;
+static const int binaryMaxLevels = 16;
+
+struct BinaryLandmarkHeader
+{
+    char magic[4];
+    int version;
+    int featureType;
+    float realWidth, realHeight;
+    int nbLevels;
+    int nbKeypoints;
+    int descriptorSize;//in bytes
+    //pyramid levels, CV_8U with one row after the other
+    int levelRows[binaryMaxLevels];
+    int levelCols[binaryMaxLevels];
+    unsigned long long levelOffsets[binaryMaxLevels];
+    unsigned long long keypointsOffset;//BinaryKeypoint array
+    unsigned long long descriptorsOffset;//nbKeypoints rows of descriptorSize bytes
+    unsigned long long fileSize;
+};
+
+struct BinaryKeypoint
+{
+    float x, y, size, angle, response;
+    int octave, classId;
+};
+
+static unsigned long long alignOffset(unsigned long long offset)
+{
+    return (offset + binaryAlignment - 1)/binaryAlignment*binaryAlignment;
+}
+
+//whole file in memory, mapped when the system allows it, released with the last reference
+static std::shared_ptr<const void> mapFile(const std::string& filename, unsigned long long& size)
+{
+#if defined(_WIN32)
+    std::ifstream file(filename.c_str(), std::ios::binary | std::ios::ate);
+    if(!file)
+        return std::shared_ptr<const void>();
+    size = file.tellg();
+    char* data = new char[size];
+    file.seekg(0);
+    file.read(data, size);
+    return std::shared_ptr<const void>(data, [](const void* p){delete[] (const char*)p;});
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        return std::shared_ptr<const void>();
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return std::shared_ptr<const void>();
+    }
+    size = st.st_size;
+    //private writable mapping: the pages are read on demand and a write would only change this process' copy
+    void* data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return std::shared_ptr<const void>();
+    const size_t mappedSize = size;
+    return std::shared_ptr<const void>(data, [mappedSize](const void* p){munmap(const_cast<void*>(p), mappedSize);});
+#endif
+}
+
+bool Landmark::isBinaryFile(const std::string& filename)
+{
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    char magic[4];
+    return file.read(magic, 4) && std::equal(magic, magic+4, binaryMagic);
+}
+
+Landmark Landmark::fromBinaryFile(const std::string& filename, bool loadTemplate)
+{
+    unsigned long long fileSize = 0;
+    std::shared_ptr<const void> storage = mapFile(filename, fileSize);
+    if(!storage)
+    {
+        std::cerr << "Could not open " << filename << std::endl;
+        throw std::runtime_error("Landmark::fromBinaryFile > File not found!");
+    }
+
+    const unsigned char* data = (const unsigned char*)storage.get();
+    const BinaryLandmarkHeader& header = *(const BinaryLandmarkHeader*)data;
+    if(fileSize < sizeof(BinaryLandmarkHeader) || !std::equal(header.magic, header.magic+4, binaryMagic)
+       || header.version != binaryVersion || header.fileSize != fileSize
+       || header.nbLevels < 1 || header.nbLevels > binaryMaxLevels || header.nbKeypoints < 0
+       || header.featureType < FEATURE_BRISK || header.featureType > FEATURE_FAST_BRIEF)
+    {
+        std::cerr << filename << " is not a binary landmark file of version " << binaryVersion << std::endl;
+        throw std::runtime_error("Landmark::fromBinaryFile > wrong file format!");
+    }
+
+    FeatureType featureType = (FeatureType)header.featureType;
+    if(header.descriptorSize != featureDescriptorSize(featureType))
+        throw std::runtime_error("Landmark::fromBinaryFile > descriptors do not match the feature type!");
+
+    //sections inside the file
+    bool valid = header.keypointsOffset + (unsigned long long)header.nbKeypoints*sizeof(BinaryKeypoint) <= fileSize
+              && header.descriptorsOffset + (unsigned long long)header.nbKeypoints*header.descriptorSize <= fileSize;
+    for(int l=0;l<header.nbLevels;l++)
+        valid = valid && header.levelRows[l] > 0 && header.levelCols[l] > 0
+                && header.levelOffsets[l] + (unsigned long long)header.levelRows[l]*header.levelCols[l] <= fileSize;
+    if(!valid)
+        throw std::runtime_error("Landmark::fromBinaryFile > truncated file!");
+
+    //headers on the mapped sections, no copy
+    unsigned char* mapped = const_cast<unsigned char*>(data);
+    std::vector<cv::Mat> pyramid;
+    if(loadTemplate)
+        for(int l=0;l<header.nbLevels;l++)
+            pyramid.push_back(cv::Mat(header.levelRows[l], header.levelCols[l], CV_8U, mapped + header.levelOffsets[l]));
+    cv::Mat descriptors;
+    if(header.nbKeypoints)
+        descriptors = cv::Mat(header.nbKeypoints, header.descriptorSize, CV_8U, mapped + header.descriptorsOffset);
+    //without the template, the file is not kept mapped for the descriptors only
+    if(!loadTemplate)
+    {
+        descriptors = descriptors.clone();
+        storage.reset();
+    }
+
+    std::vector<cv::KeyPoint> keypoints(header.nbKeypoints);
+    const BinaryKeypoint* binaryKeypoints = (const BinaryKeypoint*)(data + header.keypointsOffset);
+    for(int i=0;i<header.nbKeypoints;i++)
+    {
+        const BinaryKeypoint& kp = binaryKeypoints[i];
+        keypoints[i] = cv::KeyPoint(kp.x, kp.y, kp.size, kp.angle, kp.response, kp.octave, kp.classId);
+    }
+
+    return Landmark(pyramid, cv::Size(header.levelCols[0], header.levelRows[0]), keypoints, descriptors,
+                    cv::Size2f(header.realWidth, header.realHeight), featureType, storage);
+}
+
+void Landmark::writeBinaryFile(const std::string& filename) const
+{
+    if(!isTemplateLoaded())
+        throw std::runtime_error("Landmark::writeBinaryFile > the template is not loaded!");
+    if(mImage.type() != CV_8UC1 || (int)mPyramid.size() > binaryMaxLevels)
+        throw std::runtime_error("Landmark::writeBinaryFile > only grey images with up to 16 pyramid levels!");
+
+    BinaryLandmarkHeader header;
+    memset(&header, 0, sizeof(header));
+    std::copy(binaryMagic, binaryMagic+4, header.magic);
+    header.version = binaryVersion;
+    header.featureType = mFeatureType;
+    header.realWidth = mRealSize.width;
+    header.realHeight = mRealSize.height;
+    header.nbLevels = mPyramid.size();
+    header.nbKeypoints = mKeypoints.size();
+    header.descriptorSize = mDescriptors.empty() ? featureDescriptorSize(mFeatureType) : mDescriptors.cols;
+
+    unsigned long long offset = alignOffset(sizeof(header));
+    for(int l=0;l<header.nbLevels;l++)
+    {
+        header.levelRows[l] = mPyramid[l].rows;
+        header.levelCols[l] = mPyramid[l].cols;
+        header.levelOffsets[l] = offset;
+        offset = alignOffset(offset + (unsigned long long)mPyramid[l].rows*mPyramid[l].cols);
+    }
+    header.keypointsOffset = offset;
+    offset = alignOffset(offset + mKeypoints.size()*sizeof(BinaryKeypoint));
+    header.descriptorsOffset = offset;
+    header.fileSize = offset + (unsigned long long)header.nbKeypoints*header.descriptorSize;
+
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    if(!file)
+    {
+        std::cerr << "Could not open " << filename << std::endl;
+        throw std::runtime_error("Landmark::writeBinaryFile > could not create the file!");
+    }
+
+    //padding up to the offset of the next section
+    auto padTo = [&file](unsigned long long offset){
+        while((unsigned long long)file.tellp() < offset)
+            file.put(0);
+    };
+
+    file.write((const char*)&header, sizeof(header));
+    for(int l=0;l<header.nbLevels;l++)
+    {
+        padTo(header.levelOffsets[l]);
+        for(int r=0;r<mPyramid[l].rows;r++)
+            file.write((const char*)mPyramid[l].ptr<uchar>(r), mPyramid[l].cols);
+    }
+    padTo(header.keypointsOffset);
+    for(auto& kp : mKeypoints)
+    {
+        BinaryKeypoint binaryKeypoint = {kp.pt.x, kp.pt.y, kp.size, kp.angle, kp.response, kp.octave, kp.class_id};
+        file.write((const char*)&binaryKeypoint, sizeof(binaryKeypoint));
+    }
+    padTo(header.descriptorsOffset);
+    for(int r=0;r<mDescriptors.rows;r++)
+        file.write((const char*)mDescriptors.ptr<uchar>(r), mDescriptors.cols);
+
+    if(!file)
+        throw std::runtime_error("Landmark::writeBinaryFile > could not write the file!");
+}
+
 void Landmark::find(const cv::Mat& image,
               const cv::Mat& prevImage,
               const IntrinsicCalibration& mCalibration,
               const std::vector<cv::KeyPoint>& keypoints,
-              const cv::Mat& descriptors,
+              const std::vector<DescriptorIndex::Match>& descriptorMatches,
+              const DeviceRotation* deviceRotation,
               LandmarkDetection& detection) const
 {
     std::vector<cv::Point2f> scenePoints;
     std::vector<int> correspondences;
     
-    if(detection.mCorrespondences.empty())
+    if(detection.mCorrespondenceIds.empty())
     {
-        if(!descriptors.empty())
-            this->findCorrespondencesWithKeypoints(keypoints, descriptors, scenePoints, correspondences);
+        if(!descriptorMatches.empty())
+            this->findCorrespondencesWithIndex(keypoints, descriptorMatches, scenePoints, correspondences);
     }
     else
     {
-        this->findCorrespondencesWithTracking(image, prevImage, detection, scenePoints, correspondences);
+        this->findCorrespondencesWithTracking(image, prevImage, detection, mCalibration, deviceRotation, detection.mRng, scenePoints, correspondences);
+        //the tracks are only valid for this frame
+        detection.mTrackedPoints.clear();
+        detection.mTrackedStatus.clear();
         //this->findCorrespondencesWithActiveSearch(image, detection , scenePoints, correspondences);
 
         //compute intermediate detection structure taking into account homography computed using KLT tracking
@@ -93,10 +431,10 @@ void Landmark::find(const cv::Mat& image,
         cv::Mat homography;
         std::vector<unsigned char> mask;
         if(scenePoints.size()>10)
-            detection.mHomography = cv::findHomography(objectPoints, scenePoints, CV_RANSAC, 5., mask);
+            detection.mHomography = findHomographyRansac(objectPoints, scenePoints, 5., mask, detection.mRansacWorkspace);
 
 
-        this->findCorrespondencesWithActiveSearch(image, detection , scenePoints, correspondences);
+        this->findCorrespondencesWithActiveSearch(image, detection, detection.mRng, scenePoints, correspondences);
     }
     
     std::vector<cv::Point2f> objectPoints;
@@ -110,7 +448,7 @@ void Landmark::find(const cv::Mat& image,
     std::vector<unsigned char> mask;
     //if(!scenePoints.empty())
     if(scenePoints.size()>minCorresp)
-        homography = cv::findHomography(objectPoints, scenePoints, CV_RANSAC, ransacThreshold, mask);
+        homography = findHomographyRansac(objectPoints, scenePoints, ransacThreshold, mask, detection.mRansacWorkspace);
 
 
     //need to recompute outliers as the ones from above are those from the ransac estimation without refinement
@@ -140,52 +478,118 @@ void Landmark::find(const cv::Mat& image,
     // Save homography and inliers
     detection.mHomography = homography;
     
-    detection.mCorrespondences.clear();
-    auto maskIt = mask.cbegin();
-    auto correspIt = correspondences.cbegin();
-    auto scenePointsIt = scenePoints.cbegin();
-    for(; maskIt != mask.cend(); ++maskIt, ++correspIt, ++scenePointsIt)
+    //inliers sorted by keypoint index
+    std::vector<int>& order = detection.mInlierOrder;
+    order.clear();
+    for(unsigned int i=0;i<mask.size();i++)
+        if(mask[i])
+            order.push_back(i);
+    std::stable_sort(order.begin(), order.end(),
+        [&correspondences](int a, int b){return correspondences[a] < correspondences[b];});
+
+    detection.mCorrespondenceIds.clear();
+    detection.mCorrespondencePoints.clear();
+    for(unsigned int i=0;i<order.size();i++)
     {
-        if(!*maskIt)
-            continue;
-        
         //remark: if active search finds a correspondence which already exists from tracking then it will be
         //replacing it.
-        detection.mCorrespondences[*correspIt] = *scenePointsIt;
+        if(i+1<order.size() && correspondences[order[i+1]] == correspondences[order[i]])
+            continue;
+        detection.mCorrespondenceIds.push_back(correspondences[order[i]]);
+        detection.mCorrespondencePoints.push_back(scenePoints[order[i]]);
     }
 
     //pose computation
     if(scenePoints.size()>minCorresp)
     {
-        //use standard Pnp: define model
-        std::vector<cv::Point3f> mModelPoints(4);
-        //divide everything by 2 to get half size in meter
-        mModelPoints[3] = cv::Point3f(-mRealSize.width/2., -mRealSize.height/2.,0.);
-        mModelPoints[2] = cv::Point3f(mRealSize.width/2., -mRealSize.height/2.,0.);
-        mModelPoints[1] = cv::Point3f(mRealSize.width/2., mRealSize.height/2.,0.);
-        mModelPoints[0] = cv::Point3f(-mRealSize.width/2., mRealSize.height/2.,0.);
+        estimatePose(homography, mCalibration, detection);
 
+        //compute confidence
+        detection.mConfidence = (float)scenePoints.size() / mKeypoints.size();
 
-        //project corners in image
-        std::vector<cv::Point2f> mCornersInScene;
-        cv::perspectiveTransform(getCorners(), mCornersInScene, homography);
+    }
+    else
+    {
+        detection.mConfidence = 0;
+    }
 
-        //perform pnp
-        cv::Vec3d rot_v;
-        cv::Vec3d trans_v;
-        cv::solvePnP(mModelPoints,mCornersInScene, mCalibration.cameraMatrix, mCalibration.distCoeffs,rot_v,trans_v);
-        detection.mPose = cv::Affine3d(rot_v,trans_v);
+}
 
+void Landmark::estimatePose(const cv::Mat& homography,
+                            const IntrinsicCalibration& mCalibration,
+                            LandmarkDetection& detection) const
+{
+    //use standard Pnp: define model
+    std::vector<cv::Point3f> mModelPoints(4);
+    //divide everything by 2 to get half size in meter
+    mModelPoints[3] = cv::Point3f(-mRealSize.width/2., -mRealSize.height/2.,0.);
+    mModelPoints[2] = cv::Point3f(mRealSize.width/2., -mRealSize.height/2.,0.);
+    mModelPoints[1] = cv::Point3f(mRealSize.width/2., mRealSize.height/2.,0.);
+    mModelPoints[0] = cv::Point3f(-mRealSize.width/2., mRealSize.height/2.,0.);
+
+
+    //project corners in image
+    std::vector<cv::Point2f> mCornersInScene;
+    cv::perspectiveTransform(getCorners(), mCornersInScene, homography);
+
+    //perform pnp
+    cv::Vec3d rot_v;
+    cv::Vec3d trans_v;
+    cv::solvePnP(mModelPoints,mCornersInScene, mCalibration.cameraMatrix, mCalibration.distCoeffs,rot_v,trans_v);
+    detection.mPose = cv::Affine3d(rot_v,trans_v);
+}
 
-        //compute confidence
-        detection.mConfidence = (float)scenePoints.size() / mKeypoints.size();
+void Landmark::prepareAlignment()
+{
+    if(isTemplateLoaded() && mAligner.empty())
+        mAligner.build(mPyramid);
+}
 
+bool Landmark::track(const std::vector<cv::Mat>& imagePyramid,
+                     const IntrinsicCalibration& mCalibration,
+                     LandmarkDetection& detection) const
+{
+    //under it the template is not where the alignment converged
+    const float minScore = 0.7f;
+
+    //levels of the LK pyramid, without its derivatives
+    std::vector<cv::Mat>& imageLevels = detection.mAlignmentWorkspace.imageLevels;
+    imageLevels.clear();
+    for(unsigned int l=0;l<imagePyramid.size();l+=2)
+        imageLevels.push_back(imagePyramid[l]);
+
+    float score = -1.f;
+    cv::Matx33d homography;
+    if(!detection.mHomography.empty() && !imageLevels.empty())
+    {
+        homography = cv::Matx33d(detection.mHomography);
+        score = mAligner.align(imageLevels, homography, detection.mAlignmentWorkspace);
     }
-    else
+
+    detection.mCorrespondenceIds.clear();
+    detection.mCorrespondencePoints.clear();
+    if(score < minScore)
     {
+        detection.mHomography = cv::Mat();
         detection.mConfidence = 0;
+        return false;
     }
+    detection.mHomography = cv::Mat(homography);
+
+    //the keypoints which are in the image are the correspondences, for the calibration and the display
+    std::vector<cv::Point2f> projectedPoints;
+    cv::perspectiveTransform(mKeypointPos, projectedPoints, detection.mHomography);
+    const cv::Rect_<float> imageRect(0.f, 0.f, imageLevels[0].cols, imageLevels[0].rows);
+    for(unsigned int i=0;i<projectedPoints.size();i++)
+        if(imageRect.contains(projectedPoints[i]))
+        {
+            detection.mCorrespondenceIds.push_back(i);
+            detection.mCorrespondencePoints.push_back(projectedPoints[i]);
+        }
 
+    estimatePose(detection.mHomography, mCalibration, detection);
+    detection.mConfidence = score;
+    return true;
 }
 
 void Landmark::findCorrespondencesWithKeypoints(const std::vector<cv::KeyPoint>& keypoints,
@@ -212,16 +616,43 @@ void Landmark::findCorrespondencesWithKeypoints(const std::vector<cv::KeyPoint>&
     }
 }
 
+void Landmark::findCorrespondencesWithIndex(const std::vector<cv::KeyPoint>& keypoints,
+                                const std::vector<DescriptorIndex::Match>& descriptorMatches,
+                                std::vector<cv::Point2f>& scenePoints,
+                                std::vector<int>& correspondences) const
+{
+    // Keep only significant matches
+    for(auto match : descriptorMatches)
+    {
+        if(match.distance < 0.75 * match.secondDistance)
+        {
+            correspondences.push_back(match.trainIdx);
+            scenePoints.push_back(keypoints[match.queryIdx].pt);
+        }
+    }
+}
+
+//random permutation (Fisher-Yates) drawn from rng
+static void shuffleIndexes(std::vector<int>& indexes, cv::RNG& rng)
+{
+    for(int i=(int)indexes.size()-1;i>0;i--)
+        std::swap(indexes[i], indexes[rng.uniform(0, i+1)]);
+}
+
 void Landmark::findCorrespondencesWithActiveSearch(const cv::Mat& image,
                                 const LandmarkDetection& prevDetection,
+                                cv::RNG& rng,
                                 std::vector<cv::Point2f>& scenePoints,
                                 std::vector<int>& correspondences) const
 {
 
+    if(prevDetection.mHomography.empty())
+        return;
+
     //project all the keypoints using previous homography, 
     //fill patches 9x9 patches using template warped over current image
     //search for the patches in current image and 16x16 window
-    int patch_size = 9;
+    int patch_size = nccPatchSize;
     int window_size = 16;
 
     int half_window_size = window_size/2;
@@ -231,89 +662,52 @@ void Landmark::findCorrespondencesWithActiveSearch(const cv::Mat& image,
     //so that after a few frames, all features will be covered and shift free
     std::vector<int> myIndexes;
     for (unsigned int i=0; i<mKeypointPos.size(); i++) myIndexes.push_back(i);
-    std::random_shuffle ( myIndexes.begin(), myIndexes.end() );
+    shuffleIndexes(myIndexes, rng);
 
     unsigned int nbKeypointsCoveredPerFrame = 25;
-    for(unsigned int i = 0; i < nbKeypointsCoveredPerFrame && i < myIndexes.size(); i++)
-    {
-        int kpIndex = myIndexes[i];
-        cv::Point2f p = mKeypointPos[kpIndex];
-        //for each keypoint in template, define reference points to warp using homography
-        //and get corresponding affine transformation
-        std::vector<cv::Point2f> templateFramePoints;
-        templateFramePoints.push_back(p);
-        templateFramePoints.push_back(cv::Point2f(p.x+1.,p.y));
-        templateFramePoints.push_back(cv::Point2f(p.x,p.y+1.));
-
-        //transform this frame using previous homography
-        std::vector<cv::Point2f> sceneFramePoints;
-        cv::perspectiveTransform(templateFramePoints,sceneFramePoints,prevDetection.mHomography);
-
-        //find affine transformation from template to scene frame
-        cv::Mat mAffine = cv::getAffineTransform(templateFramePoints,sceneFramePoints);
-
-        //need to map to patch not current frame
-        mAffine.at<double>(0,2) += half_patch_size - sceneFramePoints[0].x;
-        mAffine.at<double>(1,2) += half_patch_size - sceneFramePoints[0].y;
-
-        //fill patch using template info
-        //cv::Mat patchCurr = cv::Mat::zeros( patch_size, patch_size, mImage.type() );
-        //cv::warpAffine( mImage, patchCurr, mAffine, patchCurr.size() );
-
-        //check determinant of affine transformation to know which model resolution to use
-        float detTransfo = cv::determinant(mAffine(cv::Rect(0,0,2,2)));
-        //compute corresponding pyramid level
-        unsigned int levPyr = std::min(size_t(std::max(int(log(1./detTransfo)/log(2)), 0)), mPyramid.size()-1);
-
-        //change the transformation to transform coordinates of the cooresponding model resolution
-        float rescalePyr = pow(2,levPyr);
-        mAffine(cv::Rect(0,0,2,2)) *= rescalePyr; 
-        //fill patch using template info
-        cv::Mat patchCurr = cv::Mat::zeros( patch_size, patch_size, mImage.type() );
-        cv::warpAffine( mPyramid[levPyr], patchCurr, mAffine, patchCurr.size() );
-            
+    myIndexes.resize(std::min((size_t)nbKeypointsCoveredPerFrame, myIndexes.size()));
+
+    //warp the patches of all these keypoints at once
+    std::vector<cv::Point2f> templatePoints;
+    for(int kpIndex : myIndexes)
+        templatePoints.push_back(mKeypointPos[kpIndex]);
+    std::vector<WarpedPatch> patches;
+    warpPatches(mPyramid, cv::Matx33d(prevDetection.mHomography), templatePoints, patches);
+
+    for(unsigned int i = 0; i < myIndexes.size(); i++)
+    {
+        const WarpedPatch& patch = patches[i];
+        const cv::Point2f& center = patch.center;
 
         //search for it in current image
-        //cv::Rect myROI(sceneFramePoints[0].x-half_patch_size-half_window_size,sceneFramePoints[0].y-half_patch_size-half_window_size,
-        //                window_size+patch_size-1,window_size+patch_size-1);//region of interest is around current position of point
-        //cv::Mat resultNCC = cv::Mat::zeros( window_size, window_size, CV_32FC1 );
         //Problem when point is on border with previous code
         int margin = half_patch_size+half_window_size;
-        if(sceneFramePoints[0].x < -margin || sceneFramePoints[0].y < -margin 
-            || sceneFramePoints[0].x > image.size().width+margin || sceneFramePoints[0].y > image.size().height+margin )
+        if(center.x < -margin || center.y < -margin 
+            || center.x > image.size().width+margin || center.y > image.size().height+margin )
             continue;
 
-        int myRoi_l = sceneFramePoints[0].x-half_patch_size-half_window_size; myRoi_l = (myRoi_l<0)?0:myRoi_l;
-        int myRoi_t = sceneFramePoints[0].y-half_patch_size-half_window_size; myRoi_t = (myRoi_t<0)?0:myRoi_t;
-        int myRoi_r = sceneFramePoints[0].x+half_patch_size+half_window_size; myRoi_r = (myRoi_r>image.size().width)?image.size().width:myRoi_r;
-        int myRoi_d = sceneFramePoints[0].y+half_patch_size+half_window_size; myRoi_d = (myRoi_d>image.size().height)?image.size().height:myRoi_d;       
-
-        cv::Rect myROI(myRoi_l,myRoi_t,myRoi_r-myRoi_l,myRoi_d-myRoi_t);//region of interest is around current position of point
+        int myRoi_l = center.x-half_patch_size-half_window_size; myRoi_l = (myRoi_l<0)?0:myRoi_l;
+        int myRoi_t = center.y-half_patch_size-half_window_size; myRoi_t = (myRoi_t<0)?0:myRoi_t;
+        int myRoi_r = center.x+half_patch_size+half_window_size; myRoi_r = (myRoi_r>image.size().width)?image.size().width:myRoi_r;
+        int myRoi_d = center.y+half_patch_size+half_window_size; myRoi_d = (myRoi_d>image.size().height)?image.size().height:myRoi_d;       
 
         //verify that the search region is valid
-        int result_cols = myROI.size().width - patch_size + 1;
-        int result_rows = myROI.size().height - patch_size + 1;
+        int result_cols = myRoi_r - myRoi_l - patch_size + 1;
+        int result_rows = myRoi_d - myRoi_t - patch_size + 1;
 
         if(result_cols > half_window_size && result_rows > half_window_size)
         {
-            cv::Mat resultNCC = cv::Mat::zeros( result_rows, result_cols, CV_32FC1 );
-
-            cv::matchTemplate( image(myROI), patchCurr, resultNCC, CV_TM_CCORR_NORMED );
-            //cv::normalize( resultNCC, resultNCC, 0, 1, cv::NORM_MINMAX, -1, cv::Mat() );
-
-            /// Localizing the best match with minMaxLoc searching for max NCC
-            double minVal; double maxVal; cv::Point minLoc; cv::Point maxLoc;
-            cv::minMaxLoc( resultNCC, &minVal, &maxVal, &minLoc, &maxLoc, cv::Mat() );
-            //std::cout<<maxVal<<std::endl;
+            //best NCC among the positions of the patch in the region
+            cv::Point maxLoc;
+            float maxVal = searchPatch(image, cv::Rect(myRoi_l, myRoi_t, result_cols, result_rows), patch, maxLoc);
 
             if(maxVal>0.9)
             {
                 //have location in window=> get corresponding position in image
-                //cv::Point2f estPos =  cv::Point2f(maxLoc)+sceneFramePoints[0]+cv::Point2f(-half_window_size,-half_window_size);
-                cv::Point2f estPos =  cv::Point2f(maxLoc)+cv::Point2f(myRoi_l+half_patch_size,myRoi_t+half_patch_size);
+                cv::Point2f estPos =  cv::Point2f(maxLoc)+cv::Point2f(half_patch_size,half_patch_size);
                 
                 //add it to list of matches
-                correspondences.push_back(kpIndex);
+                correspondences.push_back(myIndexes[i]);
                 scenePoints.push_back(estPos);
             }
         }
@@ -322,59 +716,166 @@ void Landmark::findCorrespondencesWithActiveSearch(const cv::Mat& image,
 
 }
 
+//LK parameters of the landmark tracking
+static const cv::Size trackingWinSize(21, 21);
+static const int trackingMaxLevel = 3;
+
+static void trackPoints(cv::InputArray image,
+                        cv::InputArray prevImage,
+                        const IntrinsicCalibration& mCalibration,
+                        const DeviceRotation* deviceRotation,
+                        const std::vector<cv::Point2f>& prevPoints,
+                        std::vector<cv::Point2f>& nextPoints,
+                        std::vector<unsigned char>& status)
+{
+    // Optical flow
+    int maxLevel = trackingMaxLevel;
+    int flags = 0;
+
+    //if the IMU gives the rotation of the camera, start from the displacement it induces
+    //only the part due to the translation of the camera is left to LK => less pyramid levels needed
+    if(deviceRotation && deviceRotation->hasInterFrame)
+    {
+        nextPoints.resize(prevPoints.size());
+        for(unsigned int i=0;i<prevPoints.size();i++)
+            nextPoints[i] = rotatePixel(mCalibration.cameraMatrix, deviceRotation->interFrame, prevPoints[i]);
+        maxLevel = 2;
+        flags = cv::OPTFLOW_USE_INITIAL_FLOW;
+    }
+
+    const cv::TermCriteria criteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS, 20, 0.1);
+    cv::calcOpticalFlowPyrLK(prevImage, image, prevPoints, nextPoints, status,
+                            cv::noArray(), trackingWinSize, maxLevel,
+                            criteria, flags, 0.001);
+    if(!(flags & cv::OPTFLOW_USE_INITIAL_FLOW))
+        return;
+
+    //the rotation of the IMU is not checked against the images (wrong axes mapping, timestamps...):
+    //if most of the points are lost with it, track the lost ones again from their previous position
+    std::vector<unsigned int> lost;
+    for(unsigned int i=0;i<status.size();i++)
+        if(!status[i])
+            lost.push_back(i);
+    if(lost.size()*2 <= status.size())
+        return;
+
+    std::vector<cv::Point2f> lostPoints(lost.size()), lostNextPoints;
+    std::vector<unsigned char> lostStatus;
+    for(unsigned int i=0;i<lost.size();i++)
+        lostPoints[i] = prevPoints[lost[i]];
+    cv::calcOpticalFlowPyrLK(prevImage, image, lostPoints, lostNextPoints, lostStatus,
+                            cv::noArray(), trackingWinSize, trackingMaxLevel,
+                            criteria, 0, 0.001);
+    for(unsigned int i=0;i<lost.size();i++)
+        if(lostStatus[i])
+        {
+            nextPoints[lost[i]] = lostNextPoints[i];
+            status[lost[i]] = 1;
+        }
+}
+
+void Landmark::trackingPyramid(const cv::Mat& image, std::vector<cv::Mat>& pyramid)
+{
+    //level 0 is a copy, the pyramid is kept after the image is released
+    cv::buildOpticalFlowPyramid(image, pyramid, trackingWinSize, trackingMaxLevel, true,
+                                cv::BORDER_REFLECT_101, cv::BORDER_CONSTANT, false);
+}
+
+void Landmark::trackCorrespondences(cv::InputArray image,
+                                cv::InputArray prevImage,
+                                const IntrinsicCalibration& mCalibration,
+                                const DeviceRotation* deviceRotation,
+                                std::vector<LandmarkDetection>& detections)
+{
+    //gather the previous positions of the correspondences of all the tracked landmarks
+    std::vector<cv::Point2f> prevPoints;
+    std::vector<unsigned int> firstPoint(detections.size()+1, 0);
+    for(unsigned int d=0;d<detections.size();d++)
+    {
+        const std::vector<cv::Point2f>& points = detections[d].mCorrespondencePoints;
+        prevPoints.insert(prevPoints.end(), points.begin(), points.end());
+        firstPoint[d+1] = prevPoints.size();
+    }
+
+    for(auto& detection : detections)
+    {
+        detection.mTrackedPoints.clear();
+        detection.mTrackedStatus.clear();
+    }
+    if(prevPoints.empty())
+        return;
+
+    std::vector<cv::Point2f> nextPoints;
+    std::vector<unsigned char> status;
+    trackPoints(image, prevImage, mCalibration, deviceRotation, prevPoints, nextPoints, status);
+
+    //scatter the tracks back to their landmark
+    for(unsigned int d=0;d<detections.size();d++)
+    {
+        detections[d].mTrackedPoints.assign(nextPoints.begin()+firstPoint[d], nextPoints.begin()+firstPoint[d+1]);
+        detections[d].mTrackedStatus.assign(status.begin()+firstPoint[d], status.begin()+firstPoint[d+1]);
+    }
+}
+
 void Landmark::findCorrespondencesWithTracking(const cv::Mat& image,
                                 const cv::Mat& prevImage,
                                 const LandmarkDetection& prevDetection,
+                                const IntrinsicCalibration& mCalibration,
+                                const DeviceRotation* deviceRotation,
+                                cv::RNG& rng,
                                 std::vector<cv::Point2f>& scenePoints,
                                 std::vector<int>& correspondences) const
 {
-    if(prevImage.empty() || prevDetection.mCorrespondences.empty())
+    if(prevImage.empty() || prevDetection.mCorrespondenceIds.empty())
         return;
     
-    // Get positions of keypoints in previous frame
-    std::vector<cv::Point2f> prevPoints;
-    for(auto p : prevDetection.mCorrespondences)
-        prevPoints.push_back(p.second);
-    
-    // Optical flow
-    int maxLevel = 3;
-    const cv::Size winSize = cv::Size(21, 21);
-    std::vector<cv::Point2f> nextPoints;
-    std::vector<unsigned char> status;
-    cv::calcOpticalFlowPyrLK(prevImage, image, prevPoints, nextPoints, status,
-                            cv::noArray(), winSize, maxLevel,
-                            cv::TermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS, 20, 0.1),
-                            0,
-                            0.001);
+    //tracks from the batch step if there are, else LK for this landmark alone
+    std::vector<cv::Point2f> ownNextPoints;
+    std::vector<unsigned char> ownStatus;
+    const bool batchTracked = prevDetection.mTrackedPoints.size() == prevDetection.mCorrespondenceIds.size();
+    if(!batchTracked)
+        trackPoints(image, prevImage, mCalibration, deviceRotation, prevDetection.mCorrespondencePoints, ownNextPoints, ownStatus);
+    const std::vector<cv::Point2f>& nextPoints = batchTracked ? prevDetection.mTrackedPoints : ownNextPoints;
+    const std::vector<unsigned char>& status = batchTracked ? prevDetection.mTrackedStatus : ownStatus;
     
     // Keep only found keypoints
     /*auto statusIt = status.cbegin();
     auto nextPointsIt = nextPoints.cbegin();
-    auto correspIt = prevDetection.mCorrespondences.cbegin();
+    auto correspIt = prevDetection.mCorrespondenceIds.cbegin();
     for(; statusIt != status.cend(); ++statusIt, ++nextPointsIt, ++correspIt)
     {
         if(!*statusIt)
             continue;
         
         scenePoints.push_back(*nextPointsIt);
-        correspondences.push_back(correspIt->first);
+        correspondences.push_back(*correspIt);
     }*/
 
     //pick up random subset of tracked features and do sanity check based on NCC
     auto statusIt = status.cbegin();
     auto nextPointsIt = nextPoints.cbegin();
-    auto correspIt = prevDetection.mCorrespondences.cbegin();
+    auto correspIt = prevDetection.mCorrespondenceIds.cbegin();
 
     //random selection of points
     int nbTracksChecked = 50;
     float NCCvalid = 0.9;
     std::vector<int> myIndexes;
     for (unsigned int i=0; i<nextPoints.size(); i++) myIndexes.push_back(i);
-    std::random_shuffle ( myIndexes.begin(), myIndexes.end() );
+    shuffleIndexes(myIndexes, rng);
     auto indexIt = myIndexes.cbegin();
 
-    int patch_size = 9;
+    int patch_size = nccPatchSize;
     int half_patch_size = (patch_size-1)/2;
+
+    //warp the patches of all the checked tracks at once
+    std::vector<cv::Point2f> templatePoints;
+    for(unsigned int i=0; i<status.size(); i++)
+        if(status[i] && myIndexes[i]<=nbTracksChecked)
+            templatePoints.push_back(mKeypointPos[prevDetection.mCorrespondenceIds[i]]);
+    std::vector<WarpedPatch> patches;
+    warpPatches(mPyramid, cv::Matx33d(prevDetection.mHomography), templatePoints, patches);
+    auto patchIt = patches.cbegin();
+
     for(; statusIt != status.cend(); ++statusIt, ++nextPointsIt, ++correspIt, ++indexIt)
     {
         if(!*statusIt)
@@ -384,50 +885,16 @@ void Landmark::findCorrespondencesWithTracking(const cv::Mat& image,
         {        
             //portion of tarcks that we don't check => just add them
             scenePoints.push_back(*nextPointsIt);
-            correspondences.push_back(correspIt->first);
+            correspondences.push_back(*correspIt);
         }
         else
         {
-            int kpIndex = correspIt->first;
-            cv::Point2f p = mKeypointPos[kpIndex];
-            //approximate the homography with an affine transformation
-            //for each keypoint in template, define reference points to warp using homography
-            //and get corresponding affine transformation
-            std::vector<cv::Point2f> templateFramePoints;
-            templateFramePoints.push_back(p);
-            templateFramePoints.push_back(cv::Point2f(p.x+1.,p.y));
-            templateFramePoints.push_back(cv::Point2f(p.x,p.y+1.));
-
-            //transform this frame using previous homography
-            std::vector<cv::Point2f> sceneFramePoints;
-            cv::perspectiveTransform(templateFramePoints,sceneFramePoints,prevDetection.mHomography);
-
-            //find affine transformation from template to scene frame
-            cv::Mat mAffine = cv::getAffineTransform(templateFramePoints,sceneFramePoints);
-            //need to map to patch not current frame
-            mAffine.at<double>(0,2) += half_patch_size - sceneFramePoints[0].x;
-            mAffine.at<double>(1,2) += half_patch_size - sceneFramePoints[0].y;
-
-            //fill patch using template info
-            //cv::Mat patchCurr = cv::Mat::zeros( patch_size, patch_size, mImage.type() );
-            //cv::warpAffine( mImage, patchCurr, mAffine, patchCurr.size() );
-
-            //check determinant of affine transformation to know which model resolution to use
-            float detTransfo = cv::determinant(mAffine(cv::Rect(0,0,2,2)));
-            //compute corresponding pyramid level
-            unsigned int levPyr = std::min(size_t(std::max(int(log(1./detTransfo)/log(2)), 0)), mPyramid.size()-1);
-
-            //change the transformation to transform coordinates of the cooresponding model resolution
-            float rescalePyr = pow(2,levPyr);
-            mAffine(cv::Rect(0,0,2,2)) *= rescalePyr; 
-            //fill patch using template info
-            cv::Mat patchCurr = cv::Mat::zeros( patch_size, patch_size, mImage.type() );
-            cv::warpAffine( mPyramid[levPyr], patchCurr, mAffine, patchCurr.size() );
+            const WarpedPatch& patch = *patchIt++;
             
             //and now just need to compare it with patch from current image centered on track
             int margin = half_patch_size;
-            if(sceneFramePoints[0].x < -margin || sceneFramePoints[0].y < -margin 
-                || sceneFramePoints[0].x > image.size().width+margin || sceneFramePoints[0].y > image.size().height+margin )
+            if(patch.center.x < -margin || patch.center.y < -margin 
+                || patch.center.x > image.size().width+margin || patch.center.y > image.size().height+margin )
                 continue;
 
             int myRoi_l = nextPointsIt->x-half_patch_size; myRoi_l = (myRoi_l<0)?0:myRoi_l;
@@ -435,21 +902,13 @@ void Landmark::findCorrespondencesWithTracking(const cv::Mat& image,
             int myRoi_r = nextPointsIt->x+half_patch_size+1; myRoi_r = (myRoi_r>image.size().width)?image.size().width:myRoi_r;
             int myRoi_d = nextPointsIt->y+half_patch_size+1; myRoi_d = (myRoi_d>image.size().height)?image.size().height:myRoi_d;       
 
-            cv::Rect myROI(myRoi_l,myRoi_t,myRoi_r-myRoi_l,myRoi_d-myRoi_t);//region of interest is around current position of point
-
-            //verify that the search region is valid (here should have size of 1x1)
-            int result_cols = myROI.size().height - patch_size + 1;
-            int result_rows = myROI.size().width - patch_size + 1;
-
-            //if track not on border of image then result should be 1x1
-            if(result_cols > 0 && result_rows > 0)
+            //if track not on border of image then the patch fits in the region around the current position of the point
+            if(myRoi_r - myRoi_l >= patch_size && myRoi_d - myRoi_t >= patch_size)
             {
-                cv::Mat resultNCC = cv::Mat::zeros( result_cols, result_rows, CV_32FC1 );
-                cv::matchTemplate( image(myROI), patchCurr, resultNCC, CV_TM_CCORR_NORMED );
-                if(resultNCC.at<float>(0,0)>NCCvalid)
+                if(patchNcc(image, myRoi_l, myRoi_t, patch)>NCCvalid)
                 {
                     scenePoints.push_back(*nextPointsIt);
-                    correspondences.push_back(correspIt->first);                    
+                    correspondences.push_back(*correspIt);                    
                 }
 
             }
@@ -492,7 +951,7 @@ std::vector<cv::Point2f> Landmark::getCorners() const
 {
     std::vector<cv::Point2f> res(4);
     
-    const cv::Size size = mImage.size();
+    const cv::Size size = mImageSize;
     
     res[0] = cv::Point2f(0, 0);
     res[1] = cv::Point2f(size.width, 0);
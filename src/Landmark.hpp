@@ -5,47 +5,132 @@
 #include <opencv2/features2d.hpp>
 #include <opencv2/calib3d.hpp>
 
-#include <map>
+#include <memory>
+#include <string>
+
 #include "Generic.hpp"
+#include "Ransac.hpp"
+#include "DescriptorIndex.hpp"
+#include "FeatureBackend.hpp"
+#include "TemplateAlignment.hpp"
 
 namespace thymio_tracker
 {
 
 class LandmarkDetection;
 
+//read only view of the correspondences of a detection, stored as parallel arrays sorted by keypoint index
+class CorrespondenceView
+{
+public:
+    CorrespondenceView(const std::vector<int>& ids, const std::vector<cv::Point2f>& points)
+        : mIds(ids), mPoints(points) {}
+
+    unsigned int size() const {return mIds.size();}
+    bool empty() const {return mIds.empty();}
+
+    //index of the keypoint in the landmark and its position in the image
+    int id(unsigned int i) const {return mIds[i];}
+    const cv::Point2f& point(unsigned int i) const {return mPoints[i];}
+
+    const std::vector<int>& ids() const {return mIds;}
+    const std::vector<cv::Point2f>& points() const {return mPoints;}
+
+private:
+    const std::vector<int>& mIds;
+    const std::vector<cv::Point2f>& mPoints;
+};
+
 class Landmark
 {
 public:
-    static Landmark fromFileStorage(cv::FileStorage& fs);
+    //loadTemplate: if false, only the keypoints and descriptors are loaded, the template image and its pyramid
+    //are not needed until the landmark has been found
+    static Landmark fromFileStorage(cv::FileStorage& fs, bool loadTemplate = true);
+
+    //binary landmark files: the template pyramid, keypoints and descriptors in aligned sections which are
+    //used in place from the mapped file, nothing is decoded nor built at load
+    static bool isBinaryFile(const std::string& filename);
+    static Landmark fromBinaryFile(const std::string& filename, bool loadTemplate = true);
+    void writeBinaryFile(const std::string& filename) const;
+
+    //binary or FileStorage file, which is kept as the source of the template: it can then be loaded
+    //and released as needed. loadTemplate only applies to binary files, FileStorage parses the template
+    //with the rest of the document so it is always loaded from them
+    static Landmark fromFile(const std::string& filename, bool loadTemplate = true);
+    bool isTemplateLoaded() const {return !mPyramid.empty();}
+    void loadTemplate();
+    //only if it can be loaded again from the source file
+    void releaseTemplate();
+    //bytes of the pyramid and of the alignment samples
+    size_t getTemplateMemory() const;
     
     Landmark(const cv::Mat& image,
              const std::vector<cv::KeyPoint>& keypoints,
              const cv::Mat& descriptors,
-             const cv::Size2f& realSize);
+             const cv::Size2f& realSize,
+             FeatureType featureType = FEATURE_BRISK);
     
+    //deviceRotation: orientation from the IMU if available, used to predict the motion of the tracked features
+    //descriptorMatches: matches of the descriptors of keypoints to this landmark from the index of all the landmarks
     void find(const cv::Mat& image,
               const cv::Mat& prevImage,
               const IntrinsicCalibration& mCalibration,
               const std::vector<cv::KeyPoint>& keypoints,
-              const cv::Mat& descriptors,
+              const std::vector<DescriptorIndex::Match>& descriptorMatches,
+              const DeviceRotation* deviceRotation,
               LandmarkDetection& detection) const;
     
     void findCorrespondencesWithKeypoints(const std::vector<cv::KeyPoint>& keypoints,
                                 const cv::Mat& descriptors,
                                 std::vector<cv::Point2f>& scene_points,
                                 std::vector<int>& correspondences) const;
+
+    //same with the matches found by the index, the ratio test is applied here
+    void findCorrespondencesWithIndex(const std::vector<cv::KeyPoint>& keypoints,
+                                const std::vector<DescriptorIndex::Match>& descriptorMatches,
+                                std::vector<cv::Point2f>& scene_points,
+                                std::vector<int>& correspondences) const;
     
+    //rng: draws the keypoints which are searched for
     void findCorrespondencesWithActiveSearch(const cv::Mat& image,
                                 const LandmarkDetection& prevDetection,
+                                cv::RNG& rng,
                                 std::vector<cv::Point2f>& scene_points,
                                 std::vector<int>& correspondences) const;
     
+    //if the rotation of the camera is known, LK starts from the motion it induces
+    //rng: draws the tracks which are verified
     void findCorrespondencesWithTracking(const cv::Mat& image,
                                 const cv::Mat& prevImage,
                                 const LandmarkDetection& prevDetection,
+                                const IntrinsicCalibration& mCalibration,
+                                const DeviceRotation* deviceRotation,
+                                cv::RNG& rng,
                                 std::vector<cv::Point2f>& scene_points,
                                 std::vector<int>& correspondences) const;
     
+    //track the correspondences of all the detections in a single LK call on shared pyramids,
+    //image and prevImage can be images or pyramids from trackingPyramid. The tracks are kept in each
+    //detection and used by its next call to find instead of running LK for this landmark alone
+    static void trackCorrespondences(cv::InputArray image,
+                                cv::InputArray prevImage,
+                                const IntrinsicCalibration& mCalibration,
+                                const DeviceRotation* deviceRotation,
+                                std::vector<LandmarkDetection>& detections);
+
+    //pyramid of an image with the LK parameters of the tracking, to be shared by trackCorrespondences between frames
+    static void trackingPyramid(const cv::Mat& image, std::vector<cv::Mat>& pyramid);
+
+    //direct tracking of a found landmark: its template is aligned to the image from the previous homography
+    //instead of tracking and matching keypoints. prepareAlignment has to be called once the template is loaded.
+    //imagePyramid: from trackingPyramid. Returns false if the landmark is lost
+    void prepareAlignment();
+    bool isAlignmentPrepared() const {return !mAligner.empty();}
+    bool track(const std::vector<cv::Mat>& imagePyramid,
+               const IntrinsicCalibration& mCalibration,
+               LandmarkDetection& detection) const;
+    
     cv::Mat findHomography(const std::vector<cv::KeyPoint>& keypoints,
                             const cv::Mat& descriptors) const;
     
@@ -53,16 +138,42 @@ public:
     std::vector<cv::Point2f> getCorners() const;
 
     inline const cv::Size2f getRealSize() const {return mRealSize;};
-    inline const cv::Mat& getImage() const {return mImage;}
+    inline const cv::Mat& getImage() const {return mImage;}//empty if the template is not loaded
+    inline const cv::Size& getImageSize() const {return mImageSize;}
+    inline const cv::Mat& getDescriptors() const {return mDescriptors;}
+    //the images have to be described with the same backend to be matched with the landmark
+    inline FeatureType getFeatureType() const {return mFeatureType;}
     const std::vector<cv::Point2f>& getKeypointPos() const {return mKeypointPos;}
     
 private:
+    //pose from the corners projected with the homography
+    void estimatePose(const cv::Mat& homography,
+                      const IntrinsicCalibration& mCalibration,
+                      LandmarkDetection& detection) const;
+
+    //landmark with its pyramid already built, its levels can point to storage
+    Landmark(const std::vector<cv::Mat>& pyramid,
+             const cv::Size& imageSize,
+             const std::vector<cv::KeyPoint>& keypoints,
+             const cv::Mat& descriptors,
+             const cv::Size2f& realSize,
+             FeatureType featureType,
+             const std::shared_ptr<const void>& storage);
+
     cv::Mat mImage;
+    cv::Size mImageSize;//known even if the template is not loaded
     std::vector<cv::Mat> mPyramid;
+    //mapped file the pyramid and the descriptors point to, if loaded from a binary file
+    std::shared_ptr<const void> mStorage;
+    //file the template is loaded from when needed, empty if the landmark does not come from a file
+    std::string mSource;
+    //samples of the template for direct tracking, built from the pyramid when needed
+    TemplateAligner mAligner;
     
     std::vector<cv::KeyPoint> mKeypoints;
     std::vector<cv::Point2f> mKeypointPos;
     cv::Mat mDescriptors;
+    FeatureType mFeatureType;
     cv::Size2f mRealSize;//in m
     
     cv::BFMatcher mMatcher;
@@ -73,11 +184,13 @@ class LandmarkDetection
     friend class Landmark;
     
 public:
-    LandmarkDetection(){}
+    //each landmark draws its samples from its own generator, so that the landmarks can be processed
+    //in any order or in parallel with the same results
+    LandmarkDetection(int landmarkIndex = 0) : mRng(0x1a4d + landmarkIndex) {}
     
     const cv::Mat& getHomography() const {return mHomography;}
     const cv::Affine3d& getPose() const {return mPose;}
-    const std::map<int, cv::Point2f>& getCorrespondences() const {return mCorrespondences;}
+    CorrespondenceView getCorrespondences() const {return CorrespondenceView(mCorrespondenceIds, mCorrespondencePoints);}
     bool isFound() const {return !mHomography.empty();}
     float getConfidence()const {return mConfidence;};
     
@@ -86,8 +199,23 @@ private:
     cv::Mat mHomography;
     cv::Affine3d mPose;
     
-    std::map<int, cv::Point2f> mCorrespondences;
+    //keypoint indexes in the landmark, sorted, and positions in the image
+    std::vector<int> mCorrespondenceIds;
+    std::vector<cv::Point2f> mCorrespondencePoints;
     // std::vector<cv::Point2f> mInliers;
+
+    //positions in the current image of the correspondences tracked by trackCorrespondences, in the same order,
+    //and if LK found them. Empty when the landmark has to be tracked on its own
+    std::vector<cv::Point2f> mTrackedPoints;
+    std::vector<unsigned char> mTrackedStatus;
+
+    //buffers of the homography estimation
+    RansacWorkspace mRansacWorkspace;
+    AlignmentWorkspace mAlignmentWorkspace;
+    cv::RNG mRng;
+
+    //buffer to sort the inliers by keypoint index
+    std::vector<int> mInlierOrder;
 };
 
 }
@@ -1,5 +1,9 @@
 #include "Models.hpp"
+#include "PosePredictor.hpp"
 #include <stdexcept>
+#include <algorithm>
+
+#include <opencv2/core/utility.hpp>
 
 
 using namespace cv;
@@ -174,35 +178,51 @@ bool compareByDiscriminativePower(const DetectionGH &a, const DetectionGH &b)
     return a.discriminativePower > b.discriminativePower;
 }
 
-//get all subsets of p elements out of a n elements set
-bool getNextSetPointers(unsigned int *pointers, int n, int p)
+//up direction given by the IMU, with the number of poses it made isPosePlausible reject
+struct UpConstraint
 {
-    int nbPtStuckAtEnd=0;
-    for(int i=p-1;i>=0;i--)
-        if((int)pointers[i]==n-p+i)
-            nbPtStuckAtEnd++;
-    
-    if(nbPtStuckAtEnd==0)//if none stuck then can simply move last one
-        pointers[p-1]++;
-    else if(nbPtStuckAtEnd==p)//all of them are stuck and we didn t find anything good=> lost
-    {
-        //std::cout<< "ratio_max = "<<ratio_max<<std::endl;
+    Vec3d upCam;
+    mutable int nbRejected;
+};
+
+//check if estimated transformation is possible (if rotation with respect to image plan > max rotation GH training
+//then would not be able to do this association using GH)
+//if the up direction is given by the IMU (data), the robot has to stand on the floor: its z axis cannot
+//be tilted by more than 30 degrees from it (gets rid of the mirrored P3P solutions)
+static bool isPosePlausible(const PnpRansacModel::Hypothesis& h, const void* data)
+{
+    if(rotationVSfrontoparallel(h.rvec)>=M_PI/4)
         return false;
-    }
-    else//some of them are at the end
+
+    const UpConstraint* up = static_cast<const UpConstraint*>(data);
+    if(up)
     {
-        //need to move the (nbBasePnp-1-nbPtStuckAtEnd)th pointer right and set the others to follow
-        pointers[p-1-nbPtStuckAtEnd]++;
-        for(int i=p-1-nbPtStuckAtEnd+1;i<p;i++)
-            pointers[i]=pointers[i-1]+1;
+        Matx33d R;
+        Rodrigues(h.rvec, R);
+        Vec3d robotUpCam(R(0,2), R(1,2), R(2,2));
+        if(robotUpCam.dot(up->upCam) < cos(M_PI/6))
+        {
+            up->nbRejected++;
+            return false;
+        }
     }
     return true;
 }
 
-bool Object3D::getPose(const IntrinsicCalibration &_mCalib, vector<DetectionGH> mMatches, Affine3d &robotPose, bool init) const
+//nb of subsets of p elements out of n
+static double getNbSubsets(int n, int p)
+{
+    double nbSubsets=1;
+    for(int i=0;i<p;i++)
+        nbSubsets*=(double)(n-i)/(i+1);
+    return nbSubsets;
+}
+
+bool Object3D::getPose(const IntrinsicCalibration &_mCalib, vector<DetectionGH> mMatches, Affine3d &robotPose, bool init,
+                       const Vec3d* upCam, RansacWorkspace* workspace) const
 {
     //if don t have 4 measures then problem not solvable
-    if(mMatches.size() < 4)
+    if(mMatches.size() < (unsigned int)PnpRansacModel::SampleSize)
         return false;
     
     //sort matches with respect to discriminative power to ease ransac later
@@ -211,105 +231,74 @@ bool Object3D::getPose(const IntrinsicCalibration &_mCalib, vector<DetectionGH>
     
     //create list of 3d points corresponding to detected projections
     vector<Point3f> detectedVertices;
-    for(unsigned int i=0;i<mMatches.size();i++)detectedVertices.push_back(mVertices[mMatches[i].id]);
-
-    //use opencv function
-    //get previous position if there is any
-    Vec3d rvec_prec,tvec_prec;
-    if(init)
-    {
-        rvec_prec=robotPose.rvec();
-        tvec_prec=robotPose.translation();
-    }
-    else
+    vector<Point2f> detectedProjections;
+    for(unsigned int i=0;i<mMatches.size();i++)
     {
-        rvec_prec = Vec3d(0.,M_PI,0.);
-        tvec_prec= Vec3d(0.,0.,0.4);
+        detectedVertices.push_back(mVertices[mMatches[i].id]);
+        detectedProjections.push_back(mMatches[i].position);
     }
+
+    RansacWorkspace localWorkspace;
+    RansacWorkspace& ws = workspace ? *workspace : localWorkspace;
+    PnpRansacModel model(_mCalib, detectedVertices, detectedProjections, vector<float>(), ws);
+    //the mapping of the device orientation to the camera frame is not validated on every device, so the up
+    //direction only gives a preference: if no pose agreeing with it is found, the ones it rejected are tried
+    UpConstraint up;
+    up.nbRejected=0;
+    if(upCam)
+        up.upCam=*upCam;
+    model.setValidityCheck(isPosePlausible, upCam ? &up : 0);
+
+    //do a kind of ransac: hypotheses are computed with P3P on minimal samples of 3 points,
+    //the 4th point of the sample selects the right solution among the ones of P3P,
+    //until find that more than majority agrees (within 2 pixels), if not consider tracker lost
+    const float ratioAgreeMin=0.75;
+
+    //limit the number of trials: if more than ratioAgreeMin of the matches were inliers,
+    //we would have drawn an all inlier sample after nb_trials_max samples with confidence 99%.
+    //No need to draw more samples than there are subsets either.
+    const float confidence=0.99;
+    int nb_trials_max = (int)std::ceil(std::log(1.-confidence)/std::log(1.-std::pow(ratioAgreeMin,(float)PnpRansacModel::SampleSize)));
+    double nbSubsets=getNbSubsets(mMatches.size(),PnpRansacModel::SampleSize);
+    if(nbSubsets<nb_trials_max)
+        nb_trials_max=(int)(nbSubsets+0.5);
+
+    Ransac<PnpRansacModel> ransac;
+    ransac.setThreshold(2.);
+    ransac.setConfidence(confidence);
+    ransac.setMaxTrials(nb_trials_max);
+    ransac.setStopInlierRatio(ratioAgreeMin);
     
-    //do a kind of ransac: try different subset to compute pose util find that more than majority agrees
-    //if not consider tracker lost
-    const unsigned int nbBasePnp=4;//take four points out of set
-    unsigned int pointers[nbBasePnp];
-    for(unsigned int i=0;i<nbBasePnp;i++)pointers[i]=i;//set first pointers as first elements of list
-
-    //limit the number of trials:
-    int cpt_trials = 0;
-    int nb_trials_max = 20;
-   
-    while(cpt_trials<nb_trials_max)
+    //previous position if there is any, it is checked before sampling
+    PnpRansacModel::Hypothesis best;
+    auto runRansac = [&]()
     {
-        cpt_trials ++;
-        //want to test all the unsorted subsets of 4 points
-        Vec3d rvec,tvec;
-        //if(!init)    {rvec=rvec_prec;tvec=tvec_prec;}
-        rvec=rvec_prec;tvec=tvec_prec;
-        
-        //create vectors corresponding to subset
-        vector<Point3f> subsetVertices;
-        vector<Point2f> subsetProjections;
-        for(unsigned int i=0;i<nbBasePnp;i++)
-        {
-            subsetVertices.push_back(detectedVertices[pointers[i]]);
-            subsetProjections.push_back(mMatches[pointers[i]].position);
-        }
-        
-        
-        //compute pose with subset
-        cv::solvePnP(subsetVertices, subsetProjections, _mCalib.cameraMatrix, _mCalib.distCoeffs, rvec, tvec, !init);
-        //cv::solvePnPRansac(detectedVertices, pointPositions, cameraMatrix, distCoeffs, rvec, tvec);
-        
-        //check if estimated transformation is possible (if rotation with respect to image plan > max rotation GH training
-        //then would not be able to do this association using GH)
-        //std::cout<< "rotationVSfrontoparallel(rvec) = "<<rotationVSfrontoparallel(rvec)<<std::endl;
-        if(rotationVSfrontoparallel(rvec)<M_PI/4)
+        if(init)
         {
-            
-            //check how many points agree
-            float threshold_proj=2.;//set error max to 2 pixels
-            //float threshold_proj=40.;//set error max to 5 pixels
-            unsigned int nbPointAgree=0;
-            vector<Point2f> vProjPoints;//project all points
-            projectPoints(detectedVertices, rvec, tvec, _mCalib.cameraMatrix, _mCalib.distCoeffs, vProjPoints);
-            for(unsigned int i=0;i<mMatches.size();i++)
-                if(norm(vProjPoints[i]-mMatches[i].position)<threshold_proj)
-                    nbPointAgree++;
-            
-            //if more than majority agrees then fine, recompute objects pose with all points which agree and return it
-            //might be better to instead do a tuckey optimisation with all points, as their might be points rejected with
-            //first subset which after some refining would be back in...
-            //can also run several iterations of the previous selection and following optimisation
-            if(nbPointAgree>mMatches.size()*0.75)
-            //if(nbPointAgree>mMatches.size()/6)
-            {
-                vector<Point3f> newSubsetVertices;
-                vector<Point2f> newSubsetProjections;
-                for(unsigned int i=0;i<mMatches.size();i++)
-                    if(norm(vProjPoints[i]-mMatches[i].position)<threshold_proj)
-                    {
-                        newSubsetVertices.push_back(detectedVertices[i]);
-                        newSubsetProjections.push_back(mMatches[i].position);
-                    }
-                
-                cv::solvePnP(newSubsetVertices, newSubsetProjections, _mCalib.cameraMatrix, _mCalib.distCoeffs, rvec, tvec, !init);
-                robotPose=Affine3d(rvec,tvec);
-                //std::cout<< "ratio = "<<(float)nbPointAgree/mMatches.size()<<std::endl;
-                //std::cout<< "rotationVSfrontoparallel(rvec) = "<<rotationVSfrontoparallel(rvec)<<std::endl;
-                return true;
-            }
+            best.rvec=robotPose.rvec();
+            best.tvec=robotPose.translation();
         }
-        
-        //get next subset
-        bool nextSetAvailable = getNextSetPointers(&pointers[0],mMatches.size(),nbBasePnp);
 
-        if(!nextSetAvailable)
-            return false;
+        //same seed for each call to get the same detection on the same image
+        cv::RNG rng(0x7c3a);
+        ProsacSampler sampler(mMatches.size(), PnpRansacModel::SampleSize, nb_trials_max);
+        float score;
+        return ransac.run(model, sampler, rng, ws, best, score, init);
+    };
+    int nbInliers = runRansac();
 
-        
+    //without the up direction only the poses it rejected can change the result
+    if(nbInliers<=detectedVertices.size()*ratioAgreeMin && up.nbRejected>0)
+    {
+        model.setValidityCheck(isPosePlausible, 0);
+        nbInliers = runRansac();
     }
-    return false;
 
-    
+    if(nbInliers<=detectedVertices.size()*ratioAgreeMin)
+        return false;
+
+    robotPose=Affine3d(best.rvec,best.tvec);
+    return true;
 }
 
 
@@ -339,6 +328,54 @@ Camera3dModel::Camera3dModel()
     mEdges.push_back(ModelEdge(mVerticesTemp[4],mVerticesTemp[1]));
 }
 
+void createTrainingCameras(std::vector<Camera3dModel>& vCams)
+{
+    float radiusSphere=0.3;//radius sphere
+    float distCamCam=0.15*radiusSphere;
+    float minLatitude=M_PI/12.;
+
+    //get latitude angle increment from desired distCamCam
+    int l=0;
+    float latitude=M_PI/2.-l*distCamCam/radiusSphere;
+    while(latitude>minLatitude)
+    {
+        if(l==0)//pole
+        {
+            //pole => want only one cam
+            Camera3dModel newCam;
+            newCam.pose=newCam.pose.rotate(Vec3d(M_PI,0,0)).translate(Vec3d(0.0,0.0,radiusSphere));
+
+            vCams.push_back(newCam);
+        }
+        else
+        {
+            //compute how many cams we want at this latitude
+            float radiusLatitude=2.*M_PI*cos(latitude);
+            int nbCamInLat=(int)(radiusSphere*radiusLatitude/distCamCam);
+
+            for(int cl=0;cl<nbCamInLat;cl++)
+            {
+                float longitude=2.*M_PI*cl/nbCamInLat;
+
+                //rotate around z
+                Camera3dModel newCam;
+                newCam.pose=newCam.pose.rotate(Vec3d(0.0,0.0,longitude));
+
+                //rotate for latitude and zoom out
+                Affine3d transfoRotx = Affine3d().rotate(Vec3d(M_PI/2.-latitude,0.0,0.0));
+                newCam.pose=newCam.pose*transfoRotx;
+
+                Affine3d transfoZLoc = Affine3d().translate(Vec3d(0.0,0.0,radiusSphere));
+                newCam.pose=(newCam.pose*transfoZLoc)*Affine3d().rotate(Vec3d(M_PI,0,0));
+
+                vCams.push_back(newCam);
+            }
+        }
+        l++;
+        latitude=M_PI/2.-l*distCamCam/radiusSphere;
+    }
+}
+
 void ThymioBlobModel::setBlobModel()
 {
     //top of the robot
@@ -375,6 +412,14 @@ void ThymioBlobModel::setBlobModel()
     mGroup4s.push_back(ModelQuadruplet(5,2,3,6));
     mGroup4s.push_back(ModelQuadruplet(12,8,9,13));
 }
+void ThymioBlobModel::setBlobModel(const std::vector<cv::Point3f>& _vertices)
+{
+    mVertices = _vertices;
+
+    //groups are only known for the default layout
+    mGroup3s.clear();
+    mGroup4s.clear();
+}
 void ThymioBlobModel::setEdgePlotModel()
 {
     //if want to display edges
@@ -677,6 +722,39 @@ void Object3D::readSurfaceLearned(cv::FileStorage& robotModelStorage)
     
 }
 
+bool arePosesClose(const cv::Affine3d& a, const cv::Affine3d& b, double maxAngle, double maxDist)
+{
+    Vec3d relativeRotation;
+    Rodrigues(a.rotation().t() * b.rotation(), relativeRotation);
+    return norm(relativeRotation) < maxAngle && norm(a.translation() - b.translation()) < maxDist;
+}
+
+void insertPoseHypothesis(std::vector<PoseHypothesisSet>& hypotheses, const PoseHypothesisSet& hypothesis,
+                          unsigned int maxSize)
+{
+    //merge with a close one
+    const double mergeAngle = 10.*M_PI/180.;
+    const double mergeDist = 0.01;
+    for(unsigned int i=0;i<hypotheses.size();i++)
+        if(arePosesClose(hypotheses[i].pose, hypothesis.pose, mergeAngle, mergeDist))
+        {
+            if(hypothesis.score <= hypotheses[i].score)
+                return;
+            hypotheses.erase(hypotheses.begin()+i);
+            break;
+        }
+
+    //keep sorted, best first
+    unsigned int pos = 0;
+    while(pos<hypotheses.size() && hypotheses[pos].score >= hypothesis.score)
+        pos++;
+    if(pos >= maxSize)
+        return;
+    hypotheses.insert(hypotheses.begin()+pos, hypothesis);
+    if(hypotheses.size() > maxSize)
+        hypotheses.resize(maxSize);
+}
+
 struct surfaceMatch {
     cv::Point3f objectPoints;
     cv::Point2f imagePoints;
@@ -690,281 +768,378 @@ bool compareByScore(const surfaceMatch &a, const surfaceMatch &b)
     return a.score > b.score;
 }
 
-bool Object3D::track(const cv::Mat &img, const cv::Mat &prev_img, const IntrinsicCalibration &_mCalib, const cv::Affine3d& prevPoseCam, cv::Affine3d& poseCam) const
+SurfaceTemplateCache::Entry* SurfaceTemplateCache::find(unsigned int surface, const int* viewBin, const cv::Size& size)
 {
-    //project textured planar surfaces to current image using the previous pose
-    //do NCC search to find displacement up to drift for each surface using frame to frame similarity
-    //refine with MI search and parabolic fitting to correct drift then PnP
-    //to retrieve the 3D pose from the sets of 2D matches
+    std::vector<Entry>& entries = surfaces[surface];
+    for(unsigned int i=0;i<entries.size();i++)
+        if(entries[i].size == size && std::equal(viewBin, viewBin+4, entries[i].viewBin))
+        {
+            //most recent first
+            std::rotate(entries.begin(), entries.begin()+i, entries.begin()+i+1);
+            return &entries[0];
+        }
+    return 0;
+}
 
-    int window_search_size = 32;
-    int half_window_size = window_search_size/2;
+void SurfaceTemplateCache::insert(unsigned int surface, const int* viewBin, const cv::Size& size,
+                                  const cv::Point2f& center, const cv::Mat& patch)
+{
+    std::vector<Entry>& entries = surfaces[surface];
+    if(entries.size() < (unsigned int)EntriesPerSurface)
+        entries.push_back(Entry());
+    //the least recently used one is replaced
+    std::rotate(entries.begin(), entries.end()-1, entries.end());
+    Entry& entry = entries[0];
+    std::copy(viewBin, viewBin+4, entry.viewBin);
+    entry.size = size;
+    entry.center = center;
+    entry.patch = patch;
+}
 
-    int window_search_size_drift = 6;
-    int half_window_size_drift = window_search_size_drift/2;
+//bin of the view of a surface by a camera: direction of the camera in the surface frame,
+//rotation of the surface around the optical axis and distance, a warped appearance is valid
+//for all the views of its bin
+static void getSurfaceViewBin(const planarSurface& surf, const cv::Affine3d& surfToCam, int* viewBin)
+{
+    const double angleStep = 3.*M_PI/180.;
+    const double logDistanceStep = std::log(1.03);
+
+    Vec3d camInSurf = surfToCam.rotation().t() * (-surfToCam.translation()) - toVec(surf.center);
+    double dist = norm(camInSurf);
+    double azimuth = std::atan2(camInSurf.dot(surf.b2), camInSurf.dot(surf.b1));
+    double elevation = std::acos(std::max(-1., std::min(1., camInSurf.dot(surf.normal)/dist)));
+    Vec3d b1Cam = surfToCam.rotation() * surf.b1;
+    double roll = std::atan2(b1Cam[1], b1Cam[0]);
+
+    viewBin[0] = cvFloor(azimuth/angleStep);
+    viewBin[1] = cvFloor(elevation/angleStep);
+    viewBin[2] = cvFloor(roll/angleStep);
+    viewBin[3] = cvFloor(std::log(std::max(dist, 1e-3))/logDistanceStep);
+}
 
-    std::vector<surfaceMatch> mSurfaceMatches;
+//matching of the surfaces of an object in a new image for Object3D::track, each surface is independent
+//so that they can be matched in parallel, the results are stored by surface index
+class SurfaceMatcher : public cv::ParallelLoopBody
+{
+public:
+    SurfaceMatcher(const Object3D& _object, const cv::Mat &_img, const cv::Mat &_prev_img, const IntrinsicCalibration &_mCalib,
+                   const cv::Affine3d& _prevPoseCam, const cv::Affine3d& _predictedPoseCam, double _sigmaRot, double _sigmaTrans,
+                   SurfaceTemplateCache* _templateCache,
+                   std::vector<surfaceMatch>& _matches, std::vector<unsigned char>& _found)
+        : object(_object), templateCache(_templateCache), img(_img), prev_img(_prev_img), _mCalib(_mCalib)
+        , prevPoseCam(_prevPoseCam), predictedPoseCam(_predictedPoseCam), sigmaRot(_sigmaRot), sigmaTrans(_sigmaTrans)
+        //the search window is 3 sigma of the prediction wide, at least +-4 pixels
+        //and at most twice what was used before having a motion model
+        , min_half_window_size(4)
+        , max_half_window_size(32)
+        , focal(_mCalib.cameraMatrix.at<double>(0,0))
+        , half_window_size_drift(6/2)
+        , matches(_matches), found(_found)
+    {
+        matches.resize(object.mPlanarSurfaces.size());
+        found.assign(object.mPlanarSurfaces.size(), 0);
+        //allocated before the threads use it
+        if(templateCache)
+            templateCache->surfaces.resize(object.mPlanarSurfaces.size());
+    }
 
-    for(unsigned int v=0;v<mPlanarSurfaces.size();v++)
+    void operator()(const cv::Range& range) const
     {
-        const planarSurface &surf = mPlanarSurfaces[v];
+        for(int v=range.start;v<range.end;v++)
+            found[v] = matchSurface(v, matches[v]);
+    }
 
-        //project surface corners to check if visible and get homography from image to surface model
-        Point3f ptLine = prevPoseCam * pose * surf.center;
-        Vec3d ray = Vec3d(ptLine.x,ptLine.y,ptLine.z);        ray = ray / norm(ray);
-        Vec3d normal_cam = prevPoseCam.rotation() * pose.rotation() * surf.normal;
-        float viewScore = 1.-2.*acos(-normal_cam.dot(ray))/3.141592;
+    //search for surface v, returns false if it is not visible or cannot be searched for
+    bool matchSurface(unsigned int v, surfaceMatch& match) const;
+
+private:
+    const Object3D& object;
+    SurfaceTemplateCache* templateCache;
+    const cv::Mat &img;
+    const cv::Mat &prev_img;
+    const IntrinsicCalibration &_mCalib;
+    const cv::Affine3d& prevPoseCam;
+    const cv::Affine3d& predictedPoseCam;
+    double sigmaRot, sigmaTrans;
+
+    const int min_half_window_size;
+    const int max_half_window_size;
+    const double focal;
+    const int half_window_size_drift;
+
+    std::vector<surfaceMatch>& matches;
+    std::vector<unsigned char>& found;
+};
+
+bool SurfaceMatcher::matchSurface(unsigned int v, surfaceMatch& match) const
+{
+    const planarSurface &surf = object.mPlanarSurfaces[v];
 
-        if(viewScore > 0.2)
-        {
-            vector<Point3f> ObjPoints;
-            ObjPoints.push_back(surf.center+toPoint(surf.radius1*surf.b1+surf.radius2*surf.b2));
-            ObjPoints.push_back(surf.center+toPoint(surf.radius1*surf.b1-surf.radius2*surf.b2));
-            ObjPoints.push_back(surf.center+toPoint(-surf.radius1*surf.b1-surf.radius2*surf.b2));
-            ObjPoints.push_back(surf.center+toPoint(-surf.radius1*surf.b1+surf.radius2*surf.b2));
-            ObjPoints.push_back(surf.center);
+    //project surface corners to check if visible and get homography from image to surface model
+    Point3f ptLine = prevPoseCam * object.pose * surf.center;
+    Vec3d ray = Vec3d(ptLine.x,ptLine.y,ptLine.z);        ray = ray / norm(ray);
+    Vec3d normal_cam = prevPoseCam.rotation() * object.pose.rotation() * surf.normal;
+    float viewScore = 1.-2.*acos(-normal_cam.dot(ray))/3.141592;
 
-            vector<Point3f> LineObj;
-            for(uint i=0;i<ObjPoints.size();i++) 
-                LineObj.push_back(pose*ObjPoints[i]);
-            
-            //get position of surface corners in previous image
-            vector<Point2f> vprojVertices;
-            projectPoints(LineObj, prevPoseCam.rvec(), prevPoseCam.translation(), _mCalib.cameraMatrix, _mCalib.distCoeffs, vprojVertices);
-            
-            //get the minimal support rectangle which contains the projected surface
-            Rect box = cv::boundingRect(cv::Mat(vprojVertices));
+    if(viewScore > 0.2)
+    {
+        vector<Point3f> ObjPoints;
+        ObjPoints.push_back(surf.center+toPoint(surf.radius1*surf.b1+surf.radius2*surf.b2));
+        ObjPoints.push_back(surf.center+toPoint(surf.radius1*surf.b1-surf.radius2*surf.b2));
+        ObjPoints.push_back(surf.center+toPoint(-surf.radius1*surf.b1-surf.radius2*surf.b2));
+        ObjPoints.push_back(surf.center+toPoint(-surf.radius1*surf.b1+surf.radius2*surf.b2));
+        ObjPoints.push_back(surf.center);
+
+        vector<Point3f> LineObj;
+        for(uint i=0;i<ObjPoints.size();i++) 
+            LineObj.push_back(object.pose*ObjPoints[i]);
+        
+        //get position of surface corners in previous image
+        vector<Point2f> vprojVertices;
+        projectPoints(LineObj, prevPoseCam.rvec(), prevPoseCam.translation(), _mCalib.cameraMatrix, _mCalib.distCoeffs, vprojVertices);
+        
+        //get the minimal support rectangle which contains the projected surface
+        Rect box = cv::boundingRect(cv::Mat(vprojVertices));
+
+        //predicted displacement of the surface and size of the window in which to search for it
+        vector<Point3f> centerObj(1, LineObj[4]);
+        vector<Point2f> vprojCenterPred;
+        projectPoints(centerObj, predictedPoseCam.rvec(), predictedPoseCam.translation(), _mCalib.cameraMatrix, _mCalib.distCoeffs, vprojCenterPred);
+        Point2f predFlow = vprojCenterPred[0] - vprojVertices[4];
+        Point boxShift(cvRound(predFlow.x), cvRound(predFlow.y));
+
+        double depthPred = (predictedPoseCam * LineObj[4]).z;
+        int half_window_size = PosePredictor::getHalfSearchWindow(sigmaRot, sigmaTrans, focal, depthPred,
+                                                                   min_half_window_size, max_half_window_size);
+
+        //if reasonable size and entirely projects in image
+        if(box.size().width<100 && box.size().height<100)
+        if(box.x >=0 && box.y >=0 && box.x + box.size().width < img.size().width && box.y + box.size().height < img.size().height)
+        {
 
-            //if reasonable size and entirely projects in image
-            if(box.size().width<100 && box.size().height<100)
-            if(box.x >=0 && box.y >=0 && box.x + box.size().width < img.size().width && box.y + box.size().height < img.size().height)
-            {
+             //get projected corners coordinates in the bounding box
+            vector<Point> vprojVertices_bb;
+            for(uint v=0;v<vprojVertices.size();v++)
+                vprojVertices_bb.push_back(vprojVertices[v]-Point2f(box.x, box.y));
 
-                 //get projected corners coordinates in the bounding box
-                vector<Point> vprojVertices_bb;
-                for(uint v=0;v<vprojVertices.size();v++)
-                    vprojVertices_bb.push_back(vprojVertices[v]-Point2f(box.x, box.y));
+            vector<Point2f> vprojVertices_bbF;
+            for(uint v=0;v<vprojVertices.size();v++)
+                vprojVertices_bbF.push_back(vprojVertices[v]-Point2f(box.x, box.y));
 
-                vector<Point2f> vprojVertices_bbF;
-                for(uint v=0;v<vprojVertices.size();v++)
-                    vprojVertices_bbF.push_back(vprojVertices[v]-Point2f(box.x, box.y));
 
+            //create the corresponding mask in box wheer surface is defined
+            cv::Mat mask = cv::Mat::zeros( box.size(), CV_8UC1 );
+            cv::fillConvexPoly(mask, &vprojVertices_bb[0], 4, 1);//4: use only 4 first corners in vertices to define contour, 5th is center
 
-                //create the corresponding mask in box wheer surface is defined
-                cv::Mat mask = cv::Mat::zeros( box.size(), CV_8UC1 );
-                cv::fillConvexPoly(mask, &vprojVertices_bb[0], 4, 1);//4: use only 4 first corners in vertices to define contour, 5th is center
+            //use previous image to define what we are searching for
+            cv::Mat patchCurr(box.size(), CV_8UC1);
+            prev_img(box).copyTo(patchCurr);
 
-                //use previous image to define what we are searching for
-                cv::Mat patchCurr(box.size(), CV_8UC1);
-                prev_img(box).copyTo(patchCurr);
+            //compute NCC over search window
+            //get the roi of the current image on which to compute similarity with patch
+            //centered on the predicted position of the box
+            Rect boxPred = box + boxShift;
+            int myRoi_l = boxPred.x-half_window_size; myRoi_l = (myRoi_l<0)?0:myRoi_l;
+            int myRoi_t = boxPred.y-half_window_size; myRoi_t = (myRoi_t<0)?0:myRoi_t;
+            int myRoi_r = boxPred.x+boxPred.size().width+half_window_size; myRoi_r = (myRoi_r>img.size().width)?img.size().width:myRoi_r;
+            int myRoi_d = boxPred.y+boxPred.size().height+half_window_size; myRoi_d = (myRoi_d>img.size().height)?img.size().height:myRoi_d;       
 
-                //compute NCC over search window
-                //get the roi of the current image on which to compute similarity with patch
-                int myRoi_l = box.x-half_window_size; myRoi_l = (myRoi_l<0)?0:myRoi_l;
-                int myRoi_t = box.y-half_window_size; myRoi_t = (myRoi_t<0)?0:myRoi_t;
-                int myRoi_r = box.x+box.size().width+half_window_size; myRoi_r = (myRoi_r>img.size().width)?img.size().width:myRoi_r;
-                int myRoi_d = box.y+box.size().height+half_window_size; myRoi_d = (myRoi_d>img.size().height)?img.size().height:myRoi_d;       
+            cv::Rect myROI(myRoi_l,myRoi_t,myRoi_r-myRoi_l,myRoi_d-myRoi_t);//region of interest is around current position of point
+            
+            //verify that the search region is valid
+            int result_cols = myROI.size().width - box.size().width + 1;
+            int result_rows = myROI.size().height - box.size().height + 1;
 
-                cv::Rect myROI(myRoi_l,myRoi_t,myRoi_r-myRoi_l,myRoi_d-myRoi_t);//region of interest is around current position of point
+            if(result_cols > half_window_size && result_rows > half_window_size)
+            {
+                cv::Mat resultNCC = cv::Mat::zeros( result_rows, result_cols, CV_32FC1 );
+                cv::matchTemplate( img(myROI), patchCurr, resultNCC, CV_TM_SQDIFF, mask);
                 
-                //verify that the search region is valid
-                int result_cols = myROI.size().width - box.size().width + 1;
-                int result_rows = myROI.size().height - box.size().height + 1;
-
-                if(result_cols > half_window_size && result_rows > half_window_size)
+                /// Localizing the best match with minMaxLoc searching for max NCC
+                double minVal; double maxVal; cv::Point minLoc; cv::Point maxLoc;
+                cv::minMaxLoc( resultNCC, &minVal, &maxVal, &minLoc, &maxLoc, cv::Mat() );
+
+                //now we have hopefully the position of the surface up to some drift
+                //so we want to use the model to correct the drift
+
+                //appearance of the surface model warped to the box, reused from the cache if the view
+                //did not change much since it was computed (the projection of the center is the one of that view)
+                cv::Mat patchCurr_drift;
+                Point2f patchCenter = vprojVertices_bbF[4];
+                SurfaceTemplateCache::Entry* cached = 0;
+                int viewBin[4];
+                if(templateCache)
                 {
-                    cv::Mat resultNCC = cv::Mat::zeros( result_rows, result_cols, CV_32FC1 );
-                    cv::matchTemplate( img(myROI), patchCurr, resultNCC, CV_TM_SQDIFF, mask);
-                    
-                    /// Localizing the best match with minMaxLoc searching for max NCC
-                    double minVal; double maxVal; cv::Point minLoc; cv::Point maxLoc;
-                    cv::minMaxLoc( resultNCC, &minVal, &maxVal, &minLoc, &maxLoc, cv::Mat() );
-
-                    //now we have hopefully the position of the surface up to some drift
-                    //so we want to use the model to correct the drift
-
-                    //get homography from surface model to current image ROI
-                    vector<Point2f> modelPoints;
-                    modelPoints.push_back(Point2f(surf.mImagePtr->size().width,0));
-                    modelPoints.push_back(Point2f(surf.mImagePtr->size().width,surf.mImagePtr->size().height));
-                    modelPoints.push_back(Point2f(0,surf.mImagePtr->size().height));
-                    modelPoints.push_back(Point2f(0,0));
-                    modelPoints.push_back(Point2f(surf.mImagePtr->size().width/2,surf.mImagePtr->size().height/2));
+                    getSurfaceViewBin(surf, prevPoseCam * object.pose, viewBin);
+                    cached = templateCache->find(v, viewBin, box.size());
+                }
+                if(cached)
+                {
+                    patchCurr_drift = cached->patch;
+                    patchCenter = cached->center;
+                }
+                else
+                {
+                    //get homography from surface model to current image ROI, the corners of the model are
+                    //(w,0),(w,h),(0,h),(0,0)
+                    Point2f corners[4] = {vprojVertices_bbF[3], vprojVertices_bbF[0], vprojVertices_bbF[1], vprojVertices_bbF[2]};
+                    Matx33d homography;
+                    if(!homographyFromRectangle(surf.mImagePtr->size().width, surf.mImagePtr->size().height, corners, homography))
+                        return false;
+
+                    cv::warpPerspective( *surf.mImagePtr, patchCurr_drift, homography, box.size(),INTER_LINEAR, BORDER_REPLICATE);
+                    if(templateCache)
+                        templateCache->insert(v, viewBin, box.size(), patchCenter, patchCurr_drift);
+                }
+                
+                //to make it simple, use box previously defined,
+                //box was centered on projection of vertex in previous image
+                //now center it on previously found optimum so can use same code afterward
+                box = box + minLoc + myROI.tl() - box.tl();
 
-                    cv::Mat homography = cv::findHomography(modelPoints,vprojVertices_bb);
+                myRoi_l = box.x-half_window_size_drift; myRoi_l = (myRoi_l<0)?0:myRoi_l;
+                myRoi_t = box.y-half_window_size_drift; myRoi_t = (myRoi_t<0)?0:myRoi_t;
+                myRoi_r = box.x+box.size().width+half_window_size_drift; myRoi_r = (myRoi_r>img.size().width)?img.size().width:myRoi_r;
+                myRoi_d = box.y+box.size().height+half_window_size_drift; myRoi_d = (myRoi_d>img.size().height)?img.size().height:myRoi_d;       
 
-                    cv::Mat patchCurr_drift(box.size(), CV_8UC1);
-                    cv::warpPerspective( *surf.mImagePtr, patchCurr_drift, homography, patchCurr_drift.size(),INTER_LINEAR, BORDER_REPLICATE);
-                    
-                    //to make it simple, use box previously defined,
-                    //box was centered on projection of vertex in previous image
-                    //now center it on previously found optimum so can use same code afterward
-                    box = box + minLoc + myROI.tl() - box.tl();
+                myROI = cv::Rect(myRoi_l,myRoi_t,myRoi_r-myRoi_l,myRoi_d-myRoi_t);//region of interest is around current position of point
+                
+                //verify that the search region is valid
+                result_cols = myROI.size().width - box.size().width + 1;
+                result_rows = myROI.size().height - box.size().height + 1;
 
-                    myRoi_l = box.x-half_window_size_drift; myRoi_l = (myRoi_l<0)?0:myRoi_l;
-                    myRoi_t = box.y-half_window_size_drift; myRoi_t = (myRoi_t<0)?0:myRoi_t;
-                    myRoi_r = box.x+box.size().width+half_window_size_drift; myRoi_r = (myRoi_r>img.size().width)?img.size().width:myRoi_r;
-                    myRoi_d = box.y+box.size().height+half_window_size_drift; myRoi_d = (myRoi_d>img.size().height)?img.size().height:myRoi_d;       
+                if(result_cols > half_window_size_drift && result_rows > half_window_size_drift)
+                {
+                    cv::Mat resultNCC_drift = cv::Mat::zeros( result_rows, result_cols, CV_32FC1 );
 
-                    myROI = cv::Rect(myRoi_l,myRoi_t,myRoi_r-myRoi_l,myRoi_d-myRoi_t);//region of interest is around current position of point
+                    matchTemplateMI( img(myROI), patchCurr_drift, resultNCC_drift, mask);
                     
-                    //verify that the search region is valid
-                    result_cols = myROI.size().width - box.size().width + 1;
-                    result_rows = myROI.size().height - box.size().height + 1;
-
-                    if(result_cols > half_window_size_drift && result_rows > half_window_size_drift)
-                    {
-                        cv::Mat resultNCC_drift = cv::Mat::zeros( result_rows, result_cols, CV_32FC1 );
-
-                        matchTemplateMI( img(myROI), patchCurr_drift, resultNCC_drift, mask);
-                        
-                        /// Localizing the best match with minMaxLoc searching for max NCC
-                        cv::minMaxLoc( resultNCC_drift, &minVal, &maxVal, &minLoc, &maxLoc, cv::Mat() );
-
-                        //refine maxLoc with parabolic fitting
-                        cv::Point2f maxLocF;
-                        parabolicRefinement(resultNCC_drift,maxLoc,maxLocF);
+                    /// Localizing the best match with minMaxLoc searching for max NCC
+                    cv::minMaxLoc( resultNCC_drift, &minVal, &maxVal, &minLoc, &maxLoc, cv::Mat() );
 
-                        //add to list of matches
-                        surfaceMatch newMatch;
-                        newMatch.objectPoints = surf.center;
-                        newMatch.imagePoints = maxLocF + Point2f(myROI.tl()) + vprojVertices_bbF[4];
-                        newMatch.score = viewScore*maxVal;
-                        mSurfaceMatches.push_back(newMatch);
+                    //refine maxLoc with parabolic fitting
+                    cv::Point2f maxLocF;
+                    parabolicRefinement(resultNCC_drift,maxLoc,maxLocF);
 
-                    }
+                    //add to list of matches
+                    match.objectPoints = surf.center;
+                    match.imagePoints = maxLocF + Point2f(myROI.tl()) + patchCenter;
+                    match.score = viewScore*maxVal;
+                    return true;
 
                 }
+
             }
         }
     }
+    return false;
+}
 
-    //sort out the matchesdepending on their score
-    std::sort(mSurfaceMatches.begin(), mSurfaceMatches.end(), compareByScore);
+bool Object3D::track(const cv::Mat &img, const cv::Mat &prev_img, const IntrinsicCalibration &_mCalib, const cv::Affine3d& prevPoseCam,
+                     const cv::Affine3d& predictedPoseCam, double sigmaRot, double sigmaTrans, cv::Affine3d& poseCam,
+                     RansacWorkspace* workspace, std::vector<PoseHypothesisSet>* hypotheses,
+                     SurfaceTemplateCache* templateCache) const
+{
+    //project textured planar surfaces to current image using the previous pose
+    //do NCC search around the predicted position to find displacement up to drift for each surface using frame to frame similarity
+    //refine with MI search and parabolic fitting to correct drift then PnP
+    //to retrieve the 3D pose from the sets of 2D matches
 
+    //the surfaces are matched in parallel if enabled, the matches are then gathered in
+    //the order of the surfaces so that the result does not depend on the threads
+    std::vector<surfaceMatch> matchBySurface;
+    std::vector<unsigned char> found;
+    SurfaceMatcher matcher(*this, img, prev_img, _mCalib, prevPoseCam, predictedPoseCam, sigmaRot, sigmaTrans,
+                           templateCache, matchBySurface, found);
+    cv::Range allSurfaces(0, mPlanarSurfaces.size());
+    if(mParallelTracking)
+        cv::parallel_for_(allSurfaces, matcher);
+    else
+        matcher(allSurfaces);
 
-    //Ransac : perform PnPwith all subsets of 4 matches, estimate pose and check corresponding score
-    //keep best scoring pose
-    //matches have been stored in lists: objectPoints, imagePoints and score;
+    std::vector<surfaceMatch> mSurfaceMatches;
+    for(unsigned int v=0;v<mPlanarSurfaces.size();v++)
+        if(found[v])
+            mSurfaceMatches.push_back(matchBySurface[v]);
 
-    const unsigned int nbBasePnp=4;
 
-    if(mSurfaceMatches.size() < nbBasePnp)
-        return false;
-    
-    cv::Affine3d bestPose;
-    float bestScore=0;
-    int bestValidSurf=0;
-    bool *inliers=new bool[mSurfaceMatches.size()];
+    //sort out the matches depending on their score, best first for PROSAC
+    std::sort(mSurfaceMatches.begin(), mSurfaceMatches.end(), compareByScore);
 
-    //do a kind of ransac: try all different subset of nbBasePnp matches to compute pose 
-    //and keep the pose which returns the most inliers
-    unsigned int pointers[nbBasePnp];
-    for(unsigned int i=0;i<nbBasePnp;i++)pointers[i]=i;//set first pointers as first elements of list        
+    if(mSurfaceMatches.size() < (unsigned int)PnpRansacModel::SampleSize)
+        return false;
 
-    //limit the number of trials:
-    int cpt_trials = 0;
-    int nb_trials_max = 30;
-   
-    while(cpt_trials<nb_trials_max)
+    //matches have been stored in lists: objectPoints, imagePoints and score;
+    vector<Point3f> surfCenters(mSurfaceMatches.size());
+    vector<Point2f> surfProjections(mSurfaceMatches.size());
+    vector<float> scores(mSurfaceMatches.size());
+    for(unsigned int v=0;v<mSurfaceMatches.size();v++)
     {
-        cpt_trials ++;
-
-        Vec3d rvec=prevPoseCam.rvec();
-        Vec3d tvec=prevPoseCam.translation();
-        
-        //create vectors corresponding to subset
-        vector<Point3f> subsetVertices;
-        vector<Point2f> subsetProjections;
-        for(unsigned int i=0;i<nbBasePnp;i++)
-        {
-            subsetVertices.push_back(mSurfaceMatches[pointers[i]].objectPoints);
-            subsetProjections.push_back(mSurfaceMatches[pointers[i]].imagePoints);
-        }
-        
-        //compute pose with subset
-        cv::solvePnP(subsetVertices, subsetProjections, _mCalib.cameraMatrix, _mCalib.distCoeffs, rvec, tvec, true);
-
-        //project all the surface centers onto image using new pose
-        vector<Point3f> surfCenters;
-        for(unsigned int v=0;v<mSurfaceMatches.size();v++)
-            surfCenters.push_back(mSurfaceMatches[v].objectPoints);
-
-        vector<Point2f> surfCenterProj;
-        projectPoints(surfCenters, rvec, tvec, _mCalib.cameraMatrix, _mCalib.distCoeffs, surfCenterProj);
-
-        //check how many surfaces agree with the pose and get cumulative score
-        int nbValidSurf = 0;
-        float scoreAccu = 0;
-        bool *inliers_temp=new bool[mSurfaceMatches.size()];
-        for(unsigned int v=0;v<mSurfaceMatches.size();v++)
-        {
-            if(cv::norm(surfCenterProj[v] - Point2f(mSurfaceMatches[v].imagePoints))<5.)
-            {
-                nbValidSurf++;
-                scoreAccu += mSurfaceMatches[v].score;
-                inliers_temp[v] = true;
-            }
-            else
-                inliers_temp[v] = false;
-        }
-
-        //compare current pose validity with the best one so far
-        //at this point we could also have used the MI and viewing angle score accumulated in scoreAccu
-        if(nbValidSurf > bestValidSurf)
-        {
-            bestValidSurf = nbValidSurf;
-            bestScore = scoreAccu;
-
-            bestPose = cv::Affine3d(rvec,tvec);
-
-            //save inleirs
-            for(unsigned int v=0;v<mSurfaceMatches.size();v++)
-                inliers[v] = inliers_temp[v];
-        }
-        delete[] inliers_temp;
-
-        //if not need to go to next subset:
-        bool nextSetAvailable = getNextSetPointers(&pointers[0],mSurfaceMatches.size(),nbBasePnp);
-
-        if(!nextSetAvailable)
-            break;        
+        surfCenters[v] = mSurfaceMatches[v].objectPoints;
+        surfProjections[v] = mSurfaceMatches[v].imagePoints;
+        scores[v] = mSurfaceMatches[v].score;
     }
+
+    //Ransac : perform PnP from the predicted pose with subsets of 4 matches and keep the pose
+    //which returns the most inliers (within 5 pixels), refined with all of them weighted by
+    //their similarity and viewing angle score
+    RansacWorkspace localWorkspace;
+    RansacWorkspace& ws = workspace ? *workspace : localWorkspace;
+    PnpRansacModel model(_mCalib, surfCenters, surfProjections, scores, ws);
+    PnpRansacModel::Hypothesis best;
+    best.rvec=predictedPoseCam.rvec();
+    best.tvec=predictedPoseCam.translation();
+    model.setInitialGuess(best);
+
+    //limit the number of trials
+    int nb_trials_max = 30;
+    double nbSubsets = getNbSubsets(mSurfaceMatches.size(),PnpRansacModel::SampleSize);
+    if(nbSubsets<nb_trials_max)
+        nb_trials_max=(int)(nbSubsets+0.5);
+
+    Ransac<PnpRansacModel> ransac;
+    ransac.setThreshold(5.);
+    ransac.setMaxTrials(nb_trials_max);
+
+    //the predicted pose is checked first
+    cv::RNG rng(0x7c3a);
+    ProsacSampler sampler(mSurfaceMatches.size(), PnpRansacModel::SampleSize, nb_trials_max);
+    float bestScore;
+    ransac.run(model, sampler, rng, ws, best, bestScore, true);
     
     //std::cout<<"score tracking MI= "<<bestScore<<std::endl;
 
     //use the MI score which has shown to be robust to occlusions
     //and illumination changes to estimate if we still track
-    if(bestScore>0.4)
+    const float minTrackScore = 0.4;
+    bool tracked = bestScore>minTrackScore;
+    if(tracked)
+        poseCam = cv::Affine3d(best.rvec,best.tvec);
+
+    if(hypotheses)
     {
-        
-        //refine pose with inliers
-        Vec3d rvec=prevPoseCam.rvec();
-        Vec3d tvec=prevPoseCam.translation();
-        
-        //create vectors corresponding to subset
-        vector<Point3f> subsetVertices;
-        vector<Point2f> subsetProjections;
-        vector<float> scores;
-        for(unsigned int i=0;i<mSurfaceMatches.size();i++)
+        if(tracked)
+            hypotheses->push_back(PoseHypothesisSet(poseCam, bestScore));
+
+        //symmetric views of the robot can make the best pose jump to the mirrored one, keep the pose
+        //which continues the prediction as well so that the right one survives in next images
+        if(!tracked || !arePosesClose(poseCam, predictedPoseCam, 10.*M_PI/180., 0.01))
         {
-            if(inliers[i])
+            PnpRansacModel::Hypothesis continued;
+            continued.rvec=predictedPoseCam.rvec();
+            continued.tvec=predictedPoseCam.translation();
+            float continuedScore;
+            ransac.score(model, continued, ws, continuedScore);
+            if(model.refine(&ws.inliers[0], continued) && model.isValid(continued))
             {
-                subsetVertices.push_back(mSurfaceMatches[i].objectPoints);
-                subsetProjections.push_back(mSurfaceMatches[i].imagePoints);
-                scores.push_back(mSurfaceMatches[i].score);
+                ransac.score(model, continued, ws, continuedScore);
+                if(continuedScore>minTrackScore)
+                    hypotheses->push_back(PoseHypothesisSet(cv::Affine3d(continued.rvec,continued.tvec), continuedScore));
             }
         }
-        delete[] inliers;
-          
-        //compute pose with all the inliers and the similarity and viewing angle score taken into account
-        robustPnp(subsetVertices, subsetProjections, scores, _mCalib.cameraMatrix, _mCalib.distCoeffs, rvec, tvec);
-
-        poseCam = cv::Affine3d(rvec,tvec);
-        return true;
     }
-    else
-        return false;
+
+    return tracked;
 }
 
 }
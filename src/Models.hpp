@@ -18,6 +18,7 @@
 #include "GH.hpp"
 #include "Grouping.hpp"
 #include "TrackingFcts.hpp"
+#include "Ransac.hpp"
 
 namespace thymio_tracker
 {
@@ -65,8 +66,37 @@ struct PoseHypothesisSet {
     cv::Affine3d pose;
     float score;
     PoseHypothesisSet(){score=0;}
+    PoseHypothesisSet(const cv::Affine3d& _pose, float _score) : pose(_pose), score(_score) {}
 } ;
 
+//are two poses of the same object within maxAngle (rad) and maxDist (m) of each other
+bool arePosesClose(const cv::Affine3d& a, const cv::Affine3d& b, double maxAngle, double maxDist);
+
+//insert a hypothesis in a set sorted by decreasing score which keeps at most maxSize of them,
+//a hypothesis close to one already in the set is merged with it (the best score is kept)
+void insertPoseHypothesis(std::vector<PoseHypothesisSet>& hypotheses, const PoseHypothesisSet& hypothesis,
+                          unsigned int maxSize);
+
+//appearances of the surfaces of a tracked object warped for a view, track reuses them as long as
+//the view of the surface stays in the same bin instead of warping the model in each image
+struct SurfaceTemplateCache {
+    struct Entry {
+        int viewBin[4];//azimuth and elevation of the camera, roll and log distance
+        cv::Size size;
+        cv::Point2f center;//projection of the surface center in the patch
+        cv::Mat patch;
+    };
+    //a few views per surface, to go back and forth between bins and for several hypotheses
+    enum {EntriesPerSurface = 4};
+    //entries of each surface, most recent first
+    std::vector<std::vector<Entry> > surfaces;
+
+    //entry of the bin or 0 if none
+    Entry* find(unsigned int surface, const int* viewBin, const cv::Size& size);
+    void insert(unsigned int surface, const int* viewBin, const cv::Size& size,
+                const cv::Point2f& center, const cv::Mat& patch);
+};
+
 #define surfacePpmm 2. // pixel per millimeter fir appearance definition in planarSurface
 
 struct planarSurface {
@@ -166,7 +196,7 @@ class Object3D
 {
 public:
     //constructor
-    Object3D(){};
+    Object3D() : mParallelTracking(false) {};
     
     // TODO: Remove all this from Object3D? Object3D should not draw itself.
     
@@ -187,8 +217,12 @@ public:
     //project vertices and return them in vector
     //std::vector<cv::Point2f> projectVertices(const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs, const cv::Affine3d &poseCam) const;
     //do pose estimation using projection of vertices and matches from GH
-    //bruteforce pose estimation: all subsets of 4 matches are used to solve PnP until half of matches agree
-    bool getPose(const IntrinsicCalibration& _mCalib, std::vector<DetectionGH> mMatches, cv::Affine3d& robotPose, bool init) const;
+    //ransac pose estimation: samples of 4 matches are used to solve PnP until 3/4 of matches agree
+    //upCam: up direction in camera frame if known from the device IMU, the poses of a robot standing on the floor
+    //are preferred, the others are only tried if none of them is found
+    //workspace: buffers of the ransac estimation to reuse from a call to the other
+    bool getPose(const IntrinsicCalibration& _mCalib, std::vector<DetectionGH> mMatches, cv::Affine3d& robotPose, bool init,
+                 const cv::Vec3d* upCam = 0, RansacWorkspace* workspace = 0) const;
     
     //3D model
     std::vector<cv::Point3f> mVertices;
@@ -208,7 +242,17 @@ public:
 
     //temporary tracking function for develop, will have to be moved to Robot if works
     //void track(const cv::Mat &img, const IntrinsicCalibration &_mCalib, const cv::Affine3d& prevPoseCam, cv::Affine3d& poseCam) const;
-    bool track(const cv::Mat &img, const cv::Mat &prev_img, const IntrinsicCalibration &_mCalib, const cv::Affine3d& prevPoseCam, cv::Affine3d& poseCam) const;
+    //the appearance of the surfaces is taken in prev_img at prevPoseCam and searched for in img around their projection
+    //with predictedPoseCam, in windows sized from the uncertainty of the prediction (sigmaRot in rad, sigmaTrans in m)
+    //hypotheses: if not null, the poses which explain the matches well enough are added to it with their score,
+    //the best one and the one refined from the prediction when the best jumped away from it (symmetric views)
+    //templateCache: warped appearances of the surfaces of this object from previous images
+    bool track(const cv::Mat &img, const cv::Mat &prev_img, const IntrinsicCalibration &_mCalib, const cv::Affine3d& prevPoseCam,
+               const cv::Affine3d& predictedPoseCam, double sigmaRot, double sigmaTrans, cv::Affine3d& poseCam,
+               RansacWorkspace* workspace = 0, std::vector<PoseHypothesisSet>* hypotheses = 0,
+               SurfaceTemplateCache* templateCache = 0) const;
+    //match the surfaces on several threads in track (same result as the sequential matching)
+    void setParallelTracking(bool parallel) {mParallelTracking = parallel;}
 
     
     //groups of vertices in our model
@@ -219,11 +263,8 @@ public:
     // TODO: is this used??
     cv::Affine3d pose;
 
-    //information for time consistency
-    /*int lengthHistory;
-    int nbHypoPerTime;
-    PoseHypothesisSet **PoseHypothesisHistory;//history x hypo (first item is most recent)*/
-
+protected:
+    bool mParallelTracking;
 };
 
 class Camera3dModel: public Object3D
@@ -233,6 +274,9 @@ public:
     Camera3dModel();
 };
 
+//sphere of cameras looking at the robot, from which the geometric hashing table is trained (trainGH, tuneGH)
+void createTrainingCameras(std::vector<Camera3dModel>& vCams);
+
 
 
 class ThymioBlobModel: public Object3D
@@ -241,6 +285,8 @@ public:
     //constructor
     ThymioBlobModel();
     void setBlobModel();
+    //replace the default blob layout, for robots carrying a different marker layout
+    void setBlobModel(const std::vector<cv::Point3f>& _vertices);
     void setEdgePlotModel();
     void setEdgeTrackModel();
     void setSurfacesModel();
@@ -0,0 +1,175 @@
+#include "PatchKernel.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+namespace thymio_tracker
+{
+
+//pixel of the pyramid level, black outside
+static inline int pixelOrZero(const Mat& level, int x, int y)
+{
+    if(x < 0 || y < 0 || x >= level.cols || y >= level.rows)
+        return 0;
+    return level.ptr<uchar>(y)[x];
+}
+
+void warpPatches(const std::vector<cv::Mat>& pyramid, const cv::Matx33d& homography,
+                 const std::vector<cv::Point2f>& points, std::vector<WarpedPatch>& patches)
+{
+    const int halfPatchSize = (nccPatchSize-1)/2;
+    patches.resize(points.size());
+
+    for(unsigned int i=0;i<points.size();i++)
+    {
+        const Point2f& p = points[i];
+        WarpedPatch& patch = patches[i];
+
+        //affine approximation of the homography from the point and its right and bottom neighbours
+        Vec3d s0 = homography*Vec3d(p.x, p.y, 1.);
+        Vec3d s1 = homography*Vec3d(p.x+1., p.y, 1.);
+        Vec3d s2 = homography*Vec3d(p.x, p.y+1., 1.);
+        Point2d c(s0[0]/s0[2], s0[1]/s0[2]);
+        double a00 = s1[0]/s1[2] - c.x, a10 = s1[1]/s1[2] - c.y;
+        double a01 = s2[0]/s2[2] - c.x, a11 = s2[1]/s2[2] - c.y;
+        patch.center = Point2f(c.x, c.y);
+
+        //pyramid level of the template with about the same resolution as the image
+        double det = a00*a11 - a01*a10;
+        unsigned int level = (det > 0) ? std::min(size_t(std::max(int(log(1./det)/log(2)), 0)), pyramid.size()-1) : 0;
+        const Mat& image = pyramid[level];
+        const double rescale = 1./(1 << level);
+
+        //inverse mapping: patch pixel q comes from p + A^-1 (q - center of the patch), in level coordinates
+        double idet = (det != 0) ? 1./det : 0.;
+        double b00 = a11*idet*rescale, b01 = -a01*idet*rescale;
+        double b10 = -a10*idet*rescale, b11 = a00*idet*rescale;
+        double ox = p.x*rescale - halfPatchSize*(b00 + b01);
+        double oy = p.y*rescale - halfPatchSize*(b10 + b11);
+
+        //bilinear interpolation with 8 bit weights
+        int sqNorm = 0;
+        unsigned char* dst = patch.pixels;
+        for(int v=0;v<nccPatchSize;v++)
+            for(int u=0;u<nccPatchSize;u++, dst++)
+            {
+                double sx = ox + b00*u + b01*v;
+                double sy = oy + b10*u + b11*v;
+                int x0 = (int)std::floor(sx), y0 = (int)std::floor(sy);
+                int wx = (int)((sx - x0)*256. + 0.5), wy = (int)((sy - y0)*256. + 0.5);
+
+                int p00, p01, p10, p11;
+                if(x0 >= 0 && y0 >= 0 && x0+1 < image.cols && y0+1 < image.rows)
+                {
+                    const uchar* row0 = image.ptr<uchar>(y0) + x0;
+                    const uchar* row1 = image.ptr<uchar>(y0+1) + x0;
+                    p00 = row0[0]; p01 = row0[1];
+                    p10 = row1[0]; p11 = row1[1];
+                }
+                else
+                {
+                    p00 = pixelOrZero(image, x0, y0); p01 = pixelOrZero(image, x0+1, y0);
+                    p10 = pixelOrZero(image, x0, y0+1); p11 = pixelOrZero(image, x0+1, y0+1);
+                }
+                int top = p00*(256-wx) + p01*wx;
+                int bottom = p10*(256-wx) + p11*wx;
+                int value = (top*(256-wy) + bottom*wy + (1 << 15)) >> 16;
+                *dst = (unsigned char)value;
+                sqNorm += value*value;
+            }
+        patch.sqNorm = sqNorm;
+    }
+}
+
+//sums of image*patch and image^2 over the window, at most 81*255^2 so they fit in 32 bits
+static inline void windowSums(const Mat& image, int x, int y, const unsigned char* patch, int& sumProducts, int& sumSquares)
+{
+#if defined(__SSE2__)
+    //8 first pixels of each row in the vector, the 9th one on its own
+    const __m128i zero = _mm_setzero_si128();
+    __m128i products = zero, squares = zero;
+    int lastProducts = 0, lastSquares = 0;
+    for(int v=0;v<nccPatchSize;v++)
+    {
+        const uchar* row = image.ptr<uchar>(y+v) + x;
+        const uchar* patchRow = patch + v*nccPatchSize;
+        __m128i i16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)row), zero);
+        __m128i t16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)patchRow), zero);
+        products = _mm_add_epi32(products, _mm_madd_epi16(i16, t16));
+        squares = _mm_add_epi32(squares, _mm_madd_epi16(i16, i16));
+        lastProducts += row[8]*patchRow[8];
+        lastSquares += row[8]*row[8];
+    }
+    products = _mm_add_epi32(products, _mm_shuffle_epi32(products, _MM_SHUFFLE(1,0,3,2)));
+    products = _mm_add_epi32(products, _mm_shuffle_epi32(products, _MM_SHUFFLE(2,3,0,1)));
+    squares = _mm_add_epi32(squares, _mm_shuffle_epi32(squares, _MM_SHUFFLE(1,0,3,2)));
+    squares = _mm_add_epi32(squares, _mm_shuffle_epi32(squares, _MM_SHUFFLE(2,3,0,1)));
+    sumProducts = _mm_cvtsi128_si32(products) + lastProducts;
+    sumSquares = _mm_cvtsi128_si32(squares) + lastSquares;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint32x4_t products = vdupq_n_u32(0), squares = vdupq_n_u32(0);
+    int lastProducts = 0, lastSquares = 0;
+    for(int v=0;v<nccPatchSize;v++)
+    {
+        const uchar* row = image.ptr<uchar>(y+v) + x;
+        const uchar* patchRow = patch + v*nccPatchSize;
+        uint8x8_t i8 = vld1_u8(row);
+        uint8x8_t t8 = vld1_u8(patchRow);
+        products = vpadalq_u16(products, vmull_u8(i8, t8));
+        squares = vpadalq_u16(squares, vmull_u8(i8, i8));
+        lastProducts += row[8]*patchRow[8];
+        lastSquares += row[8]*row[8];
+    }
+    uint64x2_t p2 = vpaddlq_u32(products), s2 = vpaddlq_u32(squares);
+    sumProducts = (int)(vgetq_lane_u64(p2, 0) + vgetq_lane_u64(p2, 1)) + lastProducts;
+    sumSquares = (int)(vgetq_lane_u64(s2, 0) + vgetq_lane_u64(s2, 1)) + lastSquares;
+#else
+    sumProducts = sumSquares = 0;
+    for(int v=0;v<nccPatchSize;v++)
+    {
+        const uchar* row = image.ptr<uchar>(y+v) + x;
+        const uchar* patchRow = patch + v*nccPatchSize;
+        for(int u=0;u<nccPatchSize;u++)
+        {
+            sumProducts += row[u]*patchRow[u];
+            sumSquares += row[u]*row[u];
+        }
+    }
+#endif
+}
+
+float patchNcc(const cv::Mat& image, int x, int y, const WarpedPatch& patch)
+{
+    int sumProducts, sumSquares;
+    windowSums(image, x, y, patch.pixels, sumProducts, sumSquares);
+    double norm = std::sqrt((double)sumSquares*patch.sqNorm);
+    return (norm > 0) ? (float)(sumProducts/norm) : 0.f;
+}
+
+float searchPatch(const cv::Mat& image, const cv::Rect& corners, const WarpedPatch& patch, cv::Point& best)
+{
+    float bestNcc = -1.f;
+    best = corners.tl();
+    for(int y=corners.y;y<corners.y+corners.height;y++)
+        for(int x=corners.x;x<corners.x+corners.width;x++)
+        {
+            float ncc = patchNcc(image, x, y, patch);
+            if(ncc > bestNcc)
+            {
+                bestNcc = ncc;
+                best = Point(x, y);
+            }
+        }
+    return bestNcc;
+}
+
+}
@@ -0,0 +1,36 @@
+//warping and normalized cross correlation of the small patches used to search and verify landmark keypoints
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+
+namespace thymio_tracker
+{
+
+static const int nccPatchSize = 9;
+
+//patch of the landmark warped in the current image
+struct WarpedPatch
+{
+    unsigned char pixels[nccPatchSize*nccPatchSize];
+    int sqNorm;//sum of the squared pixels, computed once for all the windows it is compared with
+    cv::Point2f center;//position of the keypoint in the image predicted by the homography
+};
+
+//warp the patches around the points of the template with the affine approximation of the homography
+//at each point, from the level of the template pyramid which is the closest to the local scale.
+//Same patches as cv::warpAffine (bilinear, black outside the template) without the per patch setup.
+void warpPatches(const std::vector<cv::Mat>& pyramid, const cv::Matx33d& homography,
+                 const std::vector<cv::Point2f>& points, std::vector<WarpedPatch>& patches);
+
+//normalized cross correlation of a patch with the window of the image whose top left corner is (x,y),
+//as with CV_TM_CCORR_NORMED. The window has to be inside the image.
+//Integer sums, with SSE2 or NEON when the library is compiled for it.
+float patchNcc(const cv::Mat& image, int x, int y, const WarpedPatch& patch);
+
+//best NCC of a patch among the windows of the image whose top left corners are in corners (all inside the image),
+//the first best one in row order is returned in best, as with minMaxLoc
+float searchPatch(const cv::Mat& image, const cv::Rect& corners, const WarpedPatch& patch, cv::Point& best);
+
+}
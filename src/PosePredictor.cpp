@@ -0,0 +1,132 @@
+#include "PosePredictor.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+namespace thymio_tracker
+{
+
+//spectral density of the (white) accelerations, tuned for a tablet held by hand
+static const double processNoiseRot = 1.;//rad^2/s^3
+static const double processNoiseTrans = 0.1;//m^2/s^3
+//variance of the poses returned by tracking
+static const double measurementNoiseRot = 1e-3*1e-3;//rad^2
+static const double measurementNoiseTrans = 2e-3*2e-3;//m^2
+//standard deviation of the rotation between two frames measured by the IMU of the device
+//(includes the rotation of the tracked object itself, which is slow compared to the handheld device)
+static const double deviceRotationNoise = 3e-3;//rad
+//standard deviation of the unknown velocity after a detection
+static const double initialSigmaAngularVelocity = 0.5;//rad/s
+static const double initialSigmaLinearVelocity = 0.15;//m/s
+
+//covariance of (position,velocity) after dt with constant velocity and white acceleration of density q
+static Matx22d predictCovariance(const Matx22d &P, double dt, double q)
+{
+    Matx22d F(1., dt,
+              0., 1.);
+    Matx22d Q(q*dt*dt*dt/3., q*dt*dt/2.,
+              q*dt*dt/2., q*dt);
+    return F*P*F.t() + Q;
+}
+
+//kalman correction with a measure of the position only, returns the gains on position and velocity
+static Vec2d correctCovariance(Matx22d &P, double r)
+{
+    double S = P(0,0) + r;
+    Vec2d K(P(0,0)/S, P(1,0)/S);
+    Matx22d IKH(1.-K[0], 0.,
+                -K[1], 1.);
+    P = IKH*P;
+    return K;
+}
+
+PosePredictor::PosePredictor()
+    : mAngularVelocity(0,0,0)
+    , mLinearVelocity(0,0,0)
+    , mTimestamp(0)
+    , mNbUpdates(0)
+{
+    reset(Affine3d(), 0.);
+}
+
+void PosePredictor::reset(const Affine3d& pose, double timestamp)
+{
+    mPose = pose;
+    mTimestamp = timestamp;
+    mAngularVelocity = Vec3d(0,0,0);
+    mLinearVelocity = Vec3d(0,0,0);
+    mNbUpdates = 0;
+
+    mCovRot = Matx22d(measurementNoiseRot, 0.,
+                      0., initialSigmaAngularVelocity*initialSigmaAngularVelocity);
+    mCovTrans = Matx22d(measurementNoiseTrans, 0.,
+                        0., initialSigmaLinearVelocity*initialSigmaLinearVelocity);
+}
+
+double PosePredictor::getElapsed(double timestamp) const
+{
+    double dt = timestamp - mTimestamp;
+    return (dt>0) ? dt : 0.;
+}
+
+Affine3d PosePredictor::predict(double timestamp) const
+{
+    double dt = getElapsed(timestamp);
+    return Affine3d(mAngularVelocity*dt, mLinearVelocity*dt) * mPose;
+}
+
+Affine3d PosePredictor::predict(double timestamp, const Matx33d& cameraRotation) const
+{
+    double dt = getElapsed(timestamp);
+    return Affine3d(cameraRotation, mLinearVelocity*dt) * mPose;
+}
+
+void PosePredictor::getUncertainty(double timestamp, double& sigmaRot, double& sigmaTrans, bool rotationMeasured) const
+{
+    double dt = getElapsed(timestamp);
+    if(rotationMeasured)
+        sigmaRot = sqrt(mCovRot(0,0) + deviceRotationNoise*deviceRotationNoise);
+    else
+        sigmaRot = sqrt(predictCovariance(mCovRot, dt, processNoiseRot)(0,0));
+    sigmaTrans = sqrt(predictCovariance(mCovTrans, dt, processNoiseTrans)(0,0));
+}
+
+void PosePredictor::update(const Affine3d& pose, double timestamp)
+{
+    double dt = getElapsed(timestamp);
+    Affine3d posePred = predict(timestamp);
+    mCovRot = predictCovariance(mCovRot, dt, processNoiseRot);
+    mCovTrans = predictCovariance(mCovTrans, dt, processNoiseTrans);
+
+    //innovation: motion from predicted to measured pose, in the tangent space
+    Affine3d innovation = pose * posePred.inv();
+    Vec3d innovRot = innovation.rvec();
+    Vec3d innovTrans = innovation.translation();
+
+    Vec2d KRot = correctCovariance(mCovRot, measurementNoiseRot);
+    Vec2d KTrans = correctCovariance(mCovTrans, measurementNoiseTrans);
+
+    mPose = Affine3d(KRot[0]*innovRot, KTrans[0]*innovTrans) * posePred;
+    if(dt>0)
+    {
+        mAngularVelocity += KRot[1]*innovRot;
+        mLinearVelocity += KTrans[1]*innovTrans;
+    }
+    mTimestamp = std::max(mTimestamp, timestamp);
+    mNbUpdates++;
+}
+
+int PosePredictor::getHalfSearchWindow(double sigmaRot, double sigmaTrans, double focal, double z,
+                                       int minHalfWindow, int maxHalfWindow)
+{
+    //a rotation of the camera moves any point by about f*angle pixels,
+    //a translation by f*t/z
+    double sigmaPix = focal * (sigmaRot + sigmaTrans/std::max(z, 0.01));
+    int halfWindow = (int)ceil(3.*sigmaPix);
+    return std::min(std::max(halfWindow, minHalfWindow), maxHalfWindow);
+}
+
+}
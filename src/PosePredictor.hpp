@@ -0,0 +1,58 @@
+//constant velocity motion model of the pose of a tracked object in the camera frame
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/affine.hpp>
+
+namespace thymio_tracker
+{
+
+//the pose is moved by a velocity (w,v) applied on the left: pose(t+dt) = [Rodrigues(w*dt)|v*dt] * pose(t)
+//so that a rotation of the device only changes w.
+//Rotation and translation are each filtered with a small Kalman filter with state (position, velocity)
+//in the tangent space, the 3 axes share the same 2x2 covariance.
+class PosePredictor
+{
+public:
+    PosePredictor();
+
+    //restart from a detection, the velocity is unknown
+    void reset(const cv::Affine3d& pose, double timestamp);
+
+    //pose extrapolated at timestamp
+    cv::Affine3d predict(double timestamp) const;
+    //same when the rotation of the camera since last update is measured (IMU): it replaces the extrapolated one
+    cv::Affine3d predict(double timestamp, const cv::Matx33d& cameraRotation) const;
+
+    //standard deviation of the pose predicted at timestamp, rotation in rad and translation in m
+    //if the rotation is measured, its uncertainty is the one of the IMU only
+    void getUncertainty(double timestamp, double& sigmaRot, double& sigmaTrans, bool rotationMeasured = false) const;
+
+    //correct the filter with the pose measured at timestamp
+    void update(const cv::Affine3d& pose, double timestamp);
+
+    const cv::Affine3d& getPose() const {return mPose;}
+    double getTimestamp() const {return mTimestamp;}
+    bool hasVelocity() const {return mNbUpdates>0;}
+
+    //half size in pixels of the window in which to search for a point at depth z in front of the camera
+    //(3 sigma of the predicted uncertainty), clamped to [minHalfWindow,maxHalfWindow]
+    static int getHalfSearchWindow(double sigmaRot, double sigmaTrans, double focal, double z,
+                                   int minHalfWindow, int maxHalfWindow);
+
+private:
+    //time elapsed since last pose, a null or negative elapsed time means that no motion is predicted
+    double getElapsed(double timestamp) const;
+
+    cv::Affine3d mPose;
+    cv::Vec3d mAngularVelocity;//rad/s
+    cv::Vec3d mLinearVelocity;//m/s
+    double mTimestamp;
+    int mNbUpdates;
+
+    //covariances of (position,velocity) for rotation and translation
+    cv::Matx22d mCovRot;
+    cv::Matx22d mCovTrans;
+};
+
+}
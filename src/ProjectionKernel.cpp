@@ -0,0 +1,204 @@
+#include "ProjectionKernel.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+namespace thymio_tracker
+{
+
+ProjectionCamera::ProjectionCamera(const IntrinsicCalibration& calib)
+{
+    fx = calib.cameraMatrix.at<double>(0,0);
+    fy = calib.cameraMatrix.at<double>(1,1);
+    cx = calib.cameraMatrix.at<double>(0,2);
+    cy = calib.cameraMatrix.at<double>(1,2);
+
+    double dist[5] = {0,0,0,0,0};
+    if(!calib.distCoeffs.empty())
+    {
+        Mat distCoeffs;
+        calib.distCoeffs.convertTo(distCoeffs, CV_64F);
+        for(int i=0;i<5 && i<(int)distCoeffs.total();i++)
+            dist[i] = distCoeffs.ptr<double>()[i];
+    }
+    k1 = dist[0]; k2 = dist[1]; p1 = dist[2]; p2 = dist[3]; k3 = dist[4];
+}
+
+//rotation and translation in float, as used by the kernel
+struct KernelPose
+{
+    float r00, r01, r02, r10, r11, r12, r20, r21, r22;
+    float t0, t1, t2;
+
+    KernelPose(const Matx33d& R, const Vec3d& t)
+        : r00(R(0,0)), r01(R(0,1)), r02(R(0,2))
+        , r10(R(1,0)), r11(R(1,1)), r12(R(1,2))
+        , r20(R(2,0)), r21(R(2,1)), r22(R(2,2))
+        , t0(t[0]), t1(t[1]), t2(t[2])
+        {}
+};
+
+//one point, used for the points left after the vectorized loops
+static inline bool isReprojectionInlier(const KernelPose& p, const ProjectionCamera& c,
+                                        float X, float Y, float Z, float u, float v, float sqThreshold)
+{
+    float x = p.r00*X + p.r01*Y + p.r02*Z + p.t0;
+    float y = p.r10*X + p.r11*Y + p.r12*Z + p.t1;
+    float z = p.r20*X + p.r21*Y + p.r22*Z + p.t2;
+    if(z <= 0)
+        return false;
+
+    float iz = 1.f/z;
+    float xn = x*iz, yn = y*iz;
+    float xy = xn*yn;
+    float r2 = xn*xn + yn*yn;
+    float radial = 1.f + r2*(c.k1 + r2*(c.k2 + r2*c.k3));
+    float xd = xn*radial + 2.f*c.p1*xy + c.p2*(r2 + 2.f*xn*xn);
+    float yd = yn*radial + c.p1*(r2 + 2.f*yn*yn) + 2.f*c.p2*xy;
+
+    float dx = c.fx*xd + c.cx - u;
+    float dy = c.fy*yd + c.cy - v;
+    return dx*dx + dy*dy < sqThreshold;
+}
+
+int countReprojectionInliers(const Matx33d& R, const Vec3d& t, const ProjectionCamera& camera,
+                             const float* X, const float* Y, const float* Z,
+                             const float* u, const float* v, const float* weights,
+                             int n, float sqThreshold, unsigned char* mask, float& score)
+{
+    const KernelPose pose(R, t);
+    int nbInliers = 0;
+    score = 0;
+    int i = 0;
+
+#if defined(__AVX2__)
+    {
+        const __m256 r00 = _mm256_set1_ps(pose.r00), r01 = _mm256_set1_ps(pose.r01), r02 = _mm256_set1_ps(pose.r02);
+        const __m256 r10 = _mm256_set1_ps(pose.r10), r11 = _mm256_set1_ps(pose.r11), r12 = _mm256_set1_ps(pose.r12);
+        const __m256 r20 = _mm256_set1_ps(pose.r20), r21 = _mm256_set1_ps(pose.r21), r22 = _mm256_set1_ps(pose.r22);
+        const __m256 t0 = _mm256_set1_ps(pose.t0), t1 = _mm256_set1_ps(pose.t1), t2 = _mm256_set1_ps(pose.t2);
+        const __m256 fx = _mm256_set1_ps(camera.fx), fy = _mm256_set1_ps(camera.fy);
+        const __m256 cx = _mm256_set1_ps(camera.cx), cy = _mm256_set1_ps(camera.cy);
+        const __m256 k1 = _mm256_set1_ps(camera.k1), k2 = _mm256_set1_ps(camera.k2), k3 = _mm256_set1_ps(camera.k3);
+        const __m256 p1 = _mm256_set1_ps(camera.p1), p2 = _mm256_set1_ps(camera.p2);
+        const __m256 one = _mm256_set1_ps(1.f), two = _mm256_set1_ps(2.f), zero = _mm256_setzero_ps();
+        const __m256 thr = _mm256_set1_ps(sqThreshold);
+        __m256 scoreAcc = _mm256_setzero_ps();
+
+        for(;i+8<=n;i+=8)
+        {
+            __m256 Xi = _mm256_loadu_ps(X+i), Yi = _mm256_loadu_ps(Y+i), Zi = _mm256_loadu_ps(Z+i);
+            __m256 x = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r00,Xi), _mm256_mul_ps(r01,Yi)), _mm256_add_ps(_mm256_mul_ps(r02,Zi), t0));
+            __m256 y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r10,Xi), _mm256_mul_ps(r11,Yi)), _mm256_add_ps(_mm256_mul_ps(r12,Zi), t1));
+            __m256 z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r20,Xi), _mm256_mul_ps(r21,Yi)), _mm256_add_ps(_mm256_mul_ps(r22,Zi), t2));
+
+            __m256 iz = _mm256_div_ps(one, z);
+            __m256 xn = _mm256_mul_ps(x, iz), yn = _mm256_mul_ps(y, iz);
+            __m256 xy = _mm256_mul_ps(xn, yn);
+            __m256 xx = _mm256_mul_ps(xn, xn), yy = _mm256_mul_ps(yn, yn);
+            __m256 r2 = _mm256_add_ps(xx, yy);
+            __m256 radial = _mm256_add_ps(one, _mm256_mul_ps(r2, _mm256_add_ps(k1, _mm256_mul_ps(r2, _mm256_add_ps(k2, _mm256_mul_ps(r2, k3))))));
+            __m256 xd = _mm256_add_ps(_mm256_mul_ps(xn, radial),
+                        _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(two, p1), xy), _mm256_mul_ps(p2, _mm256_add_ps(r2, _mm256_mul_ps(two, xx)))));
+            __m256 yd = _mm256_add_ps(_mm256_mul_ps(yn, radial),
+                        _mm256_add_ps(_mm256_mul_ps(p1, _mm256_add_ps(r2, _mm256_mul_ps(two, yy))), _mm256_mul_ps(_mm256_mul_ps(two, p2), xy)));
+
+            __m256 dx = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(fx, xd), cx), _mm256_loadu_ps(u+i));
+            __m256 dy = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(fy, yd), cy), _mm256_loadu_ps(v+i));
+            __m256 sqErr = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+
+            __m256 inlier = _mm256_and_ps(_mm256_cmp_ps(sqErr, thr, _CMP_LT_OQ), _mm256_cmp_ps(z, zero, _CMP_GT_OQ));
+            int bits = _mm256_movemask_ps(inlier);
+            //count while unpacking, no popcount builtin on all the compilers
+            for(int j=0;j<8;j++)
+            {
+                mask[i+j] = (bits>>j)&1;
+                nbInliers += mask[i+j];
+            }
+            if(weights)
+                scoreAcc = _mm256_add_ps(scoreAcc, _mm256_and_ps(inlier, _mm256_loadu_ps(weights+i)));
+        }
+
+        float scores[8];
+        _mm256_storeu_ps(scores, scoreAcc);
+        for(int j=0;j<8;j++)
+            score += scores[j];
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    {
+        const float32x4_t one = vdupq_n_f32(1.f), two = vdupq_n_f32(2.f), zero = vdupq_n_f32(0.f);
+        const float32x4_t thr = vdupq_n_f32(sqThreshold);
+        float32x4_t scoreAcc = vdupq_n_f32(0.f);
+        uint32x4_t countAcc = vdupq_n_u32(0);
+
+        for(;i+4<=n;i+=4)
+        {
+            float32x4_t Xi = vld1q_f32(X+i), Yi = vld1q_f32(Y+i), Zi = vld1q_f32(Z+i);
+            float32x4_t x = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(pose.t0), Xi, pose.r00), Yi, pose.r01), Zi, pose.r02);
+            float32x4_t y = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(pose.t1), Xi, pose.r10), Yi, pose.r11), Zi, pose.r12);
+            float32x4_t z = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(pose.t2), Xi, pose.r20), Yi, pose.r21), Zi, pose.r22);
+
+#if defined(__aarch64__)
+            float32x4_t iz = vdivq_f32(one, z);
+#else
+            //reciprocal estimate refined with two Newton steps
+            float32x4_t iz = vrecpeq_f32(z);
+            iz = vmulq_f32(vrecpsq_f32(z, iz), iz);
+            iz = vmulq_f32(vrecpsq_f32(z, iz), iz);
+#endif
+            float32x4_t xn = vmulq_f32(x, iz), yn = vmulq_f32(y, iz);
+            float32x4_t xy = vmulq_f32(xn, yn);
+            float32x4_t xx = vmulq_f32(xn, xn), yy = vmulq_f32(yn, yn);
+            float32x4_t r2 = vaddq_f32(xx, yy);
+            float32x4_t radial = vmlaq_f32(one, r2, vmlaq_f32(vdupq_n_f32(camera.k1), r2, vmlaq_n_f32(vdupq_n_f32(camera.k2), r2, camera.k3)));
+            float32x4_t xd = vmlaq_n_f32(vmlaq_n_f32(vmulq_f32(xn, radial), xy, 2.f*camera.p1), vmlaq_f32(r2, two, xx), camera.p2);
+            float32x4_t yd = vmlaq_n_f32(vmlaq_n_f32(vmulq_f32(yn, radial), vmlaq_f32(r2, two, yy), camera.p1), xy, 2.f*camera.p2);
+
+            float32x4_t dx = vsubq_f32(vmlaq_n_f32(vdupq_n_f32(camera.cx), xd, camera.fx), vld1q_f32(u+i));
+            float32x4_t dy = vsubq_f32(vmlaq_n_f32(vdupq_n_f32(camera.cy), yd, camera.fy), vld1q_f32(v+i));
+            float32x4_t sqErr = vmlaq_f32(vmulq_f32(dx, dx), dy, dy);
+
+            uint32x4_t inlier = vandq_u32(vcltq_f32(sqErr, thr), vcgtq_f32(z, zero));
+            uint32x4_t inlierBit = vshrq_n_u32(inlier, 31);
+            mask[i] = vgetq_lane_u32(inlierBit, 0);
+            mask[i+1] = vgetq_lane_u32(inlierBit, 1);
+            mask[i+2] = vgetq_lane_u32(inlierBit, 2);
+            mask[i+3] = vgetq_lane_u32(inlierBit, 3);
+            countAcc = vaddq_u32(countAcc, inlierBit);
+            if(weights)
+                scoreAcc = vaddq_f32(scoreAcc, vreinterpretq_f32_u32(vandq_u32(inlier, vreinterpretq_u32_f32(vld1q_f32(weights+i)))));
+        }
+
+        uint32_t counts[4];
+        float scores[4];
+        vst1q_u32(counts, countAcc);
+        vst1q_f32(scores, scoreAcc);
+        for(int j=0;j<4;j++)
+        {
+            nbInliers += counts[j];
+            score += scores[j];
+        }
+    }
+#endif
+
+    //scalar path, and points left after the vectorized loop
+    for(;i<n;i++)
+    {
+        mask[i] = isReprojectionInlier(pose, camera, X[i], Y[i], Z[i], u[i], v[i], sqThreshold);
+        nbInliers += mask[i];
+        if(weights && mask[i])
+            score += weights[i];
+    }
+
+    if(!weights)
+        score = nbInliers;
+    return nbInliers;
+}
+
+}
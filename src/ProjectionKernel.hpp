@@ -0,0 +1,31 @@
+//fused reprojection kernel used to verify pose hypotheses
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include "Generic.hpp"
+
+namespace thymio_tracker
+{
+
+//camera model of the kernel: pinhole with radial (k1,k2,k3) and tangential (p1,p2) distortion,
+//same as projectPoints with 4 or 5 coefficients (the rational model ones are ignored)
+struct ProjectionCamera
+{
+    float fx, fy, cx, cy;
+    float k1, k2, p1, p2, k3;
+
+    ProjectionCamera(const IntrinsicCalibration& calib);
+};
+
+//transform the points (X,Y,Z) with [R|t], project and distort them and compare them with the measured
+//projections (u,v) in pixels, in one pass over the points: mask[i] = squared error < sqThreshold
+//(points behind the camera are outliers). Returns the nb of inliers and the sum of their weights in score,
+//or their number if weights is null.
+//Uses AVX2 or NEON when the library is compiled for it, 8 or 4 points at a time.
+int countReprojectionInliers(const cv::Matx33d& R, const cv::Vec3d& t, const ProjectionCamera& camera,
+                             const float* X, const float* Y, const float* Z,
+                             const float* u, const float* v, const float* weights,
+                             int n, float sqThreshold, unsigned char* mask, float& score);
+
+}
@@ -0,0 +1,304 @@
+#include "Ransac.hpp"
+#include "TrackingFcts.hpp"
+
+#include <opencv2/calib3d.hpp>
+
+using namespace cv;
+using namespace std;
+
+namespace thymio_tracker
+{
+
+void UniformSampler::getSample(RNG& rng, int* sample)
+{
+    for(int i=0;i<m;i++)
+    {
+        //draw without replacement
+        bool unique;
+        do
+        {
+            sample[i] = rng.uniform(0,N);
+            unique = true;
+            for(int j=0;j<i;j++)
+                if(sample[j]==sample[i])
+                    unique = false;
+        }
+        while(!unique);
+    }
+}
+
+ProsacSampler::ProsacSampler(int _nbMatches, int _sampleSize, int _nbSamplesRansac)
+    : N(_nbMatches), m(_sampleSize), n(_sampleSize), t(0), Tn_prime(1)
+{
+    //average number of samples drawn only from the n best matches, for n=m
+    Tn = _nbSamplesRansac;
+    for(int i=0;i<m;i++)
+        Tn *= (double)(m-i)/(N-i);
+}
+
+void ProsacSampler::getSample(RNG& rng, int* sample)
+{
+    t++;
+    //grow the sampling set
+    if(t==Tn_prime && n<N)
+    {
+        double Tn_next = Tn*(n+1)/(n+1-m);
+        Tn_prime += (int)std::ceil(Tn_next-Tn);
+        Tn = Tn_next;
+        n++;
+    }
+
+    //the newest match of the set is always in the sample, unless the schedule is behind
+    int nbRandom = m;
+    if(Tn_prime>=t)
+    {
+        sample[m-1] = n-1;
+        nbRandom = m-1;
+    }
+    int setSize = (nbRandom==m) ? n : n-1;
+    for(int i=0;i<nbRandom;i++)
+    {
+        //draw without replacement
+        bool unique;
+        do
+        {
+            sample[i] = rng.uniform(0,setSize);
+            unique = true;
+            for(int j=0;j<i;j++)
+                if(sample[j]==sample[i])
+                    unique = false;
+        }
+        while(!unique);
+    }
+}
+
+
+PnpRansacModel::PnpRansacModel(const IntrinsicCalibration& calib,
+                               const vector<Point3f>& objectPoints,
+                               const vector<Point2f>& imagePoints,
+                               const vector<float>& weights,
+                               RansacWorkspace& workspace)
+    : mCalib(calib)
+    , mObjectPoints(objectPoints)
+    , mImagePoints(imagePoints)
+    , mWorkspace(workspace)
+    , mCamera(calib)
+    , mUseGuess(false)
+    , mIsValid(0)
+    , mIsValidData(0)
+{
+    const int n = objectPoints.size();
+    mWorkspace.resize(n);
+    mWorkspace.weights.assign(weights.begin(), weights.end());
+    for(int i=0;i<n;i++)
+    {
+        mWorkspace.X[i] = objectPoints[i].x;
+        mWorkspace.Y[i] = objectPoints[i].y;
+        mWorkspace.Z[i] = objectPoints[i].z;
+        mWorkspace.u[i] = imagePoints[i].x;
+        mWorkspace.v[i] = imagePoints[i].y;
+    }
+}
+
+int PnpRansacModel::solve(const int* sample, Hypothesis* solutions) const
+{
+    Point3f sampleObject[SampleSize];
+    Point2f sampleImage[SampleSize];
+    for(int i=0;i<SampleSize;i++)
+    {
+        sampleObject[i] = mObjectPoints[sample[i]];
+        sampleImage[i] = mImagePoints[sample[i]];
+    }
+    //headers on the stack arrays, no copy
+    Mat sampleObjectMat(SampleSize, 1, CV_32FC3, sampleObject);
+    Mat sampleImageMat(SampleSize, 1, CV_32FC2, sampleImage);
+
+    Hypothesis& h = solutions[0];
+    bool solved;
+    if(mUseGuess)
+    {
+        h = mGuess;
+        solved = solvePnP(sampleObjectMat, sampleImageMat, mCalib.cameraMatrix, mCalib.distCoeffs, h.rvec, h.tvec, true);
+    }
+    else
+        solved = solvePnP(sampleObjectMat, sampleImageMat, mCalib.cameraMatrix, mCalib.distCoeffs, h.rvec, h.tvec, false, SOLVEPNP_P3P);
+    return solved ? 1 : 0;
+}
+
+int PnpRansacModel::inliers(const Hypothesis& h, float sqThreshold, const float* weights, unsigned char* mask, float& score) const
+{
+    Matx33d R;
+    Rodrigues(h.rvec, R);
+    const RansacWorkspace& ws = mWorkspace;
+    return countReprojectionInliers(R, h.tvec, mCamera, &ws.X[0], &ws.Y[0], &ws.Z[0], &ws.u[0], &ws.v[0],
+                                    weights, size(), sqThreshold, mask, score);
+}
+
+bool PnpRansacModel::refine(const unsigned char* inliers, Hypothesis& h) const
+{
+    RansacWorkspace& ws = mWorkspace;
+    ws.refineObject.clear();
+    ws.refineFrom.clear();
+    ws.refineWeights.clear();
+    for(int i=0;i<size();i++)
+        if(inliers[i])
+        {
+            ws.refineObject.push_back(mObjectPoints[i]);
+            ws.refineFrom.push_back(mImagePoints[i]);
+            if(!ws.weights.empty())
+                ws.refineWeights.push_back(ws.weights[i]);
+        }
+    if(ws.refineObject.size() < (unsigned int)SampleSize)
+        return false;
+
+    //weighted when the correspondences have different qualities
+    if(ws.weights.empty())
+        return solvePnP(ws.refineObject, ws.refineFrom, mCalib.cameraMatrix, mCalib.distCoeffs, h.rvec, h.tvec, true);
+    else
+        return robustPnp(ws.refineObject, ws.refineFrom, ws.refineWeights, mCalib.cameraMatrix, mCalib.distCoeffs, h.rvec, h.tvec);
+}
+
+
+bool homographyFrom4Points(const Point2f* from, const Point2f* to, Matx33d& H)
+{
+    //h22 = 1, each correspondence gives two rows of the system
+    Matx<double,8,8> A;
+    Vec<double,8> b, x;
+    for(int i=0;i<4;i++)
+    {
+        A(i,0) = A(i+4,3) = from[i].x;
+        A(i,1) = A(i+4,4) = from[i].y;
+        A(i,2) = A(i+4,5) = 1;
+        A(i,3) = A(i,4) = A(i,5) = 0;
+        A(i+4,0) = A(i+4,1) = A(i+4,2) = 0;
+        A(i,6) = -from[i].x*to[i].x;
+        A(i,7) = -from[i].y*to[i].x;
+        A(i+4,6) = -from[i].x*to[i].y;
+        A(i+4,7) = -from[i].y*to[i].y;
+        b[i] = to[i].x;
+        b[i+4] = to[i].y;
+    }
+
+    if(!cv::solve(A, b, x, DECOMP_LU))
+        return false;
+
+    H = Matx33d(x[0], x[1], x[2],
+                x[3], x[4], x[5],
+                x[6], x[7], 1.);
+    return true;
+}
+
+HomographyRansacModel::HomographyRansacModel(const vector<Point2f>& from,
+                                             const vector<Point2f>& to,
+                                             RansacWorkspace& workspace)
+    : mFrom(from)
+    , mTo(to)
+    , mWorkspace(workspace)
+{
+    const int n = from.size();
+    mWorkspace.resize(n);
+    mWorkspace.weights.clear();
+    for(int i=0;i<n;i++)
+    {
+        mWorkspace.X[i] = from[i].x;
+        mWorkspace.Y[i] = from[i].y;
+        mWorkspace.u[i] = to[i].x;
+        mWorkspace.v[i] = to[i].y;
+    }
+}
+
+int HomographyRansacModel::solve(const int* sample, Hypothesis* solutions) const
+{
+    Point2f sampleFrom[SampleSize];
+    Point2f sampleTo[SampleSize];
+    for(int i=0;i<SampleSize;i++)
+    {
+        sampleFrom[i] = mFrom[sample[i]];
+        sampleTo[i] = mTo[sample[i]];
+    }
+    return homographyFrom4Points(sampleFrom, sampleTo, solutions[0]) ? 1 : 0;
+}
+
+bool HomographyRansacModel::isValid(const Hypothesis& h) const
+{
+    //degenerated samples (3 aligned points) give singular matrices
+    return std::abs(determinant(h)) > FLT_EPSILON;
+}
+
+int HomographyRansacModel::inliers(const Hypothesis& h, float sqThreshold, const float* weights, unsigned char* mask, float& score) const
+{
+    const float h00 = h(0,0), h01 = h(0,1), h02 = h(0,2);
+    const float h10 = h(1,0), h11 = h(1,1), h12 = h(1,2);
+    const float h20 = h(2,0), h21 = h(2,1), h22 = h(2,2);
+
+    const int n = size();
+    const float* X = &mWorkspace.X[0];
+    const float* Y = &mWorkspace.Y[0];
+    const float* u = &mWorkspace.u[0];
+    const float* v = &mWorkspace.v[0];
+    int nbInliers = 0;
+    score = 0;
+    for(int i=0;i<n;i++)
+    {
+        float w = h20*X[i] + h21*Y[i] + h22;
+        float iw = (std::abs(w) > FLT_EPSILON) ? 1.f/w : 0.f;
+        float dx = (h00*X[i] + h01*Y[i] + h02)*iw - u[i];
+        float dy = (h10*X[i] + h11*Y[i] + h12)*iw - v[i];
+        mask[i] = (iw != 0.f) && (dx*dx + dy*dy < sqThreshold);
+        nbInliers += mask[i];
+        if(weights && mask[i])
+            score += weights[i];
+    }
+    if(!weights)
+        score = nbInliers;
+    return nbInliers;
+}
+
+bool HomographyRansacModel::refine(const unsigned char* inliers, Hypothesis& h) const
+{
+    RansacWorkspace& ws = mWorkspace;
+    ws.refineFrom.clear();
+    ws.refineTo.clear();
+    for(int i=0;i<size();i++)
+        if(inliers[i])
+        {
+            ws.refineFrom.push_back(mFrom[i]);
+            ws.refineTo.push_back(mTo[i]);
+        }
+    if(ws.refineFrom.size() < (unsigned int)SampleSize)
+        return false;
+
+    //least squares on all the inliers
+    Mat H = findHomography(ws.refineFrom, ws.refineTo, 0);
+    if(H.empty())
+        return false;
+    h = Matx33d(H);
+    return true;
+}
+
+Mat findHomographyRansac(const vector<Point2f>& from, const vector<Point2f>& to,
+                         float threshold, vector<unsigned char>& mask, RansacWorkspace& workspace)
+{
+    HomographyRansacModel model(from, to, workspace);
+    Ransac<HomographyRansacModel> ransac;
+    ransac.setThreshold(threshold);
+    ransac.setConfidence(0.995);
+    ransac.setMaxTrials(2000);
+
+    //same seed for each call to get the same result on the same image
+    RNG rng(0x7c3a);
+    UniformSampler sampler(from.size(), HomographyRansacModel::SampleSize);
+    Matx33d H;
+    float score;
+    int nbInliers = ransac.run(model, sampler, rng, workspace, H, score);
+
+    if(nbInliers < HomographyRansacModel::SampleSize)
+    {
+        mask.assign(from.size(), 0);
+        return Mat();
+    }
+    mask.assign(workspace.bestInliers.begin(), workspace.bestInliers.end());
+    return Mat(H);
+}
+
+}
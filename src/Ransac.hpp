@@ -0,0 +1,334 @@
+//hypothesize and verify engine shared by the pose and homography estimations
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+#include "Generic.hpp"
+#include "ProjectionKernel.hpp"
+
+namespace thymio_tracker
+{
+
+//scratch buffers of the estimation, stored with the detection they are used for so that they are
+//allocated once and reused from frame to frame. The data is stored as structure of arrays
+//so that the hypotheses are checked on all the points with vectorized kernels
+struct RansacWorkspace
+{
+    //model points (z is not used for homographies)
+    std::vector<float> X, Y, Z;
+    //image points in pixels
+    std::vector<float> u, v;
+    //quality of each correspondence, empty if all the same
+    std::vector<float> weights;
+
+    //inliers of the hypothesis being checked and of the best one so far
+    std::vector<unsigned char> inliers;
+    std::vector<unsigned char> bestInliers;
+
+    //inlier correspondences to refine a hypothesis
+    std::vector<cv::Point3f> refineObject;
+    std::vector<cv::Point2f> refineFrom;
+    std::vector<cv::Point2f> refineTo;
+    std::vector<float> refineWeights;
+
+    void resize(int n)
+    {
+        X.resize(n); Y.resize(n); Z.resize(n);
+        u.resize(n); v.resize(n);
+        inliers.resize(n);
+        bestInliers.resize(n);
+    }
+};
+
+//draw samples of m indexes uniformly among N without replacement
+class UniformSampler
+{
+public:
+    UniformSampler(int _nbMatches, int _sampleSize)
+        : N(_nbMatches), m(_sampleSize)
+        {}
+
+    void getSample(cv::RNG& rng, int* sample);
+
+private:
+    int N, m;
+};
+
+//PROSAC sampling: the matches are sorted by quality, the samples are first drawn from the few
+//best matches and the set they are drawn from grows progressively to all the matches
+//(Chum and Matas, Matching with PROSAC - Progressive Sample Consensus)
+class ProsacSampler
+{
+public:
+    ProsacSampler(int _nbMatches, int _sampleSize, int _nbSamplesRansac);
+
+    //draw the next sample, indexes are positions in the sorted list
+    void getSample(cv::RNG& rng, int* sample);
+
+private:
+    int N, m, n, t;
+    double Tn;
+    int Tn_prime;
+};
+
+//hypothesize and verify loop with local optimization (LO-RANSAC) and adaptive stopping
+//Model has to define:
+//  typedef ... Hypothesis;
+//  enum {SampleSize = .., MaxSolutions = ..};
+//  int size() const;                                           nb of correspondences
+//  int solve(const int* sample, Hypothesis* solutions) const;  minimal solver, returns nb of solutions
+//  bool isValid(const Hypothesis& h) const;                    plausibility check before scoring
+//  int inliers(const Hypothesis& h, float sqThreshold, const float* weights, unsigned char* mask, float& score) const;
+//                                                               points with squared error in pixels < sqThreshold,
+//                                                               nb and weighted score (nb if no weights) in one pass
+//  bool refine(const unsigned char* inliers, Hypothesis& h) const;  least squares fit on the inliers, from h
+//The Sampler has to define void getSample(cv::RNG&, int* sample).
+template<class Model>
+class Ransac
+{
+public:
+    typedef typename Model::Hypothesis Hypothesis;
+
+    Ransac()
+        : mThreshold(2.)
+        , mConfidence(0.99)
+        , mMaxTrials(100)
+        , mStopInlierRatio(1.)
+        , mNbLocalOptim(1)
+        {}
+
+    //inlier threshold in pixels
+    void setThreshold(float threshold) {mThreshold = threshold;}
+    //probability to have drawn an outlier free sample when stopping
+    void setConfidence(float confidence) {mConfidence = confidence;}
+    void setMaxTrials(int maxTrials) {mMaxTrials = maxTrials;}
+    //stop as soon as a hypothesis has strictly more than this ratio of inliers (1 = never)
+    void setStopInlierRatio(float ratio) {mStopInlierRatio = ratio;}
+    //nb of refinements on the inliers when a new best hypothesis is found, 0 for plain ransac
+    void setLocalOptimization(int nbIterations) {mNbLocalOptim = nbIterations;}
+
+    //check a hypothesis, the inliers are stored in workspace.inliers
+    //returns the nb of inliers and their summed weights in score
+    int score(const Model& model, const Hypothesis& h, RansacWorkspace& workspace, float& score) const;
+
+    //run the estimation, if hasInitialGuess the hypothesis in best is checked before sampling
+    //returns the nb of inliers of the best hypothesis and its score, its inliers are in workspace.bestInliers
+    //and the hypothesis is refined on them
+    template<class Sampler>
+    int run(const Model& model, Sampler& sampler, cv::RNG& rng, RansacWorkspace& workspace,
+            Hypothesis& best, float& bestScore, bool hasInitialGuess = false) const;
+
+protected:
+    //nb of trials needed to draw an outlier free sample with mConfidence
+    int getNbTrialsNeeded(float inlierRatio) const;
+    //keep h if better than the best hypothesis so far
+    bool keepIfBetter(const Hypothesis& h, int nbInliers, float score, RansacWorkspace& workspace,
+                      Hypothesis& best, int& bestNbInliers, float& bestScore) const;
+
+    float mThreshold;
+    float mConfidence;
+    int mMaxTrials;
+    float mStopInlierRatio;
+    int mNbLocalOptim;
+};
+
+template<class Model>
+int Ransac<Model>::score(const Model& model, const Hypothesis& h, RansacWorkspace& workspace, float& score) const
+{
+    const float* weights = workspace.weights.empty() ? 0 : &workspace.weights[0];
+    return model.inliers(h, mThreshold*mThreshold, weights, &workspace.inliers[0], score);
+}
+
+template<class Model>
+int Ransac<Model>::getNbTrialsNeeded(float inlierRatio) const
+{
+    double pGoodSample = std::pow((double)inlierRatio, (int)Model::SampleSize);
+    if(pGoodSample <= DBL_EPSILON)
+        return mMaxTrials;
+    if(pGoodSample >= 1.)
+        return 1;
+    double nbTrials = std::log(1.-mConfidence)/std::log(1.-pGoodSample);
+    return (nbTrials < mMaxTrials) ? (int)std::ceil(nbTrials) : mMaxTrials;
+}
+
+template<class Model>
+bool Ransac<Model>::keepIfBetter(const Hypothesis& h, int nbInliers, float score, RansacWorkspace& workspace,
+                                 Hypothesis& best, int& bestNbInliers, float& bestScore) const
+{
+    //most inliers, the weights only break ties
+    if(nbInliers < bestNbInliers || (nbInliers == bestNbInliers && score <= bestScore))
+        return false;
+
+    best = h;
+    bestNbInliers = nbInliers;
+    bestScore = score;
+    workspace.bestInliers.swap(workspace.inliers);
+    return true;
+}
+
+template<class Model>
+template<class Sampler>
+int Ransac<Model>::run(const Model& model, Sampler& sampler, cv::RNG& rng, RansacWorkspace& workspace,
+                       Hypothesis& best, float& bestScore, bool hasInitialGuess) const
+{
+    const int n = model.size();
+    int bestNbInliers = 0;
+    bestScore = 0;
+    if(n < (int)Model::SampleSize)
+        return 0;
+
+    workspace.inliers.resize(n);
+    workspace.bestInliers.resize(n);
+
+    Hypothesis solutions[Model::MaxSolutions];
+    int sample[Model::SampleSize];
+    int nbTrialsNeeded = mMaxTrials;
+    bool stop = false;
+
+    for(int trial=-1;trial<nbTrialsNeeded && !stop;trial++)
+    {
+        //first "trial" is the initial guess
+        int nbSolutions = 0;
+        if(trial<0)
+        {
+            if(!hasInitialGuess)
+                continue;
+            solutions[0] = best;
+            nbSolutions = 1;
+        }
+        else
+        {
+            sampler.getSample(rng, sample);
+            nbSolutions = model.solve(sample, solutions);
+        }
+
+        for(int s=0;s<nbSolutions && !stop;s++)
+        {
+            if(!model.isValid(solutions[s]))
+                continue;
+
+            float score;
+            int nbInliers = this->score(model, solutions[s], workspace, score);
+            if(!keepIfBetter(solutions[s], nbInliers, score, workspace, best, bestNbInliers, bestScore))
+                continue;
+
+            //local optimization: fit on the inliers and check again, as long as it improves
+            for(int lo=0;lo<mNbLocalOptim;lo++)
+            {
+                Hypothesis refined = best;
+                if(!model.refine(&workspace.bestInliers[0], refined) || !model.isValid(refined))
+                    break;
+                nbInliers = this->score(model, refined, workspace, score);
+                if(!keepIfBetter(refined, nbInliers, score, workspace, best, bestNbInliers, bestScore))
+                    break;
+            }
+
+            nbTrialsNeeded = getNbTrialsNeeded((float)bestNbInliers/n);
+            stop = (bestNbInliers > mStopInlierRatio*n);
+        }
+    }
+
+    if(bestNbInliers < (int)Model::SampleSize)
+        return bestNbInliers;
+
+    //final fit on the inliers of the best hypothesis, kept unless it loses inliers
+    Hypothesis refined = best;
+    if(model.refine(&workspace.bestInliers[0], refined) && model.isValid(refined))
+    {
+        float score;
+        int nbInliers = this->score(model, refined, workspace, score);
+        if(nbInliers >= bestNbInliers)
+        {
+            best = refined;
+            bestNbInliers = nbInliers;
+            bestScore = score;
+            workspace.bestInliers.swap(workspace.inliers);
+        }
+    }
+    return bestNbInliers;
+}
+
+
+//pose of an object from 3D-2D correspondences
+//hypotheses are computed with P3P (the 4th point selects the right solution)
+//or with iterative PnP from an initial guess
+class PnpRansacModel
+{
+public:
+    struct Hypothesis
+    {
+        cv::Vec3d rvec;
+        cv::Vec3d tvec;
+    };
+    enum {SampleSize = 4, MaxSolutions = 1};
+
+    //fills the workspace, weights (can be empty) are used for the score and the refinement
+    PnpRansacModel(const IntrinsicCalibration& calib,
+                   const std::vector<cv::Point3f>& objectPoints,
+                   const std::vector<cv::Point2f>& imagePoints,
+                   const std::vector<float>& weights,
+                   RansacWorkspace& workspace);
+
+    //use iterative PnP from this pose instead of P3P for the minimal samples
+    void setInitialGuess(const Hypothesis& guess) {mGuess = guess; mUseGuess = true;}
+    //reject the hypotheses which fail this test
+    void setValidityCheck(bool (*isValid)(const Hypothesis&, const void*), const void* data)
+        {mIsValid = isValid; mIsValidData = data;}
+
+    int size() const {return mObjectPoints.size();}
+    int solve(const int* sample, Hypothesis* solutions) const;
+    bool isValid(const Hypothesis& h) const {return !mIsValid || mIsValid(h, mIsValidData);}
+    int inliers(const Hypothesis& h, float sqThreshold, const float* weights, unsigned char* mask, float& score) const;
+    bool refine(const unsigned char* inliers, Hypothesis& h) const;
+
+private:
+    const IntrinsicCalibration& mCalib;
+    const std::vector<cv::Point3f>& mObjectPoints;
+    const std::vector<cv::Point2f>& mImagePoints;
+    RansacWorkspace& mWorkspace;
+    ProjectionCamera mCamera;
+
+    bool mUseGuess;
+    Hypothesis mGuess;
+    bool (*mIsValid)(const Hypothesis&, const void*);
+    const void* mIsValidData;
+};
+
+//homography between two planes, hypotheses from 4 points, refined with least squares
+class HomographyRansacModel
+{
+public:
+    typedef cv::Matx33d Hypothesis;
+    enum {SampleSize = 4, MaxSolutions = 1};
+
+    HomographyRansacModel(const std::vector<cv::Point2f>& from,
+                          const std::vector<cv::Point2f>& to,
+                          RansacWorkspace& workspace);
+
+    int size() const {return mFrom.size();}
+    int solve(const int* sample, Hypothesis* solutions) const;
+    bool isValid(const Hypothesis& h) const;
+    int inliers(const Hypothesis& h, float sqThreshold, const float* weights, unsigned char* mask, float& score) const;
+    bool refine(const unsigned char* inliers, Hypothesis& h) const;
+
+private:
+    const std::vector<cv::Point2f>& mFrom;
+    const std::vector<cv::Point2f>& mTo;
+    RansacWorkspace& mWorkspace;
+};
+
+//homography from 4 correspondences, solved as a 8x8 linear system without allocation
+//returns false if the points are degenerated
+bool homographyFrom4Points(const cv::Point2f* from, const cv::Point2f* to, cv::Matx33d& H);
+
+//ransac estimation of a homography, drop in replacement of findHomography(from, to, CV_RANSAC, threshold, mask)
+//which reuses the buffers of workspace. Returns an empty matrix if none was found
+cv::Mat findHomographyRansac(const std::vector<cv::Point2f>& from, const std::vector<cv::Point2f>& to,
+                             float threshold, std::vector<unsigned char>& mask, RansacWorkspace& workspace);
+
+}
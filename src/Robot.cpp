@@ -3,6 +3,8 @@
 
 #include <stdexcept>
 #include <numeric>
+#include <algorithm>
+#include <cstdio>
 
 #include <opencv2/core.hpp>
 #include <opencv2/calib3d.hpp>
@@ -20,56 +22,132 @@ void Robot::init(IntrinsicCalibration *_mCalibration_ptr,
               cv::FileStorage& robotModelStorage)
 {
     mCalibration_ptr = _mCalibration_ptr;
+    mDetectionPeriod = 10;
+    mNbHypotheses = 3;
+
+    //marker layouts of the models stored in the GH file, loading the GH releases the storage
+    //so read them first. Files trained for a single robot do not have any and use the default layout
+    std::vector<std::vector<cv::Point3f> > layouts;
+    for(int m=0;;m++)
+    {
+        char layoutName[100];
+        sprintf(layoutName, "modelVertices_%d", m);
+        cv::FileNode layoutNode = geomHashingStorage[layoutName];
+        if(layoutNode.empty())
+            break;
+
+        std::vector<cv::Point3f> layout;
+        layoutNode >> layout;
+        layouts.push_back(layout);
+    }
+
     //mGH.loadFromStream(geomHashingStream);
     mGH.loadFromFileStorage(geomHashingStorage);
     mGH.setCalibration(mCalibration_ptr);
+    //stop voting for a blob once its id is decided
+    mGH.setEarlyExit(true);
+
+    //create all the models in place
+    mModels.resize(mGH.getNbModels());
+    for(unsigned int m=0;m<mModels.size();m++)
+    {
+        if(m<layouts.size())
+            mModels[m].setBlobModel(layouts[m]);
+        mModels[m].setParallelTracking(true);
+        if((int)mModels[m].mVertices.size() != mGH.getNbIdsInModel(m))
+            throw std::runtime_error("Robot::init > model layout does not match GH ids!");
+    }
 
-    mModel.readSurfaceLearned(robotModelStorage);
+    //all the robots share the same appearance, the storage is released once read
+    mModels[0].readSurfaceLearned(robotModelStorage);
+    for(unsigned int m=1;m<mModels.size();m++)
+        for(unsigned int v=0;v<mModels[m].mPlanarSurfaces.size();v++)
+            if(!mModels[m].mPlanarSurfaces[v].isSymetricCopy)
+                mModels[m].mPlanarSurfaces[v].mImage = mModels[0].mPlanarSurfaces[v].mImage;
 }
 
 
 void Robot::find(const cv::Mat& input,
           const cv::Mat& prevImage,
+          double timestamp,
+          const DeviceRotation* deviceRotation,
           RobotDetection& mDetectionInfo) const
 {
     mDetectionInfo.clearBlobs();
+    mDetectionInfo.mTimestamp = timestamp;
     IntrinsicCalibration& mCalibration = *mCalibration_ptr;
 
-    //if robot was not found in previous image then run Geometric Hashing
-    if(!mDetectionInfo.isFound())
+    //track the robots found in previous image, the lost ones are removed
+    //the search starts from the pose predicted with the motion of each robot,
+    //the rotation of the device measured by the IMU replaces the extrapolated one
+    bool rotationMeasured = deviceRotation && deviceRotation->hasInterFrame;
+    std::vector<RobotInstance> trackedInstances;
+    for(unsigned int i=0;i<mDetectionInfo.mInstances.size();i++)
     {
-        this->findFromBlobGroupsAndGH(input,mDetectionInfo);
-        //mDetectionInfo.robotFound = false;
-
-        //if robot has been found init tracks
-        if(mDetectionInfo.robotFound)
+        RobotInstance& instance = mDetectionInfo.mInstances[i];
+
+        //each hypothesis is tracked from the predicted pose, the ones which still explain the image are kept
+        std::vector<PoseHypothesisSet> candidates;
+        std::vector<PoseHypothesisSet> newHypotheses;
+        cv::Affine3d predictedPose;
+        double sigmaRot, sigmaTrans;
+        auto trackHypotheses = [&](bool useRotation)
         {
-            //for now lets just estimate the homography between top view and image
-            //and do PnP from that.
+            predictedPose = useRotation ? instance.motion.predict(timestamp, deviceRotation->interFrame)
+                                        : instance.motion.predict(timestamp);
+            instance.motion.getUncertainty(timestamp, sigmaRot, sigmaTrans, useRotation);
 
-            //have blob pos listed in mRobot
-            //project model 3D points to get current keypoint position
-            //std::vector<cv::Point2f> vprojVertices;
-            //projectPoints(mModel.mVertices, mDetectionInfo.mPose.rvec(), mDetectionInfo.mPose.translation(), mCalibration.cameraMatrix, mCalibration.distCoeffs, vprojVertices);
-    
-            //add to tracking correspondences
-            //mDetectionInfo.mCorrespondences.clear();
-            //for(unsigned int i=0;i<vprojVertices.size();i++)
-            //    mDetectionInfo.mCorrespondences[i]=vprojVertices[i];
+            //the motion is applied on the left so the same one moves all the hypotheses
+            cv::Affine3d motion = predictedPose * instance.pose.inv();
 
-            //find homography
-            //mDetectionInfo.mHomography = cv::findHomography(mModel.mVerticesTopPos, vprojVertices);
+            newHypotheses.clear();
+            for(unsigned int h=0;h<instance.hypotheses.size();h++)
+            {
+                const cv::Affine3d& hypothesisPose = instance.hypotheses[h].pose;
+                cv::Affine3d newPose;
+                candidates.clear();
+                mModels[instance.model].track(input, prevImage, mCalibration, hypothesisPose,
+                                              motion * hypothesisPose, sigmaRot, sigmaTrans, newPose,
+                                              &mDetectionInfo.mRansacWorkspace, &candidates, &instance.templateCache);
+                for(unsigned int c=0;c<candidates.size();c++)
+                    insertPoseHypothesis(newHypotheses, candidates[c], mNbHypotheses);
+            }
+        };
+        trackHypotheses(rotationMeasured);
+        //the rotation of the IMU is not checked against the images (wrong axes mapping, timestamps...):
+        //if the robot is lost with it, search again from the extrapolated motion and its wider window
+        if(newHypotheses.empty() && rotationMeasured)
+            trackHypotheses(false);
+
+        //lost only when all the hypotheses are
+        if(newHypotheses.empty())
+            continue;
 
-        }
+        instance.hypotheses.swap(newHypotheses);
+        const cv::Affine3d& newPose = instance.hypotheses[0].pose;
+        //the velocity is only valid if the best hypothesis continues the previous one
+        if(arePosesClose(newPose, predictedPose, 3.*sigmaRot + 10.*M_PI/180., 3.*sigmaTrans + 0.01))
+            instance.motion.update(newPose, timestamp);
+        else
+            instance.motion.reset(newPose, timestamp);
+        instance.pose = newPose;
+        trackedInstances.push_back(instance);
     }
-    else
+    mDetectionInfo.mInstances.swap(trackedInstances);
+
+    //if no robot was found in previous image then run Geometric Hashing,
+    //if some are tracked, look for new ones from time to time only
+    mDetectionInfo.framesSinceDetection++;
+    if(mDetectionInfo.mInstances.empty() || mDetectionInfo.framesSinceDetection >= mDetectionPeriod)
     {
-        cv::Affine3d newPose;
-        mDetectionInfo.robotFound = mModel.track(input, prevImage, mCalibration, mDetectionInfo.mPose, newPose);
-        
-        if(mDetectionInfo.robotFound)
-            mDetectionInfo.mPose = newPose;
+        this->findFromBlobGroupsAndGH(input,mDetectionInfo,deviceRotation);
+        mDetectionInfo.framesSinceDetection = 0;
     }
+
+    mDetectionInfo.robotFound = !mDetectionInfo.mInstances.empty();
+    if(mDetectionInfo.robotFound)
+        mDetectionInfo.mPose = mDetectionInfo.mInstances[0].pose;
+
     /*else
     {
         //robot was found in previous image => can do tracking
@@ -157,7 +235,8 @@ void Robot::find(const cv::Mat& input,
 }
 
 void Robot::findFromBlobGroupsAndGH(const cv::Mat& image,
-                                 RobotDetection& mDetectionInfo) const
+                                 RobotDetection& mDetectionInfo,
+                                 const DeviceRotation* deviceRotation) const
 {
     //get the pairs which are likely to belong to group of blobs from model
     mGrouping.getBlobsAndPairs(image,
@@ -177,13 +256,89 @@ void Robot::findFromBlobGroupsAndGH(const cv::Mat& image,
     mGrouping.getQuadripletsFromTriplets(mDetectionInfo.blobTriplets,
                                          mDetectionInfo.blobQuadriplets);
     
+    //the blobs of the robots already tracked should not vote for new ones:
+    //remove the blobs which are in the projected top of a tracked robot
+    std::vector<cv::Rect> trackedBoxes;
+    for(unsigned int i=0;i<mDetectionInfo.mInstances.size();i++)
+    {
+        const RobotInstance& instance = mDetectionInfo.mInstances[i];
+        std::vector<cv::Point2f> vprojVertices;
+        cv::projectPoints(mModels[instance.model].mVertices, instance.pose.rvec(), instance.pose.translation(),
+                          mCalibration_ptr->cameraMatrix, mCalibration_ptr->distCoeffs, vprojVertices);
+        cv::Rect box = cv::boundingRect(vprojVertices);
+        //add some margin around the blobs
+        int margin = std::max(box.width, box.height)/4;
+        trackedBoxes.push_back(cv::Rect(box.x-margin, box.y-margin, box.width+2*margin, box.height+2*margin));
+    }
+    if(!trackedBoxes.empty())
+    {
+        std::vector<cv::KeyPoint> freeBlobs;
+        for(unsigned int b=0;b<mDetectionInfo.blobsinTriplets.size();b++)
+        {
+            bool inTrackedRobot = false;
+            for(unsigned int i=0;i<trackedBoxes.size();i++)
+                if(trackedBoxes[i].contains(mDetectionInfo.blobsinTriplets[b].pt))
+                    inTrackedRobot = true;
+            if(!inTrackedRobot)
+                freeBlobs.push_back(mDetectionInfo.blobsinTriplets[b]);
+        }
+        mDetectionInfo.blobsinTriplets.swap(freeBlobs);
+    }
+    
     //extract blobs and identify which one fit model, return set of positions and Id
-    mGH.getModelPointsFromImage(mDetectionInfo.blobsinTriplets, mDetectionInfo.matches);
+    //all the models are voted for at once
+    //the scratch buffers of the query live in the detection to be reused from frame to frame
+    mGH.getModelPointsFromImage(mDetectionInfo.blobsinTriplets, mDetectionInfo.matches, mDetectionInfo.mGHWorkspace);
     
-    mDetectionInfo.robotFound = mModel.getPose(*mCalibration_ptr,
-                                               mDetectionInfo.matches,
-                                               mDetectionInfo.mPose,
-                                               mDetectionInfo.robotFound);
+    //with the IMU, the poses which do not have the robot standing on the floor can be rejected
+    cv::Vec3d upCam;
+    const cv::Vec3d* upCamPtr = 0;
+    if(deviceRotation && deviceRotation->hasOrientation)
+    {
+        upCam = deviceRotation->upInCamera();
+        upCamPtr = &upCam;
+    }
+
+    //estimate the pose of each model from its matches
+    for(unsigned int m=0;m<mModels.size();m++)
+    {
+        std::vector<DetectionGH> modelMatches;
+        for(unsigned int i=0;i<mDetectionInfo.matches.size();i++)
+            if(mDetectionInfo.matches[i].model == (int)m)
+                modelMatches.push_back(mDetectionInfo.matches[i]);
+
+        cv::Affine3d pose;
+        if(mModels[m].getPose(*mCalibration_ptr, modelMatches, pose, false, upCamPtr, &mDetectionInfo.mRansacWorkspace))
+        {
+            //check that this is not a robot which is already tracked, if it is, the detected pose
+            //becomes one of its hypotheses so that a wrong tracked one can be dropped
+            bool alreadyTracked = false;
+            for(unsigned int i=0;i<mDetectionInfo.mInstances.size() && !alreadyTracked;i++)
+            {
+                RobotInstance& instance = mDetectionInfo.mInstances[i];
+                if(instance.model == (int)m && cv::norm(instance.pose.translation() - pose.translation()) < 0.05)
+                {
+                    alreadyTracked = true;
+                    bool known = false;
+                    for(unsigned int h=0;h<instance.hypotheses.size();h++)
+                        if(arePosesClose(instance.hypotheses[h].pose, pose, 10.*M_PI/180., 0.01))
+                            known = true;
+                    if(!known)
+                    {
+                        //replaces the worst hypothesis, with its score so that it does not
+                        //become the best one before being tracked
+                        float score = instance.hypotheses.back().score;
+                        if(instance.hypotheses.size() >= mNbHypotheses)
+                            instance.hypotheses.pop_back();
+                        instance.hypotheses.push_back(PoseHypothesisSet(pose, score));
+                    }
+                }
+            }
+
+            if(!alreadyTracked)
+                mDetectionInfo.mInstances.push_back(RobotInstance(m,pose,mDetectionInfo.mTimestamp));
+        }
+    }
 }
 
 
@@ -9,6 +9,7 @@
 #include "GHscale.hpp"
 #include "Models.hpp"
 #include "Grouping.hpp"
+#include "PosePredictor.hpp"
 
 
 namespace thymio_tracker
@@ -25,12 +26,19 @@ public:
               cv::FileStorage& geomHashingStorage,
               cv::FileStorage& robotModelStorage);
     
+    //timestamp of image in seconds, used to predict the motion of the tracked robots
+    //deviceRotation: orientation from the IMU if available, gives the rotation part of the prediction
     void find(const cv::Mat& image,
               const cv::Mat& prevImage,
+              double timestamp,
+              const DeviceRotation* deviceRotation,
               RobotDetection& detection) const;
 
+    //look for the robots which are not tracked yet, all the models are searched
+    //for with a single blob extraction and geometric hashing pass
     void findFromBlobGroupsAndGH(const cv::Mat& image,
-                                 RobotDetection& detection) const;
+                                 RobotDetection& detection,
+                                 const DeviceRotation* deviceRotation = 0) const;
 
     /*void findCorrespondencesWithTracking(const cv::Mat& image,
                                 const cv::Mat& prevImage,
@@ -46,7 +54,8 @@ public:
     
     //find homography from top view to current image
     
-    const ThymioBlobModel& model() const {return mModel;}
+    unsigned int getNbModels() const {return mModels.size();}
+    const ThymioBlobModel& model(unsigned int _model = 0) const {return mModels[_model];}
     
 private:
     //calibration
@@ -54,8 +63,32 @@ private:
 
     //for detection
     Grouping mGrouping;
-    GHscale mGH;
-    ThymioBlobModel mModel;
+    GHscale mGH;//one table for all the models
+    //one model per marker layout, the surfaces hold pointers to each other
+    //so the models are created in place and never copied
+    std::vector<ThymioBlobModel> mModels;
+
+    //when some robots are tracked, look for new ones every detectionPeriod frames only
+    int mDetectionPeriod;
+
+    //nb of poses kept for each tracked robot, the robot is lost when all of them are
+    unsigned int mNbHypotheses;
+};
+
+//one recognized robot
+struct RobotInstance
+{
+    int model;//index of the model (marker layout) in Robot
+    cv::Affine3d pose;//best hypothesis
+    PosePredictor motion;//to predict the pose in next image
+    //poses tracked in parallel, sorted by score (best first), to survive the ambiguous views
+    std::vector<PoseHypothesisSet> hypotheses;
+    //appearances of the surfaces warped in previous images
+    SurfaceTemplateCache templateCache;
+
+    RobotInstance(int _model, const cv::Affine3d& _pose, double timestamp)
+        : model(_model), pose(_pose), hypotheses(1, PoseHypothesisSet(_pose, 0.f))
+        {motion.reset(_pose, timestamp);}
 };
 
 class RobotDetection
@@ -65,12 +98,17 @@ class RobotDetection
 public:
     RobotDetection()
         : robotFound(false)
+        , framesSinceDetection(0)
+        , mTimestamp(0)
         {}
     
     //const cv::Mat& getHomography() const {return mHomography;}
+    //pose of the first instance found
     const cv::Affine3d& getPose() const {return mPose;}
     //const std::map<int, cv::Point2f>& getCorrespondences() const {return mCorrespondences;}
     const bool& isFound() const {return robotFound;}
+    //all the robots found in the last image
+    const std::vector<RobotInstance>& getInstances() const {return mInstances;}
 
     void clearBlobs();
     void drawBlobs(cv::Mat* output) const;
@@ -80,6 +118,9 @@ protected:
     bool robotFound;
     //cv::Mat mHomography;
     cv::Affine3d mPose;
+    std::vector<RobotInstance> mInstances;
+    int framesSinceDetection;
+    double mTimestamp;//of the last image
     
     //temporal detection variables
     std::vector<cv::KeyPoint> blobs;
@@ -88,6 +129,8 @@ protected:
     std::vector<BlobQuadruplets> blobQuadriplets;
     std::vector<cv::KeyPoint> blobsinTriplets;
     std::vector<DetectionGH> matches;
+    GHscaleWorkspace mGHWorkspace;
+    RansacWorkspace mRansacWorkspace;
 
     //temporary tracking variables
     //std::map<int, cv::Point2f> mCorrespondences;
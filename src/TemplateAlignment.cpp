@@ -0,0 +1,255 @@
+#include "TemplateAlignment.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/imgproc.hpp>
+
+using namespace cv;
+using namespace std;
+
+namespace thymio_tracker
+{
+
+void TemplateAligner::build(const std::vector<cv::Mat>& templatePyramid, int maxSamples)
+{
+    //gradient under which a pixel brings little to the alignment, in grey levels per pixel
+    const float minGradient = 4.f;
+
+    mLevels.assign(templatePyramid.size(), Level());
+    for(unsigned int l=0;l<templatePyramid.size();l++)
+    {
+        const Mat& image = templatePyramid[l];
+        Level& level = mLevels[l];
+        level.center = Point2d((image.cols-1)/2., (image.rows-1)/2.);
+        level.scale = std::max(image.cols, image.rows)/2.;
+        level.hessianInverse = Matx<double, 8, 8>::zeros();
+        if(image.cols < 8 || image.rows < 8)
+            continue;
+
+        Mat gx, gy;
+        Sobel(image, gx, CV_32F, 1, 0, 3, 1./8);
+        Sobel(image, gy, CV_32F, 0, 1, 3, 1./8);
+
+        //strongest gradient of each cell of a grid, so that the samples are spread over the template
+        int cellSize = std::max(1, (int)std::ceil(std::sqrt((double)image.cols*image.rows/maxSamples)));
+        for(int cy=1;cy<image.rows-1;cy+=cellSize)
+            for(int cx=1;cx<image.cols-1;cx+=cellSize)
+            {
+                float bestGradient = minGradient*minGradient;
+                int bestX = -1, bestY = -1;
+                for(int y=cy;y<std::min(cy+cellSize, image.rows-1);y++)
+                {
+                    const float* gxRow = gx.ptr<float>(y);
+                    const float* gyRow = gy.ptr<float>(y);
+                    for(int x=cx;x<std::min(cx+cellSize, image.cols-1);x++)
+                    {
+                        float gradient = gxRow[x]*gxRow[x] + gyRow[x]*gyRow[x];
+                        if(gradient > bestGradient)
+                        {
+                            bestGradient = gradient;
+                            bestX = x;
+                            bestY = y;
+                        }
+                    }
+                }
+                if(bestX < 0)
+                    continue;
+
+                //gradient kept in the steepest descent slots until the intensities are normalized
+                Sample sample;
+                sample.x = (bestX - level.center.x)/level.scale;
+                sample.y = (bestY - level.center.y)/level.scale;
+                sample.value = image.at<uchar>(bestY, bestX);
+                sample.steepest[0] = gx.at<float>(bestY, bestX);
+                sample.steepest[1] = gy.at<float>(bestY, bestX);
+                level.samples.push_back(sample);
+            }
+        if(level.samples.size() < 8)
+        {
+            level.samples.clear();
+            continue;
+        }
+
+        //zero mean and unit variance intensities
+        double sum = 0., sumSq = 0.;
+        for(auto& sample : level.samples)
+        {
+            sum += sample.value;
+            sumSq += sample.value*sample.value;
+        }
+        double mean = sum/level.samples.size();
+        double stdDev = std::sqrt(std::max(sumSq/level.samples.size() - mean*mean, 0.));
+        if(stdDev < 1.)
+        {
+            level.samples.clear();
+            continue;
+        }
+
+        //jacobian of the warp at identity for H = [1+p0 p1 p2; p3 1+p4 p5; p6 p7 1], in normalized coordinates
+        Matx<double, 8, 8> hessian = Matx<double, 8, 8>::zeros();
+        for(auto& sample : level.samples)
+        {
+            double dx = sample.steepest[0]*level.scale/stdDev;
+            double dy = sample.steepest[1]*level.scale/stdDev;
+            double u = sample.x, v = sample.y;
+            double radial = dx*u + dy*v;
+            double steepest[8] = {dx*u, dx*v, dx, dy*u, dy*v, dy, -radial*u, -radial*v};
+
+            sample.value = (sample.value - mean)/stdDev;
+            for(int i=0;i<8;i++)
+            {
+                sample.steepest[i] = steepest[i];
+                for(int j=0;j<8;j++)
+                    hessian(i, j) += steepest[i]*steepest[j];
+            }
+        }
+        if(!invert(hessian, level.hessianInverse, DECOMP_CHOLESKY))
+            level.samples.clear();
+    }
+}
+
+size_t TemplateAligner::memory() const
+{
+    size_t memory = mLevels.size()*sizeof(Level);
+    for(auto& level : mLevels)
+        memory += level.samples.capacity()*sizeof(Sample);
+    return memory;
+}
+
+//bilinear interpolation, false outside the image
+static inline bool interpolate(const Mat& image, double x, double y, float& value)
+{
+    int x0 = (int)std::floor(x), y0 = (int)std::floor(y);
+    if(x0 < 0 || y0 < 0 || x0+1 >= image.cols || y0+1 >= image.rows)
+        return false;
+
+    float wx = (float)(x - x0), wy = (float)(y - y0);
+    const uchar* row0 = image.ptr<uchar>(y0) + x0;
+    const uchar* row1 = image.ptr<uchar>(y0+1) + x0;
+    value = (row0[0]*(1.f-wx) + row0[1]*wx)*(1.f-wy) + (row1[0]*(1.f-wx) + row1[1]*wx)*wy;
+    return true;
+}
+
+float TemplateAligner::align(const std::vector<cv::Mat>& imagePyramid, cv::Matx33d& homography, AlignmentWorkspace& workspace) const
+{
+    const int maxIterations = 10;
+    const double minStep = 0.03;//displacement of the template corners in pixels under which a level has converged
+    const unsigned int minSamples = 32;
+
+    if(mLevels.empty() || imagePyramid.empty())
+        return -1.f;
+
+    float score = -1.f;
+    for(int k=imagePyramid.size()-1;k>=0;k--)
+    {
+        const Mat& image = imagePyramid[k];
+
+        //template level with about the resolution of the image level, from the scale at the center of the template
+        const Point2d& c = mLevels[0].center;
+        Vec3d s0 = homography*Vec3d(c.x, c.y, 1.);
+        Vec3d s1 = homography*Vec3d(c.x+1., c.y, 1.);
+        Vec3d s2 = homography*Vec3d(c.x, c.y+1., 1.);
+        double a00 = s1[0]/s1[2] - s0[0]/s0[2], a10 = s1[1]/s1[2] - s0[1]/s0[2];
+        double a01 = s2[0]/s2[2] - s0[0]/s0[2], a11 = s2[1]/s2[2] - s0[1]/s0[2];
+        double det = a00*a11 - a01*a10;
+        if(!(det > 0.))
+            return -1.f;
+        int l = cvRound(k - 0.5*std::log(det)/std::log(2.));
+        l = std::min(std::max(l, 0), (int)mLevels.size()-1);
+        const Level& level = mLevels[l];
+        if(level.samples.size() < minSamples)
+            continue;
+
+        //warp from the normalized coordinates of the template level to the image level
+        const double toTemplate = 1 << l, toImage = 1./(1 << k);
+        const Matx33d normalization(level.scale*toTemplate, 0., level.center.x*toTemplate,
+                                    0., level.scale*toTemplate, level.center.y*toTemplate,
+                                    0., 0., 1.);
+        const Matx33d imageScale(toImage, 0., 0., 0., toImage, 0., 0., 0., 1.);
+        Matx33d warp = imageScale*homography*normalization;
+
+        const unsigned int nbSamples = level.samples.size();
+        workspace.values.resize(nbSamples);
+        workspace.valid.resize(nbSamples);
+        for(int it=0;it<maxIterations;it++)
+        {
+            //image at the warped samples
+            double sum = 0., sumSq = 0.;
+            unsigned int nbValid = 0;
+            for(unsigned int i=0;i<nbSamples;i++)
+            {
+                const Sample& sample = level.samples[i];
+                double w = warp(2, 0)*sample.x + warp(2, 1)*sample.y + warp(2, 2);
+                bool valid = false;
+                if(w > 0.)
+                {
+                    double x = (warp(0, 0)*sample.x + warp(0, 1)*sample.y + warp(0, 2))/w;
+                    double y = (warp(1, 0)*sample.x + warp(1, 1)*sample.y + warp(1, 2))/w;
+                    valid = interpolate(image, x, y, workspace.values[i]);
+                }
+                workspace.valid[i] = valid;
+                if(valid)
+                {
+                    sum += workspace.values[i];
+                    sumSq += workspace.values[i]*workspace.values[i];
+                    nbValid++;
+                }
+            }
+            //most of the template out of the image
+            if(nbValid < minSamples || nbValid*10 < nbSamples)
+                return -1.f;
+            double mean = sum/nbValid;
+            double variance = sumSq/nbValid - mean*mean;
+            if(variance < 1.)
+                return -1.f;
+            double invStdDev = 1./std::sqrt(variance);
+
+            //error with the template, as the image normalized the same way
+            Matx<double, 8, 1> gradient = Matx<double, 8, 1>::zeros();
+            double ncc = 0.;
+            for(unsigned int i=0;i<nbSamples;i++)
+            {
+                if(!workspace.valid[i])
+                    continue;
+                const Sample& sample = level.samples[i];
+                double value = (workspace.values[i] - mean)*invStdDev;
+                double error = value - sample.value;
+                ncc += value*sample.value;
+                for(int j=0;j<8;j++)
+                    gradient(j) += sample.steepest[j]*error;
+            }
+            score = (float)(ncc/nbValid);
+
+            //inverse compositional update
+            Matx<double, 8, 1> dp = level.hessianInverse*gradient;
+            Matx33d step(1.+dp(0), dp(1), dp(2),
+                         dp(3), 1.+dp(4), dp(5),
+                         dp(6), dp(7), 1.);
+            warp = warp*step.inv();
+            if(!(std::abs(warp(2, 2)) > 1e-12))
+                return -1.f;
+            warp *= 1./warp(2, 2);
+
+            //largest displacement of the template corners by the step
+            double maxDisplacement = 0.;
+            for(int corner=0;corner<4;corner++)
+            {
+                Vec3d p((corner & 1) ? 1. : -1., (corner & 2) ? 1. : -1., 1.);
+                Vec3d q = step*p;
+                maxDisplacement = std::max(maxDisplacement, norm(Vec2d(q[0]/q[2] - p[0], q[1]/q[2] - p[1])));
+            }
+            if(!(maxDisplacement*level.scale >= minStep))
+                break;
+        }
+
+        homography = imageScale.inv()*warp*normalization.inv();
+        if(!(std::abs(homography(2, 2)) > 1e-12))
+            return -1.f;
+        homography *= 1./homography(2, 2);
+    }
+
+    return score;
+}
+
+}
@@ -0,0 +1,56 @@
+//direct alignment of a planar template to an image: inverse compositional homography solver (Baker & Matthews),
+//the steepest descent images and the hessian only depend on the template and are computed once
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+
+namespace thymio_tracker
+{
+
+//buffers of an alignment, one per detection
+struct AlignmentWorkspace
+{
+    std::vector<cv::Mat> imageLevels;
+    std::vector<float> values;//warped image at the samples
+    std::vector<unsigned char> valid;//if the sample is inside the image
+};
+
+class TemplateAligner
+{
+public:
+    //samples of each level of the template pyramid, on the strongest gradients of a grid of at most maxSamples cells
+    void build(const std::vector<cv::Mat>& templatePyramid, int maxSamples = 1024);
+    void clear() {mLevels.clear();}
+    bool empty() const {return mLevels.empty();}
+    //bytes of the samples
+    size_t memory() const;
+
+    //refine the homography from the template (level 0) to the image (level 0), coarse to fine on the levels
+    //of the image pyramid (each half the size of the previous one). The intensities are normalized
+    //so that the alignment is not sensitive to gain and bias.
+    //Returns the zero mean NCC of the samples at the finest level, -1 if the alignment failed
+    float align(const std::vector<cv::Mat>& imagePyramid, cv::Matx33d& homography, AlignmentWorkspace& workspace) const;
+
+private:
+    struct Sample
+    {
+        float x, y;//normalized coordinates in the template
+        float value;//normalized intensity
+        float steepest[8];//gradient times jacobian of the warp at identity
+    };
+
+    struct Level
+    {
+        std::vector<Sample> samples;
+        cv::Matx<double, 8, 8> hessianInverse;
+        //normalized coordinates: (x - center)/scale, to keep the hessian well conditioned
+        cv::Point2d center;
+        double scale;
+    };
+
+    std::vector<Level> mLevels;
+};
+
+}
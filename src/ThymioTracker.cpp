@@ -4,10 +4,12 @@
 #include <vector>
 #include <stdexcept>
 #include <fstream>
+#include <algorithm>
 
 #include <opencv2/core.hpp>
 #include <opencv2/calib3d.hpp>
 #include <opencv2/imgproc.hpp>
+#include <opencv2/core/utility.hpp>
 
 namespace thymio_tracker
 {
@@ -83,6 +85,44 @@ void drawAxes(cv::Mat& image, const cv::Mat& orientation)
     }
 }
 
+//finds the landmarks in a range, to dispatch them on several threads
+class LandmarkFinder : public cv::ParallelLoopBody
+{
+public:
+    LandmarkFinder(const std::vector<Landmark>& _landmarks, const cv::Mat& _image, const cv::Mat& _prevImage,
+                   const IntrinsicCalibration& _calibration, const std::vector<cv::KeyPoint>& _keypoints,
+                   const std::vector<std::vector<DescriptorIndex::Match> >& _descriptorMatches,
+                   const DeviceRotation* _deviceRotation, const std::vector<cv::Mat>* _imagePyramid,
+                   std::vector<LandmarkDetection>& _detections)
+        : landmarks(_landmarks), image(_image), prevImage(_prevImage), calibration(_calibration), keypoints(_keypoints)
+        , descriptorMatches(_descriptorMatches), deviceRotation(_deviceRotation), imagePyramid(_imagePyramid)
+        , detections(_detections)
+    {}
+
+    void operator()(const cv::Range& range) const
+    {
+        for(int l=range.start;l<range.end;l++)
+        {
+            //with direct tracking, the found landmarks are aligned, the others are detected with the features
+            if(imagePyramid && detections[l].isFound() && landmarks[l].isAlignmentPrepared())
+                landmarks[l].track(*imagePyramid, calibration, detections[l]);
+            else
+                landmarks[l].find(image, prevImage, calibration, keypoints, descriptorMatches[l], deviceRotation, detections[l]);
+        }
+    }
+
+private:
+    const std::vector<Landmark>& landmarks;
+    const cv::Mat& image;
+    const cv::Mat& prevImage;
+    const IntrinsicCalibration& calibration;
+    const std::vector<cv::KeyPoint>& keypoints;
+    const std::vector<std::vector<DescriptorIndex::Match> >& descriptorMatches;
+    const DeviceRotation* deviceRotation;
+    const std::vector<cv::Mat>* imagePyramid;//null without direct tracking
+    std::vector<LandmarkDetection>& detections;
+};
+
 ThymioTracker::ThymioTracker(const std::string& configPath)
 {
     std::string configFile; configFile = configPath + "Config.xml";
@@ -118,6 +158,41 @@ ThymioTracker::ThymioTracker(const std::string& configPath)
 
     init(calibrationFile, geomHashingFile, robotModelFile, landmarkFiles);
 
+    //optional feature type, the landmark files have to be made for it
+    std::string featureType;
+    fs["featureType"]>> featureType;
+    if(!featureType.empty() && featureTypeFromName(featureType) != mFeatureType)
+    {
+        std::cerr << "The landmarks use " << featureTypeName(mFeatureType) << " features, not " << featureType << std::endl;
+        throw std::runtime_error("Landmark files do not match the feature type of the configuration!");
+    }
+
+    //optional direct tracking of the found landmarks
+    int directLandmarkTracking = 0;
+    fs["directLandmarkTracking"]>> directLandmarkTracking;
+    if(directLandmarkTracking)
+        setDirectLandmarkTracking(true);
+
+    //optional memory for the landmark templates, in MB
+    int landmarkMemoryBudget = 0;
+    fs["landmarkMemoryBudget"]>> landmarkMemoryBudget;
+    if(landmarkMemoryBudget > 0)
+        setLandmarkMemoryBudget((size_t)landmarkMemoryBudget << 20);
+
+    //optional vocabulary of the landmarks
+    std::string vocabularyFile;
+    fs["vocabularyFile"]>> vocabularyFile;
+    if(!vocabularyFile.empty())
+    {
+        vocabularyFile = configPath + vocabularyFile;
+        cv::FileStorage vocabularyStorage(vocabularyFile, cv::FileStorage::READ);
+        if(!vocabularyStorage.isOpened())
+        {
+            std::cerr << "Could not open " << vocabularyFile << std::endl;
+            throw std::runtime_error("Vocabulary file not found!");
+        }
+        loadVocabulary(vocabularyStorage);
+    }
 }
 ThymioTracker::ThymioTracker(const std::string& calibrationFile,
                              const std::string& externalFolder,
@@ -157,16 +232,13 @@ void ThymioTracker::init(const std::string& calibrationFile,
         throw std::runtime_error("Robot model File not found!");
     }
 
-    std::vector<cv::FileStorage> landmarkStorages;
+    //only the descriptors of binary files are loaded, their templates are loaded when the landmarks are found.
+    //FileStorage files are parsed with their templates anyway, those are kept until the memory budget is exceeded
+    std::vector<Landmark> landmarks;
     for(auto& landmarkFile : landmarkFiles)
-    {
-        cv::FileStorage fs(landmarkFile, cv::FileStorage::READ);
-        if(!fs.isOpened())
-            throw std::runtime_error("Marker file not found");
-        landmarkStorages.push_back(fs);
-    }
+        landmarks.push_back(Landmark::fromFile(landmarkFile, false));
     
-    init(calibrationStorage, geomHashingStorage, robotModelStorage, landmarkStorages);    
+    init(calibrationStorage, geomHashingStorage, robotModelStorage, landmarks);    
 }
 
 ThymioTracker::ThymioTracker(cv::FileStorage& calibrationStorage,
@@ -182,8 +254,25 @@ void ThymioTracker::init(cv::FileStorage& calibrationStorage,
                          cv::FileStorage& robotModelStorage,
                          std::vector<cv::FileStorage>& landmarkStorages)
 {
-    mDetectionInfo.init(landmarkStorages.size());
-    mFeatureExtractor = cv::BRISK::create();
+    // Load landmarks
+    std::vector<Landmark> landmarks;
+    for(auto& landmarkStorage : landmarkStorages)
+        landmarks.push_back(Landmark::fromFileStorage(landmarkStorage));
+
+    init(calibrationStorage, geomHashingStorage, robotModelStorage, landmarks);
+}
+
+void ThymioTracker::init(cv::FileStorage& calibrationStorage,
+                         cv::FileStorage& geomHashingStorage,
+                         cv::FileStorage& robotModelStorage,
+                         std::vector<Landmark>& landmarks)
+{
+    mDetectionInfo.init(landmarks.size());
+    mParallelLandmarks = true;
+    mDirectLandmarkTracking = false;
+    mLandmarkMemoryBudget = 32 << 20;
+    mLandmarkFrame = 0;
+    mLandmarkLastSeen.assign(landmarks.size(), 0);
 
     readCalibrationFromFileStorage(calibrationStorage, mCalibration);
 
@@ -192,9 +281,48 @@ void ThymioTracker::init(cv::FileStorage& calibrationStorage,
     //mGH.loadFromStream(geomHashingStream);
     //mGH.setCalibration(mCalibration);
     
-    // Load landmarks
-    for(auto& landmarkStorage : landmarkStorages)
-        mLandmarks.push_back(Landmark::fromFileStorage(landmarkStorage));
+    mLandmarks.swap(landmarks);
+
+    //the frames are described with the backend of the landmarks, which have to share it to be matched at once
+    mFeatureType = mLandmarks.empty() ? FEATURE_BRISK : mLandmarks[0].getFeatureType();
+    for(auto& landmark : mLandmarks)
+        if(landmark.getFeatureType() != mFeatureType)
+        {
+            std::cerr << "Landmarks with " << featureTypeName(mFeatureType) << " and "
+                      << featureTypeName(landmark.getFeatureType()) << " features" << std::endl;
+            throw std::runtime_error("All the landmarks have to use the same feature type!");
+        }
+    mFeatureExtractor = createFeatureExtractor(mFeatureType);
+
+    //one index of the descriptors of all the landmarks, queried once per image
+    std::vector<cv::Mat> landmarkDescriptors;
+    for(auto& landmark : mLandmarks)
+        landmarkDescriptors.push_back(landmark.getDescriptors());
+    mLandmarkIndex.build(landmarkDescriptors);
+}
+
+void ThymioTracker::loadVocabulary(cv::FileStorage& vocabularyStorage)
+{
+    BinaryVocabulary vocabulary;
+    vocabulary.loadFromFileStorage(vocabularyStorage);
+
+    std::vector<cv::Mat> landmarkDescriptors;
+    for(auto& landmark : mLandmarks)
+        landmarkDescriptors.push_back(landmark.getDescriptors());
+    mLandmarkRecognizer.build(vocabulary, landmarkDescriptors);
+}
+
+const DeviceRotation* ThymioTracker::trackDeviceRotation(const cv::Mat* deviceOrientation, DeviceRotation& deviceRotation)
+{
+    //no orientation for this frame: the next one cannot be compared to the last known one
+    if(!deviceOrientation || deviceOrientation->empty())
+    {
+        deviceRotation = DeviceRotation();
+        return 0;
+    }
+
+    updateDeviceRotation(deviceRotation, *deviceOrientation);
+    return &deviceRotation;
 }
 
 void ThymioTracker::resizeCalibration(const cv::Size& imgSize)
@@ -206,14 +334,21 @@ void ThymioTracker::resizeCalibration(const cv::Size& imgSize)
 
     
 void ThymioTracker::updateRobot(const cv::Mat& input,
-                           const cv::Mat* deviceOrientation)
+                           const cv::Mat* deviceOrientation,
+                           double timestamp)
 {    
     if(input.size() != mCalibration.imageSize)
         resizeCalibration(input.size());
+
+    if(timestamp < 0)
+        timestamp = cv::getTickCount() / cv::getTickFrequency();
+
+    //rotation of the device since previous frame
+    const DeviceRotation* deviceRotation = trackDeviceRotation(deviceOrientation, mDetectionInfo.deviceRotationRobot);
     
     // Robot detection and tracking
     if(!mDetectionInfo.prevImageRobot.empty())
-        mRobot.find(input,mDetectionInfo.prevImageRobot,mDetectionInfo.mRobotDetection);
+        mRobot.find(input,mDetectionInfo.prevImageRobot,timestamp,deviceRotation,mDetectionInfo.mRobotDetection);
 
     input.copyTo(mDetectionInfo.prevImageRobot);
     
@@ -235,6 +370,9 @@ void ThymioTracker::updateLandmarks(const cv::Mat& input,
         resizeCalibration(input.size());
 
 
+    //rotation of the device since previous frame
+    const DeviceRotation* deviceRotation = trackDeviceRotation(deviceOrientation, mDetectionInfo.deviceRotationLandm);
+
     // Landmark detection and tracking
     static int counter = 100;   
 
@@ -244,36 +382,119 @@ void ThymioTracker::updateLandmarks(const cv::Mat& input,
         
         //check if all the landmarks are tracked
         bool allTracked = true;
+        bool anyTracked = false;
         auto lmcDetectionsIt = mDetectionInfo.landmarkDetections.cbegin();
         for(; lmcDetectionsIt != mDetectionInfo.landmarkDetections.cend(); ++lmcDetectionsIt)
         {
             const cv::Mat& h = lmcDetectionsIt->getHomography();
             if(h.empty()) 
                 allTracked = false;
+            if(!lmcDetectionsIt->getCorrespondences().empty())
+                anyTracked = true;
         }
 
+        //track the correspondences of all the landmarks with one LK call, the pyramid of this frame
+        //is reused as the previous one at the next frame. Direct tracking only needs the pyramid of this frame
+        if(anyTracked)
+        {
+            Landmark::trackingPyramid(input, mDetectionInfo.pyramidLandm);
+            if(!mDirectLandmarkTracking)
+            {
+                if(mDetectionInfo.prevPyramidLandm.empty())
+                    Landmark::trackingPyramid(mDetectionInfo.prevImageLandm, mDetectionInfo.prevPyramidLandm);
+                Landmark::trackCorrespondences(mDetectionInfo.pyramidLandm, mDetectionInfo.prevPyramidLandm,
+                                               mCalibration, deviceRotation, mDetectionInfo.landmarkDetections);
+            }
+        }
+        else
+            mDetectionInfo.pyramidLandm.clear();
+
 
         // Extract features only once every 20 frames and only if need to do any detection (ie all markers are not tracked)
         std::vector<cv::KeyPoint> detectedKeypoints;
         cv::Mat detectedDescriptors;
+        std::vector<std::vector<DescriptorIndex::Match> > descriptorMatches(mLandmarks.size());
         if(!allTracked && counter >= 20)
         {
             mFeatureExtractor->detectAndCompute(input, cv::noArray(),
                                                 detectedKeypoints, detectedDescriptors);
+            //match with all the landmarks at once, or only with the ones whose words are in the image
+            //when there are more of them than the shortlist keeps
+            const unsigned int maxShortlist = 4;
+            if(mLandmarkRecognizer.empty() || mLandmarks.size() <= maxShortlist)
+                mLandmarkIndex.match(detectedDescriptors, descriptorMatches);
+            else
+            {
+                std::vector<int> shortlist;
+                mLandmarkRecognizer.shortlist(detectedDescriptors, maxShortlist, 0.05f, shortlist);
+                mLandmarkShortlist.assign(mLandmarks.size(), 0);
+                for(unsigned int i=0;i<shortlist.size();i++)
+                    mLandmarkShortlist[shortlist[i]] = 1;
+                mLandmarkIndex.match(detectedDescriptors, descriptorMatches, &mLandmarkShortlist);
+            }
             counter = 0;
         }
         
-        auto landmarksIt = mLandmarks.cbegin();
-        auto lmDetectionsIt = mDetectionInfo.landmarkDetections.begin();
-        for(; landmarksIt != mLandmarks.cend(); ++landmarksIt, ++lmDetectionsIt)
-            landmarksIt->find(input, mDetectionInfo.prevImageLandm, mCalibration, detectedKeypoints, detectedDescriptors, *lmDetectionsIt);
+        //the tracked landmarks need their template, loaded here as the finders only read the landmarks
+        ++mLandmarkFrame;
+        for(unsigned int l=0;l<mLandmarks.size();l++)
+            if(!mDetectionInfo.landmarkDetections[l].getCorrespondences().empty())
+            {
+                mLandmarks[l].loadTemplate();
+                if(mDirectLandmarkTracking)
+                    mLandmarks[l].prepareAlignment();
+                mLandmarkLastSeen[l] = mLandmarkFrame;
+            }
+
+        //each landmark only writes its own detection
+        LandmarkFinder finder(mLandmarks, input, mDetectionInfo.prevImageLandm, mCalibration, detectedKeypoints,
+                              descriptorMatches, deviceRotation,
+                              mDirectLandmarkTracking ? &mDetectionInfo.pyramidLandm : 0,
+                              mDetectionInfo.landmarkDetections);
+        cv::Range allLandmarks(0, mLandmarks.size());
+        if(mParallelLandmarks)
+            cv::parallel_for_(allLandmarks, finder);
+        else
+            finder(allLandmarks);
+
+        releaseLandmarkTemplates();
     }
 
     input.copyTo(mDetectionInfo.prevImageLandm);
+    std::swap(mDetectionInfo.prevPyramidLandm, mDetectionInfo.pyramidLandm);
     
     mTimer.tic();
 }
 
+void ThymioTracker::releaseLandmarkTemplates()
+{
+    //number of frames a landmark has to be lost before its template can be released
+    const int releaseDelay = 100;
+
+    size_t memory = 0;
+    std::vector<std::pair<int, int> > candidates;//last seen, landmark
+    for(unsigned int l=0;l<mLandmarks.size();l++)
+    {
+        if(!mLandmarks[l].isTemplateLoaded())
+            continue;
+        memory += mLandmarks[l].getTemplateMemory();
+        if(mDetectionInfo.landmarkDetections[l].getCorrespondences().empty()
+           && mLandmarkFrame - mLandmarkLastSeen[l] > releaseDelay)
+            candidates.push_back(std::make_pair(mLandmarkLastSeen[l], l));
+    }
+
+    //lost for the longest time first
+    std::sort(candidates.begin(), candidates.end());
+    for(unsigned int c=0;c<candidates.size() && memory > mLandmarkMemoryBudget;c++)
+    {
+        Landmark& landmark = mLandmarks[candidates[c].second];
+        size_t templateMemory = landmark.getTemplateMemory();
+        landmark.releaseTemplate();
+        if(!landmark.isTemplateLoaded())
+            memory -= templateMemory;
+    }
+}
+
 bool ThymioTracker::updateCalibration()
 {
     //for each tracked landmark add the matches to the calibration tool
@@ -290,13 +511,13 @@ bool ThymioTracker::updateCalibration()
             std::vector<cv::Point2f> lmImagePoints;
 
             // FIXME: will break non-square landmarks
-            float scale = landmarksIt->getRealSize().width/landmarksIt->getImage().size().width;
-            auto correspIt = lmDetectionsIt->getCorrespondences().cbegin();
-            for(; correspIt != lmDetectionsIt->getCorrespondences().cend(); ++correspIt)
+            float scale = landmarksIt->getRealSize().width/landmarksIt->getImageSize().width;
+            CorrespondenceView correspondences = lmDetectionsIt->getCorrespondences();
+            lmImagePoints = correspondences.points();
+            for(unsigned int i = 0; i < correspondences.size(); ++i)
             {
-                lmImagePoints.push_back(correspIt->second);
-                cv::Point3f lmPoint = cv::Point3f(scale*landmarksIt->getKeypointPos()[correspIt->first].x,scale*landmarksIt->getKeypointPos()[correspIt->first].y,0.);
-                lmObjectPoints.push_back(lmPoint);
+                const cv::Point2f& keypointPos = landmarksIt->getKeypointPos()[correspondences.id(i)];
+                lmObjectPoints.push_back(cv::Point3f(scale*keypointPos.x,scale*keypointPos.y,0.));
             }
 
 
@@ -348,7 +569,10 @@ void ThymioTracker::drawLastDetection(cv::Mat* output, cv::Mat* deviceOrientatio
     //                     cv::DrawMatchesFlags::DRAW_OVER_OUTIMG);
     
     if(mDetectionInfo.mRobotDetection.isFound())
-        mRobot.model().draw(*output, mCalibration, mDetectionInfo.mRobotDetection.getPose());
+    {
+        for(auto& instance : mDetectionInfo.mRobotDetection.getInstances())
+            mRobot.model(instance.model).draw(*output, mCalibration, instance.pose);
+    }
     else
         putText(*output, "Lost",
                 cv::Point2i(10,10),
@@ -443,11 +667,8 @@ void ThymioTracker::drawLastDetection(cv::Mat* output, cv::Mat* deviceOrientatio
         cv::line(*output, corners[2], corners[3], *colorIt, 2);
         cv::line(*output, corners[3], corners[0], *colorIt, 2);
         
-        for(auto c : lmDetectionsIt->getCorrespondences())
-        {
-            cv::Point2f p = c.second;
+        for(auto& p : lmDetectionsIt->getCorrespondences().points())
             cv::circle(*output, p, 2, cv::Scalar(0, 255, 255));
-        }
 
         //draw pose
         //draw object frame (axis XYZ)
@@ -14,6 +14,7 @@
 // #include <opencv2/xfeatures2d.hpp>
 
 #include "Landmark.hpp"
+#include "Vocabulary.hpp"
 #include "Robot.hpp"
 
 namespace thymio_tracker
@@ -22,10 +23,15 @@ namespace thymio_tracker
 struct DetectionInfo
 {
     DetectionInfo(){};
-    DetectionInfo(int numberOfLandmarks)
-        : landmarkDetections(numberOfLandmarks){}
-
-    void init(int numberOfLandmarks){landmarkDetections.resize(numberOfLandmarks);}
+    DetectionInfo(int numberOfLandmarks){init(numberOfLandmarks);}
+
+    //one detection per landmark, each with its own random generator
+    void init(int numberOfLandmarks)
+    {
+        landmarkDetections.clear();
+        for(int i = 0; i < numberOfLandmarks; ++i)
+            landmarkDetections.push_back(LandmarkDetection(i));
+    }
     
     //robot detection info
     RobotDetection mRobotDetection;
@@ -37,6 +43,14 @@ struct DetectionInfo
     //each need to store its previous frame)
     cv::Mat prevImageRobot;
     cv::Mat prevImageLandm;
+
+    // LK pyramids of the current and previous frame of the landmark tracking, empty if not built
+    std::vector<cv::Mat> pyramidLandm;
+    std::vector<cv::Mat> prevPyramidLandm;
+
+    // Device orientation from the IMU and rotation since previous frame, one for each thread too
+    DeviceRotation deviceRotationRobot;
+    DeviceRotation deviceRotationLandm;
 };
 
 struct CalibrationInfo
@@ -92,15 +106,18 @@ public:
     void writeCalibration(cv::FileStorage& output);
 
     //to detect and track the robot
+    //timestamp of the frame in seconds, if negative the time at which the frame is processed is used
     void updateRobot(const cv::Mat& input,
-                const cv::Mat* deviceOrientation=0);
+                const cv::Mat* deviceOrientation=0,
+                double timestamp=-1.);
 
     //to detect and track the landmarks
     void updateLandmarks(const cv::Mat& input,
                 const cv::Mat* deviceOrientation=0);
 
     void update(const cv::Mat& input,
-                const cv::Mat* deviceOrientation=0){updateRobot(input,deviceOrientation);updateLandmarks(input,deviceOrientation);};
+                const cv::Mat* deviceOrientation=0,
+                double timestamp=-1.){updateRobot(input,deviceOrientation,timestamp);updateLandmarks(input,deviceOrientation);};
     //void update(const cv::Mat& input,
     //            const cv::Mat* deviceOrientation=0){updateLandmarks(input,deviceOrientation);};
     //void update(const cv::Mat& input,
@@ -108,11 +125,26 @@ public:
 
     void drawLastDetection(cv::Mat* output, cv::Mat* deviceOrientation=0) const;
 
+    //find the landmarks on several threads in updateLandmarks (same result as one after the other)
+    void setParallelLandmarks(bool parallel) {mParallelLandmarks = parallel;}
+
+    //track the found landmarks by aligning their template to the image instead of tracking their keypoints
+    //with LK and active search, they are still detected with the features
+    void setDirectLandmarkTracking(bool direct) {mDirectLandmarkTracking = direct;}
+
+    //vocabulary trained with tools/trainVocabulary, to match only the landmarks which share words with the image
+    void loadVocabulary(cv::FileStorage& vocabularyStorage);
+
+    //bytes of landmark templates kept loaded, the ones of the landmarks lost for a while are released above it
+    //(only the landmarks loaded from files, which can load them again)
+    void setLandmarkMemoryBudget(size_t bytes) {mLandmarkMemoryBudget = bytes;}
+
     
     inline const IntrinsicCalibration& getCalibration() const {return mCalibration;}
     inline const DetectionInfo& getDetectionInfo() const {return mDetectionInfo;}
     inline const CalibrationInfo& getCalibrationInfo() const {return mCalibrationInfo;}
     inline const std::vector<Landmark>& getLandmarks() const {return mLandmarks;}
+    inline FeatureType getFeatureType() const {return mFeatureType;}
     
     inline const Timer& getTimer() const {return mTimer;}
     inline const IntrinsicCalibration& getIntrinsicCalibration() const {return mCalibration;}
@@ -126,10 +158,21 @@ private:
               cv::FileStorage& geomHashing,
               cv::FileStorage& robotModel,
               std::vector<cv::FileStorage>& landmarkStorages);
+    void init(cv::FileStorage& calibration,
+              cv::FileStorage& geomHashing,
+              cv::FileStorage& robotModel,
+              std::vector<Landmark>& landmarks);
 
     /// Resize the calibration for a new given image size.
     void resizeCalibration(const cv::Size& imgSize);
 
+    /// Update the rotation of the device with the orientation of the new frame,
+    /// returns null if it is not known.
+    const DeviceRotation* trackDeviceRotation(const cv::Mat* deviceOrientation, DeviceRotation& deviceRotation);
+
+    /// Release the templates of the landmarks which are not tracked while the memory budget is exceeded.
+    void releaseLandmarkTemplates();
+
     
     IntrinsicCalibration mCalibration;
     
@@ -139,6 +182,15 @@ private:
     Robot mRobot;
     
     std::vector<Landmark> mLandmarks;
+    DescriptorIndex mLandmarkIndex;//descriptors of all the landmarks
+    LandmarkRecognizer mLandmarkRecognizer;//shortlist of the landmarks seen in the image, empty without vocabulary
+    std::vector<unsigned char> mLandmarkShortlist;
+    bool mParallelLandmarks;
+    bool mDirectLandmarkTracking;
+    size_t mLandmarkMemoryBudget;
+    int mLandmarkFrame;//landmark updates since init
+    std::vector<int> mLandmarkLastSeen;//update at which each landmark was last tracked
+    FeatureType mFeatureType;//of the landmarks and the frames
     cv::Ptr<cv::Feature2D> mFeatureExtractor;//want to extract features from current image once => put it out of landmark
     
     Timer mTimer;
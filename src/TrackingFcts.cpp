@@ -1,186 +1,165 @@
 
 #include "TrackingFcts.hpp"
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 using namespace cv;
 using namespace std;
 
 namespace thymio_tracker
 {
 
-void printMat(const CvMat* mat)
+//weighted reprojection error of the points for pose (R,t), in pixels of the undistorted camera
+//if JtJ and JtErr are given, also accumulate the normal equations for a rotation update on the left
+//(R <- exp(w)R) and a translation update (t <- t+dt), parameters ordered as (w,dt)
+static double weightedReprojectionError(const Point3f* objectPoints, const Point2f* undistPoints, const float* weights, int count,
+                                        double fx, double fy, const Matx33d& R, const Vec3d& t,
+                                        Matx66d* JtJ = NULL, Vec6d* JtErr = NULL)
 {
-    //IplImage img=mat;
-    cv::Mat matt=cvarrToMat(mat);
-    std::cout<<mat->rows<<std::endl;
-    std::cout<<mat->cols<<std::endl;
-    std::cout<<matt.channels()<<std::endl;
-    for(int i=0; i<mat->rows; i++)
+    double errNorm = 0;
+    if(JtJ)
     {
-        for(int j=0; j<mat->cols; j++)
-        {   
-            for(int k=0; k<matt.channels(); k++)
-                std::cout<<cvGet2D(mat,i,j).val[k]<<"\t";
-            std::cout<<std::endl;
-        }
-        std::cout<<std::endl<<std::endl;
+        *JtJ = Matx66d::zeros();
+        *JtErr = Vec6d::all(0);
     }
 
-}
-
-//multiply matrix by a matrix with one element only
-void mulErrMat(const CvMat* mat,const CvMat* s,CvMat* matr)
-{
-    //score has shape (1,nbMatch,1)
-    //err has shape (1,nbMatch,2)
-    cv::Mat mat_r=cvarrToMat(mat);
-    cv::Mat mat_w=cvarrToMat(matr);
-    int nbChannel = mat_r.channels();
-
-    for(int i=0; i<mat->rows; i++)
+    for(int i=0;i<count;i++)
     {
-        //float *ptr_r = mat_r.at<float>
-        for(int j=0; j<mat->cols; j++)
-        {   
-            for(int k=0; k<mat_r.channels(); k++)
-                mat_w.ptr<double>(i)[j*nbChannel+k] = cvGet2D(s,i,j).val[0]*mat_r.ptr<double>(i)[j*nbChannel+k];
+        const Vec3d X(objectPoints[i].x,objectPoints[i].y,objectPoints[i].z);
+        const Vec3d RX = R*X;
+        const Vec3d Xc = RX + t;
+        const double invZ = 1./Xc[2];
+        const double x = Xc[0]*invZ;
+        const double y = Xc[1]*invZ;
+        const double w = weights[i];
+
+        const double ex = w*fx*(x - undistPoints[i].x);
+        const double ey = w*fy*(y - undistPoints[i].y);
+        errNorm += ex*ex + ey*ey;
+
+        if(JtJ)
+        {
+            //derivative of the weighted pixel projection with respect to the point in camera frame
+            const Matx23d dp_dXc(w*fx*invZ, 0., -w*fx*x*invZ,
+                                 0., w*fy*invZ, -w*fy*y*invZ);
+            //derivative of the point in camera frame with respect to (w,dt): [-[RX]x | I]
+            const double dXc_dp_vals[18] = {0., RX[2], -RX[1], 1., 0., 0.,
+                                            -RX[2], 0., RX[0], 0., 1., 0.,
+                                            RX[1], -RX[0], 0., 0., 0., 1.};
+            const Matx<double,3,6> dXc_dp(dXc_dp_vals);
+            const Matx<double,2,6> J = dp_dXc*dXc_dp;
+            *JtJ += J.t()*J;
+            *JtErr += J.t()*Vec2d(ex,ey);
         }
     }
-
+    return errNorm;
 }
 
-void mulJacMat(const CvMat* mat,const CvMat* s,CvMat* matr)
+//read a 3 vector stored as float or double
+static Vec3d readVec3(const Mat& m)
 {
-    //score has shape (1,nbMatch,1)
-    //Jac has shape (2*nbMatch,6,1)
-    cv::Mat mat_r=cvarrToMat(mat);
-    cv::Mat mat_w=cvarrToMat(matr);
-
-    for(int i=0; i<s->cols; i++)
-        for(int i2=0; i2<2; i2++)
-    {
-        for(int j=0; j<mat->cols; j++)
-        {   
-            mat_w.ptr<double>(2*i+i2)[j] = cvGet2D(s,0,i).val[0]*mat_r.ptr<double>(2*i+i2)[j];
-        }
-    }
-
+    CV_Assert(m.total()*m.channels()==3);
+    if(m.depth()==CV_64F)
+        return Vec3d(m.ptr<double>()[0],m.ptr<double>()[1],m.ptr<double>()[2]);
+    return Vec3d(m.ptr<float>()[0],m.ptr<float>()[1],m.ptr<float>()[2]);
+}
+static void writeVec3(const Vec3d& v, Mat m)
+{
+    if(m.depth()==CV_64F)
+        for(int i=0;i<3;i++)m.ptr<double>()[i]=v[i];
+    else
+        for(int i=0;i<3;i++)m.ptr<float>()[i]=(float)v[i];
 }
 
-
-void cvFindPoseScaled( const CvMat* objectPoints,
-                  const CvMat* imagePoints, const CvMat* scores, const CvMat* A,
-                  const CvMat* distCoeffs, CvMat* rvec, CvMat* tvec)
+bool robustPnp(InputArray opoints,InputArray ipoints,
+    InputArray score, InputArray _cameraMatrix, InputArray _distCoeffs,
+               OutputArray _rvec, OutputArray _tvec)
 {
+    Mat objectPoints = opoints.getMat(), imagePoints = ipoints.getMat(), scores = score.getMat();
+    int count = objectPoints.checkVector(3, CV_32F);
+    CV_Assert( count >= 0 && imagePoints.checkVector(2, CV_32F) == count && scores.checkVector(1, CV_32F) == count );
+    if(count==0)
+        return false;
+
+    Mat cameraMatrix = _cameraMatrix.getMat();
+    const double fx = cameraMatrix.at<double>(0,0), fy = cameraMatrix.at<double>(1,1);
+
+    //undistort points once, the error is then measured in pixels of the undistorted camera
+    AutoBuffer<Point2f, 64> undistBuffer(count);
+    Mat undistPoints(imagePoints.size(), CV_32FC2, (Point2f*)undistBuffer);
+    undistortPoints(imagePoints, undistPoints, cameraMatrix, _distCoeffs);
+
+    const Point3f* objPtr = objectPoints.ptr<Point3f>();
+    const Point2f* undistPtr = (Point2f*)undistBuffer;
+    const float* weightPtr = scores.ptr<float>();
+
+    //initial pose
+    Mat rvecMat = _rvec.getMat(), tvecMat = _tvec.getMat();
+    Matx33d R;
+    Rodrigues(readVec3(rvecMat), R);
+    Vec3d t = readVec3(tvecMat);
+
+    //Levenberg Marquardt on the weighted reprojection error
     const int max_iter = 20;
-    Ptr<CvMat> matM, _m, _mn, matL, _s;
-
-    int count;
-    double a[9], ar[9]={1,0,0,0,1,0,0,0,1};
-    CvScalar Mc;
-    double param[6];
-    CvMat matA = cvMat( 3, 3, CV_64F, a );
-    CvMat _Ar = cvMat( 3, 3, CV_64F, ar );
-    CvMat _r = cvMat( 3, 1, CV_64F, param );
-    CvMat _t = cvMat( 3, 1, CV_64F, param + 3 );
-    CvMat _param = cvMat( 6, 1, CV_64F, param );
-    CvMat _dpdr, _dpdt;
-
-    CV_Assert( CV_IS_MAT(objectPoints) && CV_IS_MAT(imagePoints) &&
-        CV_IS_MAT(A) && CV_IS_MAT(rvec) && CV_IS_MAT(tvec) );
+    double lambda = 1e-3;
+    Matx66d JtJ;
+    Vec6d JtErr;
+    double errNorm = weightedReprojectionError(objPtr, undistPtr, weightPtr, count, fx, fy, R, t, &JtJ, &JtErr);
 
-    count = MAX(objectPoints->cols, objectPoints->rows);
-    matM.reset(cvCreateMat( 1, count, CV_64FC3 ));
-    _m.reset(cvCreateMat( 1, count, CV_64FC2 ));
-
-    cvConvertPointsHomogeneous( objectPoints, matM );
-    cvConvertPointsHomogeneous( imagePoints, _m );
-    cvConvert( A, &matA );
-
-
-    CV_Assert( (CV_MAT_DEPTH(rvec->type) == CV_64F || CV_MAT_DEPTH(rvec->type) == CV_32F) &&
-        (rvec->rows == 1 || rvec->cols == 1) && rvec->rows*rvec->cols*CV_MAT_CN(rvec->type) == 3 );
-
-    CV_Assert( (CV_MAT_DEPTH(tvec->type) == CV_64F || CV_MAT_DEPTH(tvec->type) == CV_32F) &&
-        (tvec->rows == 1 || tvec->cols == 1) && tvec->rows*tvec->cols*CV_MAT_CN(tvec->type) == 3 );
-
-    _mn.reset(cvCreateMat( 1, count, CV_64FC2 ));
-
-    // normalize image points
-    // (unapply the intrinsic matrix transformation and distortion)
-    cvUndistortPoints( _m, _mn, &matA, distCoeffs, 0, &_Ar );
-
-    CvMat _r_temp = cvMat(rvec->rows, rvec->cols,
-        CV_MAKETYPE(CV_64F,CV_MAT_CN(rvec->type)), param );
-    CvMat _t_temp = cvMat(tvec->rows, tvec->cols,
-        CV_MAKETYPE(CV_64F,CV_MAT_CN(tvec->type)), param + 3);
-    cvConvert( rvec, &_r_temp );
-    cvConvert( tvec, &_t_temp );
-    
-    
-
-    cvReshape( matM, matM, 3, 1 );//3 = number of channels, 1=number of rows
-    cvReshape( _mn, _mn, 2, 1 );
-
-    // refine extrinsic parameters using iterative algorithm
-    CvLevMarq solver( 6, count*2, cvTermCriteria(CV_TERMCRIT_EPS+CV_TERMCRIT_ITER,max_iter,FLT_EPSILON), true);
-    cvCopy( &_param, solver.param );
-
-    for(;;)
+    for(int iter=0;iter<max_iter;iter++)
     {
-        CvMat *matJ = 0, *_err = 0;
-        const CvMat *__param = 0;
-        bool proceed = solver.update( __param, matJ, _err );
-        cvCopy( __param, &_param );
-        if( !proceed || !_err )
-            break;
-        cvReshape( _err, _err, 2, 1 );
-
-        if( matJ )
+        //increase damping until the error decreases
+        Vec6d dx;
+        bool improved = false;
+        while(!improved && lambda<1e16)
         {
-            cvGetCols( matJ, &_dpdr, 0, 3 );
-            cvGetCols( matJ, &_dpdt, 3, 6 );
-            cvProjectPoints2( matM, &_r, &_t, &matA, distCoeffs,
-                              _err, &_dpdr, &_dpdt, 0, 0, 0 );
-            //in _err just get the projection of the points now and 
-            mulJacMat(matJ,scores,matJ);
-        }
-        else
-        {
-            cvProjectPoints2( matM, &_r, &_t, &matA, distCoeffs,
-                              _err, 0, 0, 0, 0, 0 );
+            Matx66d A = JtJ;
+            for(int i=0;i<6;i++)
+                A(i,i) *= 1.+lambda;
+            dx = A.solve(JtErr, DECOMP_CHOLESKY);
+
+            Matx33d dR;
+            Rodrigues(Vec3d(-dx[0],-dx[1],-dx[2]), dR);
+            Matx33d newR = dR*R;
+            Vec3d newt = t - Vec3d(dx[3],dx[4],dx[5]);
+
+            double newErrNorm = weightedReprojectionError(objPtr, undistPtr, weightPtr, count, fx, fy, newR, newt);
+            if(newErrNorm <= errNorm)
+            {
+                R = newR;
+                t = newt;
+                errNorm = newErrNorm;
+                lambda = std::max(lambda/10., 1e-16);
+                improved = true;
+            }
+            else
+                lambda *= 10.;
         }
-        cvSub(_err, _m, _err);//now get the error really
-        mulErrMat(_err, scores, _err);
-
-        cvReshape( _err, _err, 1, 2*count );
-    }
-    cvCopy( solver.param, &_param );
 
-    _r = cvMat( rvec->rows, rvec->cols,
-        CV_MAKETYPE(CV_64F,CV_MAT_CN(rvec->type)), param );
-    _t = cvMat( tvec->rows, tvec->cols,
-        CV_MAKETYPE(CV_64F,CV_MAT_CN(tvec->type)), param + 3 );
+        //converged
+        if(!improved || norm(dx) <= FLT_EPSILON*(1.+norm(t)))
+            break;
 
-    cvConvert( &_r, rvec );
-    cvConvert( &_t, tvec );
-}
+        weightedReprojectionError(objPtr, undistPtr, weightPtr, count, fx, fy, R, t, &JtJ, &JtErr);
+    }
 
-bool robustPnp(InputArray opoints,InputArray ipoints,
-    InputArray score, InputArray _cameraMatrix, InputArray _distCoeffs,
-               OutputArray _rvec, OutputArray _tvec)
-{
-    //undistort points 
-    CvMat c_objectPoints = opoints.getMat(), c_imagePoints = ipoints.getMat();
-    CvMat c_score = score.getMat();
-    CvMat c_cameraMatrix = _cameraMatrix.getMat(), c_distCoeffs = _distCoeffs.getMat();
-    CvMat c_rvec = _rvec.getMat(), c_tvec = _tvec.getMat();
-    
-    cvFindPoseScaled(&c_objectPoints, &c_imagePoints, &c_score, &c_cameraMatrix,&c_distCoeffs,
-                                     &c_rvec, &c_tvec);
+    Vec3d rvec;
+    Rodrigues(R, rvec);
+    writeVec3(rvec, rvecMat);
+    writeVec3(t, tvecMat);
     return true;
-    
 }
 
+//reference implementation of the mutual information of one window, matchTemplateMI computes the same
+//without going through it
 float MI(cv::Mat img, cv::Mat &templ, cv::Mat &mask)
 {
     int nbBin = 8;
@@ -290,13 +269,152 @@ float MI(cv::Mat img, cv::Mat &templ, cv::Mat &mask)
     return res;
 }
 
+//joint histogram of MI is 8x8, each pixel value v is split between bins 7v/256 and 7v/256+1
+//with weights 256-w and w where w = 7v%256 (exactly the float weights of MI() times 256)
+#define MI_NB_BINS 8
+
+//adds the contribution of one pixel pair to the joint histogram (in 1/65536 of pixel):
+//the template pixel is given by its weights on the 8 template bins, the image pixel by its bin and weight
+static inline void accumulateJointHistogram(unsigned int* hist, const unsigned short* templWeights, int imgBin, int imgWeight)
+{
+    unsigned int* row0 = hist + MI_NB_BINS*imgBin;
+    unsigned int* row1 = row0 + MI_NB_BINS;
+    const unsigned int w0 = 256 - imgWeight;
+    const unsigned int w1 = imgWeight;
+#if defined(__SSE2__)
+    //u16 x u16 products, up to 65536 so they are assembled on 32 bits from the low and high parts
+    __m128i t = _mm_loadu_si128((const __m128i*)templWeights);
+    __m128i vw0 = _mm_set1_epi16((short)w0);
+    __m128i vw1 = _mm_set1_epi16((short)w1);
+    __m128i lo0 = _mm_mullo_epi16(t, vw0), hi0 = _mm_mulhi_epu16(t, vw0);
+    __m128i lo1 = _mm_mullo_epi16(t, vw1), hi1 = _mm_mulhi_epu16(t, vw1);
+    __m128i* r0 = (__m128i*)row0;
+    __m128i* r1 = (__m128i*)row1;
+    _mm_storeu_si128(r0,   _mm_add_epi32(_mm_loadu_si128(r0),   _mm_unpacklo_epi16(lo0, hi0)));
+    _mm_storeu_si128(r0+1, _mm_add_epi32(_mm_loadu_si128(r0+1), _mm_unpackhi_epi16(lo0, hi0)));
+    _mm_storeu_si128(r1,   _mm_add_epi32(_mm_loadu_si128(r1),   _mm_unpacklo_epi16(lo1, hi1)));
+    _mm_storeu_si128(r1+1, _mm_add_epi32(_mm_loadu_si128(r1+1), _mm_unpackhi_epi16(lo1, hi1)));
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint16x8_t t = vld1q_u16(templWeights);
+    uint16x4_t vw0 = vdup_n_u16((unsigned short)w0);
+    uint16x4_t vw1 = vdup_n_u16((unsigned short)w1);
+    vst1q_u32(row0,   vmlal_u16(vld1q_u32(row0),   vget_low_u16(t),  vw0));
+    vst1q_u32(row0+4, vmlal_u16(vld1q_u32(row0+4), vget_high_u16(t), vw0));
+    vst1q_u32(row1,   vmlal_u16(vld1q_u32(row1),   vget_low_u16(t),  vw1));
+    vst1q_u32(row1+4, vmlal_u16(vld1q_u32(row1+4), vget_high_u16(t), vw1));
+#else
+    for(int k=0;k<MI_NB_BINS;k++)
+    {
+        row0[k] += w0*templWeights[k];
+        row1[k] += w1*templWeights[k];
+    }
+#endif
+}
+
+//sum of c*log(c) over the non empty bins
+static inline double sumCLogC(const unsigned int* counts, int n)
+{
+    double sum = 0;
+    for(int i=0;i<n;i++)
+        if(counts[i])
+            sum += counts[i]*std::log((double)counts[i]);
+    return sum;
+}
+
 void matchTemplateMI( cv::Mat img, cv::Mat &templ, cv::Mat &res, cv::Mat &mask)
 {
-    for(int i=0;i<res.size().height;i++)
-        for(int j=0;j<res.size().width;j++)
+    //same pairing of pixels as MI(): in row i, the k-th masked pixel of the window is compared with
+    //img(i,k) and templ(i,k), so only the nb of masked pixels of each row matters
+    std::vector<int> nbMaskedInRow(templ.rows);
+    int nbPix = 0;
+    for(int i=0;i<templ.rows;i++)
+    {
+        const uchar* pixel_mask = mask.ptr<uchar>(i);
+        int nb = 0;
+        for(int j=0;j<templ.cols;j++)
+            if(pixel_mask[j]>0)
+                nb++;
+        nbMaskedInRow[i] = nb;
+        nbPix += nb;
+    }
+
+    if(nbPix == 0)
+    {
+        res.setTo(0.);
+        return;
+    }
+    //the joint histogram is accumulated on 32 bits with 65536 per pixel
+    if(nbPix >= 65536)
+    {
+        for(int i=0;i<res.size().height;i++)
+            for(int j=0;j<res.size().width;j++)
+            {
+                Rect box = cv::Rect(j,i,templ.size().width,templ.size().height);
+                res.at<float>(i,j) = MI(img(box),templ,mask);
+            }
+        return;
+    }
+
+    //template pixels binned once: weights on the 8 bins, and template histogram
+    std::vector<unsigned short> templWeights(MI_NB_BINS*nbPix, 0);
+    unsigned int templHist[MI_NB_BINS] = {0};
+    for(int i=0, p=0;i<templ.rows;i++)
+    {
+        const uchar* pixel_n = templ.ptr<uchar>(i);
+        for(int k=0;k<nbMaskedInRow[i];k++, p++)
         {
-            Rect box = cv::Rect(j,i,templ.size().width,templ.size().height);
-            res.at<float>(i,j) = MI(img(box),templ,mask);
+            int v = (MI_NB_BINS-1)*pixel_n[k];
+            int bin = v >> 8, weight = v & 255;
+            templWeights[MI_NB_BINS*p+bin] = 256 - weight;
+            templWeights[MI_NB_BINS*p+bin+1] = weight;
+            templHist[bin] += 256*(256 - weight);
+            templHist[bin+1] += 256*weight;
+        }
+    }
+
+    //image pixels of the search region binned once
+    std::vector<uchar> imgBins(img.rows*img.cols), imgWeights(img.rows*img.cols);
+    for(int i=0;i<img.rows;i++)
+    {
+        const uchar* pixel_m = img.ptr<uchar>(i);
+        for(int j=0;j<img.cols;j++)
+        {
+            int v = (MI_NB_BINS-1)*pixel_m[j];
+            imgBins[i*img.cols+j] = v >> 8;
+            imgWeights[i*img.cols+j] = v & 255;
+        }
+    }
+
+    //MI = sum Pmn log(Pmn/(Pm Pn)) = (sum Cmn log Cmn - sum Cm log Cm - sum Cn log Cn)/S + log S
+    //with the counts C in 1/65536 of pixel and S = 65536 nbPix, the template term does not change
+    const double S = 65536.*nbPix;
+    const double logS = std::log(S);
+    const double templTerm = sumCLogC(templHist, MI_NB_BINS);
+
+    for(int y=0;y<res.rows;y++)
+        for(int x=0;x<res.cols;x++)
+        {
+            unsigned int jointHist[MI_NB_BINS*MI_NB_BINS] = {0};
+            const unsigned short* t = &templWeights[0];
+            for(int i=0;i<templ.rows;i++)
+            {
+                const uchar* bins = &imgBins[(y+i)*img.cols+x];
+                const uchar* weights = &imgWeights[(y+i)*img.cols+x];
+                for(int k=0;k<nbMaskedInRow[i];k++, t+=MI_NB_BINS)
+                    accumulateJointHistogram(jointHist, t, bins[k], weights[k]);
+            }
+
+            //the image histogram is the sum of the rows of the joint one
+            unsigned int imgHist[MI_NB_BINS];
+            for(int b=0;b<MI_NB_BINS;b++)
+            {
+                imgHist[b] = 0;
+                for(int k=0;k<MI_NB_BINS;k++)
+                    imgHist[b] += jointHist[MI_NB_BINS*b+k];
+            }
+
+            double mi = (sumCLogC(jointHist, MI_NB_BINS*MI_NB_BINS) - sumCLogC(imgHist, MI_NB_BINS) - templTerm)/S + logS;
+            res.at<float>(y,x) = (float)mi;
         }
 }
 
@@ -321,6 +439,38 @@ void parabolicRefinement(cv::Mat &curv,cv::Point maxLoc,cv::Point2f &maxLocF)
 
         maxLocF = cv::Point2f(maxLoc)+cv::Point2f(ex,ey);
     }
-}           
+}
+
+bool homographyFromRectangle(float width, float height, const cv::Point2f* corners, cv::Matx33d& H)
+{
+    if(width<=0 || height<=0)
+        return false;
+
+    //unit square to quadrilateral
+    const Point2f &p0 = corners[0], &p1 = corners[1], &p2 = corners[2], &p3 = corners[3];
+    double sx = p0.x - p1.x + p2.x - p3.x;
+    double sy = p0.y - p1.y + p2.y - p3.y;
+    double g = 0., h = 0.;
+    if(sx != 0. || sy != 0.)
+    {
+        //projective
+        double dx1 = p1.x - p2.x, dx2 = p3.x - p2.x;
+        double dy1 = p1.y - p2.y, dy2 = p3.y - p2.y;
+        double den = dx1*dy2 - dx2*dy1;
+        if(std::abs(den) < DBL_EPSILON)
+            return false;
+        g = (sx*dy2 - dx2*sy)/den;
+        h = (dx1*sy - sx*dy1)/den;
+    }
+    Matx33d square(p1.x - p0.x + g*p1.x, p3.x - p0.x + h*p3.x, p0.x,
+                   p1.y - p0.y + g*p1.y, p3.y - p0.y + h*p3.y, p0.y,
+                   g, h, 1.);
+
+    //rectangle to unit square
+    H = square * Matx33d(1./width, 0., 0.,
+                         0., 1./height, 0.,
+                         0., 0., 1.);
+    return true;
+}
 
 }
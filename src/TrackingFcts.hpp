@@ -18,6 +18,8 @@ namespace thymio_tracker
 //robustPnp: solve a PnP problem iteratively using Levenberg Marquardt
 //same as opencv solvePnp expect that the least squared error is weighted
 //using the list of weights stored in score parameter
+//rvec and tvec are used as initial guess. The image points are undistorted once and the error is
+//measured in pixels of the undistorted camera, no allocation is done for less than 64 points
 bool robustPnp(cv::InputArray opoints,cv::InputArray ipoints,
     cv::InputArray score, cv::InputArray _cameraMatrix, cv::InputArray _distCoeffs,
                cv::OutputArray _rvec, cv::OutputArray _tvec);
@@ -32,5 +34,10 @@ void matchTemplateMI( cv::Mat img, cv::Mat &templ, cv::Mat &res, cv::Mat &mask);
 //To do so use the 4 closest neigbors to do parabic fitting and refine location
 void parabolicRefinement(cv::Mat &curv,cv::Point maxLoc,cv::Point2f &maxLocF);
 
+//homography which maps the rectangle (0,0),(width,0),(width,height),(0,height) to the 4 corners,
+//in closed form (Heckbert, Fundamentals of Texture Mapping and Image Warping)
+//returns false if the corners are degenerated
+bool homographyFromRectangle(float width, float height, const cv::Point2f* corners, cv::Matx33d& H);
+
 
 }
@@ -0,0 +1,322 @@
+#include "Vocabulary.hpp"
+#include "DescriptorIndex.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <iostream>
+
+using namespace cv;
+using namespace std;
+
+namespace thymio_tracker
+{
+
+void BinaryVocabulary::train(const cv::Mat& descriptors, int branching, int depth, cv::RNG& rng)
+{
+    if(descriptors.empty() || descriptors.type() != CV_8U)
+        throw std::runtime_error("BinaryVocabulary::train > descriptors have to be binary!");
+    if(branching < 2 || depth < 1)
+        throw std::runtime_error("BinaryVocabulary::train > the tree needs a branching of 2 and 1 level at least!");
+
+    mBranching = branching;
+    mDepth = depth;
+    mNbWords = 0;
+
+    //root, its centroid is not used
+    mCentroids = Mat::zeros(1, descriptors.cols, CV_8U);
+    mFirstChild.assign(1, -1);
+    mNbChildren.assign(1, 0);
+    mWords.assign(1, -1);
+
+    std::vector<int> ids(descriptors.rows);
+    for(int i=0;i<descriptors.rows;i++)
+        ids[i] = i;
+    trainNode(descriptors, ids, 0, 0, rng);
+}
+
+void BinaryVocabulary::trainNode(const cv::Mat& descriptors, const std::vector<int>& ids, int node, int level, cv::RNG& rng)
+{
+    const int nbBytes = descriptors.cols;
+    if(level == mDepth || (int)ids.size() <= mBranching)
+    {
+        mWords[node] = mNbWords++;
+        return;
+    }
+
+    //k-majority: seeds drawn among the descriptors, then the descriptors are assigned to the closest centroid
+    //and each centroid becomes the majority of the bits of its descriptors
+    //the descriptors are visited in random order, each one is drawn once so that duplicated descriptors
+    //(landmark given twice, repeated texture) give less clusters instead of drawing forever
+    Mat centroids(mBranching, nbBytes, CV_8U);
+    std::vector<int> seeds;
+    std::vector<int> drawOrder = ids;
+    for(unsigned int i=0;i<drawOrder.size() && (int)seeds.size() < mBranching;i++)
+    {
+        std::swap(drawOrder[i], drawOrder[i + rng.uniform(0, (int)(drawOrder.size()-i))]);
+        int seed = drawOrder[i];
+        bool unique = true;
+        for(unsigned int s=0;s<seeds.size() && unique;s++)
+            if(hammingDistance(descriptors.ptr<uchar>(seed), descriptors.ptr<uchar>(seeds[s]), nbBytes) == 0)
+                unique = false;
+        if(unique)
+        {
+            descriptors.row(seed).copyTo(centroids.row(seeds.size()));
+            seeds.push_back(seed);
+        }
+    }
+    const int nbClusters = seeds.size();
+    //all the descriptors are the same, nothing to split
+    if(nbClusters < 2)
+    {
+        mWords[node] = mNbWords++;
+        return;
+    }
+
+    std::vector<int> assignment(ids.size(), -1);
+    std::vector<int> bitCounts(8*nbBytes);
+    for(int iteration=0;iteration<10;iteration++)
+    {
+        bool changed = false;
+        for(unsigned int i=0;i<ids.size();i++)
+        {
+            const uchar* d = descriptors.ptr<uchar>(ids[i]);
+            int bestCluster = 0, bestDistance = INT_MAX;
+            for(int c=0;c<nbClusters;c++)
+            {
+                int distance = hammingDistance(d, centroids.ptr<uchar>(c), nbBytes);
+                if(distance < bestDistance)
+                {
+                    bestDistance = distance;
+                    bestCluster = c;
+                }
+            }
+            if(assignment[i] != bestCluster)
+            {
+                assignment[i] = bestCluster;
+                changed = true;
+            }
+        }
+        if(!changed)
+            break;
+
+        for(int c=0;c<nbClusters;c++)
+        {
+            std::fill(bitCounts.begin(), bitCounts.end(), 0);
+            int nbInCluster = 0;
+            for(unsigned int i=0;i<ids.size();i++)
+                if(assignment[i] == c)
+                {
+                    const uchar* d = descriptors.ptr<uchar>(ids[i]);
+                    for(int b=0;b<8*nbBytes;b++)
+                        bitCounts[b] += (d[b/8] >> (b%8)) & 1;
+                    nbInCluster++;
+                }
+            //an empty cluster keeps its centroid
+            if(!nbInCluster)
+                continue;
+            uchar* centroid = centroids.ptr<uchar>(c);
+            for(int b=0;b<nbBytes;b++)
+            {
+                uchar byte = 0;
+                for(int k=0;k<8;k++)
+                    if(2*bitCounts[8*b+k] > nbInCluster)
+                        byte |= (uchar)(1 << k);
+                centroid[b] = byte;
+            }
+        }
+    }
+
+    //children are stored next to each other, then each one is clustered
+    std::vector<std::vector<int> > childIds(nbClusters);
+    for(unsigned int i=0;i<ids.size();i++)
+        childIds[assignment[i]].push_back(ids[i]);
+
+    int firstChild = mFirstChild.size();
+    int nbChildren = 0;
+    for(int c=0;c<nbClusters;c++)
+        if(!childIds[c].empty())
+        {
+            mCentroids.push_back(centroids.row(c));
+            mFirstChild.push_back(-1);
+            mNbChildren.push_back(0);
+            mWords.push_back(-1);
+            nbChildren++;
+        }
+    mFirstChild[node] = firstChild;
+    mNbChildren[node] = nbChildren;
+
+    for(int c=0, child=firstChild;c<nbClusters;c++)
+        if(!childIds[c].empty())
+            trainNode(descriptors, childIds[c], child++, level+1, rng);
+}
+
+int BinaryVocabulary::getWord(const uchar* descriptor) const
+{
+    const int nbBytes = mCentroids.cols;
+    int node = 0;
+    while(mNbChildren[node] > 0)
+    {
+        int bestChild = mFirstChild[node], bestDistance = INT_MAX;
+        for(int c=mFirstChild[node];c<mFirstChild[node]+mNbChildren[node];c++)
+        {
+            int distance = hammingDistance(descriptor, mCentroids.ptr<uchar>(c), nbBytes);
+            if(distance < bestDistance)
+            {
+                bestDistance = distance;
+                bestChild = c;
+            }
+        }
+        node = bestChild;
+    }
+    return mWords[node];
+}
+
+void BinaryVocabulary::getWords(const cv::Mat& descriptors, std::vector<int>& words) const
+{
+    if(!descriptors.empty() && (descriptors.type() != CV_8U || descriptors.cols != mCentroids.cols))
+        throw std::runtime_error("BinaryVocabulary::getWords > descriptors do not match the vocabulary!");
+
+    words.resize(descriptors.rows);
+    for(int i=0;i<descriptors.rows;i++)
+        words[i] = getWord(descriptors.ptr<uchar>(i));
+}
+
+void BinaryVocabulary::writeToFileStorage(cv::FileStorage& fs) const
+{
+    cv::write(fs, "vocabulary_branching", mBranching);
+    cv::write(fs, "vocabulary_depth", mDepth);
+    cv::write(fs, "vocabulary_nbWords", mNbWords);
+    cv::write(fs, "vocabulary_centroids", mCentroids);
+    cv::write(fs, "vocabulary_firstChild", mFirstChild);
+    cv::write(fs, "vocabulary_nbChildren", mNbChildren);
+    cv::write(fs, "vocabulary_words", mWords);
+}
+
+void BinaryVocabulary::loadFromFileStorage(cv::FileStorage& fs)
+{
+    cv::FileNode centroidsNode = fs["vocabulary_centroids"];
+    if(centroidsNode.empty())
+    {
+        std::cerr << "No vocabulary in the file" << std::endl;
+        throw std::runtime_error("BinaryVocabulary::loadFromFileStorage > vocabulary not found!");
+    }
+
+    mBranching = (int)fs["vocabulary_branching"];
+    mDepth = (int)fs["vocabulary_depth"];
+    mNbWords = (int)fs["vocabulary_nbWords"];
+    cv::read(centroidsNode, mCentroids);
+    cv::read(fs["vocabulary_firstChild"], mFirstChild);
+    cv::read(fs["vocabulary_nbChildren"], mNbChildren);
+    cv::read(fs["vocabulary_words"], mWords);
+    fs.release();
+
+    if(mFirstChild.size() != (unsigned int)mCentroids.rows || mNbChildren.size() != (unsigned int)mCentroids.rows
+       || mWords.size() != (unsigned int)mCentroids.rows)
+        throw std::runtime_error("BinaryVocabulary::loadFromFileStorage > corrupted vocabulary!");
+}
+
+
+void LandmarkRecognizer::build(const BinaryVocabulary& vocabulary, const std::vector<cv::Mat>& landmarkDescriptors)
+{
+    mVocabulary = vocabulary;
+    mNbLandmarks = landmarkDescriptors.size();
+    const int nbWords = mVocabulary.getNbWords();
+
+    //words of each landmark, and in how many landmarks each word appears
+    std::vector<std::vector<int> > landmarkWords(mNbLandmarks);
+    std::vector<int> nbLandmarksWithWord(nbWords, 0);
+    for(int l=0;l<mNbLandmarks;l++)
+    {
+        mVocabulary.getWords(landmarkDescriptors[l], landmarkWords[l]);
+        std::vector<int> uniqueWords = landmarkWords[l];
+        std::sort(uniqueWords.begin(), uniqueWords.end());
+        uniqueWords.erase(std::unique(uniqueWords.begin(), uniqueWords.end()), uniqueWords.end());
+        for(unsigned int i=0;i<uniqueWords.size();i++)
+            nbLandmarksWithWord[uniqueWords[i]]++;
+    }
+
+    //a word which is in all the landmarks tells them apart the least, smoothed so that it still counts:
+    //with one or two landmarks most of the words are shared
+    mIdf.resize(nbWords);
+    for(int w=0;w<nbWords;w++)
+        mIdf[w] = nbLandmarksWithWord[w] ? std::log((float)(mNbLandmarks+1)/nbLandmarksWithWord[w]) : 0.f;
+
+    mInvertedFile.assign(nbWords, std::vector<Posting>());
+    std::vector<std::pair<int,float> > bow;
+    for(int l=0;l<mNbLandmarks;l++)
+    {
+        getBowVector(landmarkWords[l], bow);
+        for(unsigned int i=0;i<bow.size();i++)
+        {
+            Posting posting;
+            posting.landmark = l;
+            posting.weight = bow[i].second;
+            mInvertedFile[bow[i].first].push_back(posting);
+        }
+    }
+}
+
+void LandmarkRecognizer::getBowVector(const std::vector<int>& words, std::vector<std::pair<int,float> >& bow) const
+{
+    bow.clear();
+    std::vector<int> sortedWords = words;
+    std::sort(sortedWords.begin(), sortedWords.end());
+
+    //tf-idf, L1 normalized
+    float sum = 0;
+    for(unsigned int i=0;i<sortedWords.size();)
+    {
+        unsigned int j = i;
+        while(j<sortedWords.size() && sortedWords[j] == sortedWords[i])
+            j++;
+        float weight = (j-i)*mIdf[sortedWords[i]];
+        if(weight > 0)
+        {
+            bow.push_back(std::make_pair(sortedWords[i], weight));
+            sum += weight;
+        }
+        i = j;
+    }
+    for(unsigned int i=0;i<bow.size();i++)
+        bow[i].second /= sum;
+}
+
+void LandmarkRecognizer::shortlist(const cv::Mat& descriptors, unsigned int maxNbLandmarks, float minScore,
+                                   std::vector<int>& landmarks) const
+{
+    landmarks.clear();
+    if(empty() || descriptors.empty())
+        return;
+
+    std::vector<int> words;
+    mVocabulary.getWords(descriptors, words);
+    std::vector<std::pair<int,float> > bow;
+    getBowVector(words, bow);
+
+    //L1 score of normalized vectors: 1 - |a-b|/2 = sum over the common words of min(a,b),
+    //only the landmarks in the posting lists of the words of the image are scored
+    std::vector<float> scores(mNbLandmarks, 0.f);
+    std::vector<int> scored;
+    for(unsigned int i=0;i<bow.size();i++)
+    {
+        const std::vector<Posting>& postings = mInvertedFile[bow[i].first];
+        for(unsigned int p=0;p<postings.size();p++)
+        {
+            if(scores[postings[p].landmark] == 0.f)
+                scored.push_back(postings[p].landmark);
+            scores[postings[p].landmark] += std::min(bow[i].second, postings[p].weight);
+        }
+    }
+
+    std::vector<std::pair<float,int> > candidates;
+    for(unsigned int i=0;i<scored.size();i++)
+        if(scores[scored[i]] >= minScore)
+            candidates.push_back(std::make_pair(-scores[scored[i]], scored[i]));
+    std::sort(candidates.begin(), candidates.end());
+    for(unsigned int i=0;i<candidates.size() && i<maxNbLandmarks;i++)
+        landmarks.push_back(candidates[i].second);
+}
+
+}
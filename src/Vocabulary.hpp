@@ -0,0 +1,84 @@
+//bag of binary words to recognize which landmarks are seen in an image before matching them
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+
+namespace thymio_tracker
+{
+
+//vocabulary tree of binary descriptors (Nister and Stewenius, Scalable Recognition with a Vocabulary Tree),
+//the nodes are clustered with k-majority (Galvez-Lopez and Tardos, Bags of Binary Words) and the words are the leaves
+class BinaryVocabulary
+{
+public:
+    BinaryVocabulary() : mBranching(0), mDepth(0), mNbWords(0) {}
+
+    //cluster the descriptors (CV_8U, one per row) in a tree with branching children per node and depth levels
+    void train(const cv::Mat& descriptors, int branching, int depth, cv::RNG& rng);
+
+    void writeToFileStorage(cv::FileStorage& fs) const;
+    void loadFromFileStorage(cv::FileStorage& fs);
+
+    bool empty() const {return mNbWords == 0;}
+    int getNbWords() const {return mNbWords;}
+    int getDescriptorSize() const {return mCentroids.cols;}
+
+    //word of a descriptor: the leaf reached by going down to the closest child at each level
+    int getWord(const uchar* descriptor) const;
+    //words of all the descriptors
+    void getWords(const cv::Mat& descriptors, std::vector<int>& words) const;
+
+private:
+    //cluster the descriptors of ids in node, recursively
+    void trainNode(const cv::Mat& descriptors, const std::vector<int>& ids, int node, int level, cv::RNG& rng);
+
+    int mBranching;
+    int mDepth;
+    int mNbWords;
+
+    //centroid of each node, the root (node 0) has none
+    cv::Mat mCentroids;
+    //children of node n are mFirstChild[n] to mFirstChild[n]+mNbChildren[n]-1, none for the leaves
+    std::vector<int> mFirstChild;
+    std::vector<int> mNbChildren;
+    //word of each leaf, -1 for the inner nodes
+    std::vector<int> mWords;
+};
+
+//inverted file of the landmarks: for each word, the landmarks where it appears with its tf-idf weight.
+//An image is compared only with the landmarks which share words with it, with the L1 score of the
+//normalized bag of words vectors, so the cost depends on the words of the image, not on the nb of landmarks
+class LandmarkRecognizer
+{
+public:
+    LandmarkRecognizer() : mNbLandmarks(0) {}
+
+    //set the vocabulary and index the descriptors of each landmark
+    void build(const BinaryVocabulary& vocabulary, const std::vector<cv::Mat>& landmarkDescriptors);
+
+    bool empty() const {return mVocabulary.empty();}
+
+    //landmarks which are the most similar to the image with these descriptors, at most maxNbLandmarks
+    //and with a score in [0,1] of at least minScore, best first
+    void shortlist(const cv::Mat& descriptors, unsigned int maxNbLandmarks, float minScore,
+                   std::vector<int>& landmarks) const;
+
+private:
+    struct Posting
+    {
+        int landmark;
+        float weight;
+    };
+
+    //normalized tf-idf vector of a set of words, as (word,weight) sorted by word
+    void getBowVector(const std::vector<int>& words, std::vector<std::pair<int,float> >& bow) const;
+
+    BinaryVocabulary mVocabulary;
+    int mNbLandmarks;
+    std::vector<float> mIdf;
+    std::vector<std::vector<Posting> > mInvertedFile;
+};
+
+}
@@ -0,0 +1,48 @@
+/*
+
+convert a landmark file made by the landmark tool to the binary format, which ThymioTracker maps
+instead of decoding it when it is added to the config file
+
+*/
+
+#include "Landmark.hpp"
+#include <opencv2/core.hpp>
+
+#include <iostream>
+#include <string>
+
+
+void print_usage(const char* command)
+{
+    std::cerr << "Usage :\n\t" << command << " <landmark file> <output file>" << std::endl;
+    std::cerr << "example :\n\t./convertLandmark ../data/landmarks/marker.xml.gz ../data/landmarks/marker.lmk" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc != 3)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::string inputFilename = argv[1];
+    std::string outputFilename = argv[2];
+
+    cv::FileStorage fs(inputFilename, cv::FileStorage::READ);
+    if(!fs.isOpened())
+    {
+        std::cerr << "Could not open " << inputFilename << std::endl;
+        return 1;
+    }
+    thymio_tracker::Landmark landmark = thymio_tracker::Landmark::fromFileStorage(fs);
+    fs.release();
+
+    landmark.writeBinaryFile(outputFilename);
+
+    //check that it can be loaded back
+    thymio_tracker::Landmark converted = thymio_tracker::Landmark::fromBinaryFile(outputFilename);
+    std::cout << "Nb features : " << converted.getKeypointPos().size() << std::endl;
+
+    return 0;
+}
@@ -6,6 +6,7 @@ if it is added to the config file
 */
 
 #include "VideoSource.hpp"
+#include "FeatureBackend.hpp"
 #include <opencv2/core.hpp>
 #include <opencv2/features2d.hpp>
 #include <opencv2/calib3d.hpp>
@@ -13,13 +14,25 @@ if it is added to the config file
 
 void print_usage(const char* command)
 {
-    std::cerr << "Usage :\n\t" << command << " <image file> <output file> <scale factor> <width in meters> <height in meters>" << std::endl;
+    std::cerr << "Usage :\n\t" << command << " <image file> <output file> <scale factor> <width in meters> <height in meters> [<feature type> ...]" << std::endl;
+    std::cerr << "feature types : brisk (default), orb, fast_brief. With several types, one file per type is written, named <output file>_<type>" << std::endl;
     std::cerr << "example :\n\t./landmark_simple ../data/landmarks/marker.png  ../data/landmarks/marker2.xml.gz 0.5 0.1025 0.1025" << std::endl;
+    std::cerr << "\t./landmark_simple ../data/landmarks/marker.png  ../data/landmarks/marker2.xml.gz 0.5 0.1025 0.1025 brisk orb" << std::endl;
+}
+
+//output file of a feature type when several are written: marker2.xml.gz => marker2_orb.xml.gz
+std::string outputFilenameForType(const std::string& outputFilename, const std::string& featureType)
+{
+    size_t slash = outputFilename.find_last_of('/');
+    size_t dot = outputFilename.find('.', (slash == std::string::npos) ? 0 : slash+1);
+    if(dot == std::string::npos)
+        return outputFilename + "_" + featureType;
+    return outputFilename.substr(0, dot) + "_" + featureType + outputFilename.substr(dot);
 }
 
 int main(int argc, char* argv[])
 {
-    if(argc !=6)
+    if(argc < 6)
     {
         print_usage(argv[0]);
         return 1;
@@ -32,6 +45,12 @@ int main(int argc, char* argv[])
     float r_width = std::stof(argv[4]);
     float r_height = std::stof(argv[5]);
 
+    std::vector<thymio_tracker::FeatureType> featureTypes;
+    for(int i=6;i<argc;i++)
+        featureTypes.push_back(thymio_tracker::featureTypeFromName(argv[i]));
+    if(featureTypes.empty())
+        featureTypes.push_back(thymio_tracker::FEATURE_BRISK);
+
 
     cv::Mat templateImage = cv::imread(imageFilename);
     if(templateImage.type() != CV_8UC1)
@@ -59,25 +78,32 @@ int main(int argc, char* argv[])
     cv::Mat templateImageBorder;
     copyMakeBorder( templateImageRescaled, templateImageBorder, margin, margin, margin, margin, cv::BORDER_CONSTANT, cv::Scalar(255,255,255) );
     
-    //create feature extractor and extract
-    cv::Ptr<cv::BRISK> test_orb = cv::BRISK::create(60);//(int thresh=30, int octaves=3, float patternScale=1.0f)
-    std::vector<cv::KeyPoint> templateKeypoints;
-    cv::Mat templateDescriptors;
-    test_orb->detectAndCompute(templateImageBorder, cv::noArray(), templateKeypoints, templateDescriptors);
-    std::cout<<"Nb features : "<<templateKeypoints.size()<<std::endl;
-
-    //rescale template Keypoint positions to original image coordinate
-    for(unsigned int i=0;i<templateKeypoints.size();i++)
-        templateKeypoints[i].pt = (templateKeypoints[i].pt-cv::Point2f(margin,margin))/scale;
-
-    //save to file
-    cv::FileStorage fs(outputFilename, cv::FileStorage::WRITE);
-    cv::write(fs, "image", templateImage);
-    cv::write(fs, "image_size", templateImage.size());
-    cv::write(fs, "real_size", cv::Size2f(r_width,r_height));
-    cv::write(fs,"keypoints", templateKeypoints);
-    cv::write(fs,"descriptors", templateDescriptors);
-    fs.release();
+    for(auto featureType : featureTypes)
+    {
+        std::string featureTypeName = thymio_tracker::featureTypeName(featureType);
+
+        //create feature extractor and extract
+        cv::Ptr<cv::Feature2D> test_orb = thymio_tracker::createFeatureExtractor(featureType, true);
+        std::vector<cv::KeyPoint> templateKeypoints;
+        cv::Mat templateDescriptors;
+        test_orb->detectAndCompute(templateImageBorder, cv::noArray(), templateKeypoints, templateDescriptors);
+        std::cout<<"Nb features ("<<featureTypeName<<") : "<<templateKeypoints.size()<<std::endl;
+
+        //rescale template Keypoint positions to original image coordinate
+        for(unsigned int i=0;i<templateKeypoints.size();i++)
+            templateKeypoints[i].pt = (templateKeypoints[i].pt-cv::Point2f(margin,margin))/scale;
+
+        //save to file
+        std::string filename = (featureTypes.size() > 1) ? outputFilenameForType(outputFilename, featureTypeName) : outputFilename;
+        cv::FileStorage fs(filename, cv::FileStorage::WRITE);
+        cv::write(fs, "image", templateImage);
+        cv::write(fs, "image_size", templateImage.size());
+        cv::write(fs, "real_size", cv::Size2f(r_width,r_height));
+        cv::write(fs, "feature_type", featureTypeName);
+        cv::write(fs,"keypoints", templateKeypoints);
+        cv::write(fs,"descriptors", templateDescriptors);
+        fs.release();
+    }
 
     
     return 0;
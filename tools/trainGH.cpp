@@ -11,7 +11,12 @@
 //If you changed the function setBlobModel which includes the blob positions 
 //and blob groups then use this program to update the geometric hashing xml file.
 
+//Robots with other marker layouts can be added to the same table: each layout file
+//is an xml file storing the list of blob positions in "vertices". The first model
+//of the table is always the default layout from setBlobModel.
+
 #include <iostream>
+#include <cstdio>
 #include "Models.hpp"
 #include "Visualization3D.hpp"
 #include "GH.hpp"
@@ -25,12 +30,12 @@ namespace tt = thymio_tracker;
 
 void print_usage(const char* command)
 {
-    std::cerr << "Usage:\n\t" << command << " <geo hashing outfile>" << std::endl;
+    std::cerr << "Usage:\n\t" << command << " <geo hashing outfile> [<marker layout file> ...]" << std::endl;
 }
 
 int main(int argc, const char * argv[])
 {
-    if(argc != 2)
+    if(argc < 2)
     {
         print_usage(argv[0]);
         return 1;
@@ -49,54 +54,27 @@ int main(int argc, const char * argv[])
     Visualization3D vizu(&mCalibration);
     tt::ThymioBlobModel mRobot;
     vizu.addObject(mRobot);
-    
-    //create an sphere of camera watching object
-    vector<tt::Camera3dModel> vCams;
-    float radiusSphere=0.3;//radius sphere
-    float distCamCam=0.15*radiusSphere;
-    float minLatitude=M_PI/12.;
-        
-    //get latitude angle increment from desired distCamCam
-    int l=0;
-    float latitude=M_PI/2.-l*distCamCam/radiusSphere;
-    while(latitude>minLatitude)
+
+    //blob layouts of all the models to store in the table
+    vector<vector<Point3f> > layouts;
+    layouts.push_back(mRobot.mVertices);
+    for(int a=2;a<argc;a++)
     {
-        if(l==0)//pole
+        cv::FileStorage layoutStorage(argv[a], cv::FileStorage::READ);
+        if(!layoutStorage.isOpened())
         {
-            //pole => want only one cam
-            tt::Camera3dModel newCam;
-            newCam.pose=newCam.pose.rotate(Vec3d(M_PI,0,0)).translate(Vec3d(0.0,0.0,radiusSphere));
-            
-            vCams.push_back(newCam);
-        }
-        else
-        {
-            //compute how many cams we want at this latitude
-            float radiusLatitude=2.*M_PI*cos(latitude);
-            int nbCamInLat=(int)(radiusSphere*radiusLatitude/distCamCam);
-            
-            for(int cl=0;cl<nbCamInLat;cl++)
-            {
-                float longitude=2.*M_PI*cl/nbCamInLat;
-                
-                //rotate around z
-                tt::Camera3dModel newCam;
-                newCam.pose=newCam.pose.rotate(Vec3d(0.0,0.0,longitude));
-                
-                //rotate for latitude and zoom out
-                Affine3d transfoRotx = Affine3d().rotate(Vec3d(M_PI/2.-latitude,0.0,0.0));
-                newCam.pose=newCam.pose*transfoRotx;
-               
-                Affine3d transfoZLoc = Affine3d().translate(Vec3d(0.0,0.0,radiusSphere));
-                newCam.pose=(newCam.pose*transfoZLoc)*Affine3d().rotate(Vec3d(M_PI,0,0));
-                
-                vCams.push_back(newCam);
-            }
+            std::cerr << "Could not open " << argv[a] << std::endl;
+            return 1;
         }
-        l++;
-        latitude=M_PI/2.-l*distCamCam/radiusSphere;
+        vector<Point3f> layout;
+        layoutStorage["vertices"] >> layout;
+        layouts.push_back(layout);
     }
     
+    //create an sphere of camera watching object
+    vector<tt::Camera3dModel> vCams;
+    tt::createTrainingCameras(vCams);
+    
     for(unsigned int c=0;c<vCams.size();c++)vizu.addObject(vCams[c]);
     
     //create another window to show projection in created cameras
@@ -114,47 +92,64 @@ int main(int argc, const char * argv[])
     
     //use created cameras to train GH to become robust to perspective
 #ifndef USE_SCALE
-    vector<Point2f> *projPoints=new vector<Point2f>[vCams.size()];//for GH: contains only coordinates in meters of projected vertices
+    if(layouts.size()>1)
+        std::cerr << "GH without scale only supports one model, other layouts are ignored" << std::endl;
+    layouts.resize(1);
+    typedef Point2f ProjPoint;//for GH: contains only coordinates in meters of projected vertices
 #else
-    vector<Point3f> *projPoints=new vector<Point3f>[vCams.size()];//for GHscale, contains inverse depth as well
+    typedef Point3f ProjPoint;//for GHscale, contains inverse depth as well
 #endif
-    for(unsigned int p=0;p<vCams.size();p++)
+    vector<vector<ProjPoint>*> projPoints;
+    for(unsigned int m=0;m<layouts.size();m++)
     {
-        Affine3d poseInv=vCams[p].pose.inv();
-        
-        Affine3d poseComb=poseInv * mRobot.pose;
-        for(unsigned int v=0;v<mRobot.mVertices.size();v++)
+        projPoints.push_back(new vector<ProjPoint>[vCams.size()]);
+        for(unsigned int p=0;p<vCams.size();p++)
         {
-            Point3f pointCam=poseComb*mRobot.mVertices[v];
-            //for GH:
+            Affine3d poseInv=vCams[p].pose.inv();
+            
+            Affine3d poseComb=poseInv * mRobot.pose;
+            for(unsigned int v=0;v<layouts[m].size();v++)
+            {
+                Point3f pointCam=poseComb*layouts[m][v];
+                //for GH:
 #ifndef USE_SCALE
-            Point2f projMeters(pointCam.x,pointCam.y);
+                Point2f projMeters(pointCam.x,pointCam.y);
 #else
-            //for GHscale:
-            Point3f projMeters(pointCam.x/pointCam.z,pointCam.y/pointCam.z,1./pointCam.z);
+                //for GHscale:
+                Point3f projMeters(pointCam.x/pointCam.z,pointCam.y/pointCam.z,1./pointCam.z);
 #endif
-            
-            projPoints[p].push_back(projMeters);            
+                
+                projPoints[m][p].push_back(projMeters);            
+            }
         }
-        
-        
     }
     
 //give that to GH
 #ifndef USE_SCALE
     tt::GH mGH;//here will train with coodrinates in meters so calibration does not matter
+    mGH.initHashTable(layouts[0].size());
+    mGH.setModel(projPoints[0],vCams.size());
 #else
     tt::GHscale mGH;//here will train with coodrinates in meters so calibration does not matter
+    vector<int> nbIdsPerModel;
+    for(unsigned int m=0;m<layouts.size();m++)
+        nbIdsPerModel.push_back(layouts[m].size());
+    mGH.initHashTable(nbIdsPerModel);
+    mGH.setModels(projPoints,vCams.size());
 #endif
-    
-    mGH.initHashTable(mRobot.mVertices.size());
-    mGH.setModel(projPoints,vCams.size());
     {
-        //save GH for later use
+        //save GH for later use, with the layouts so that the tracker knows the models
         cv::FileStorage GHstorage(outFilename, cv::FileStorage::WRITE);
+        for(unsigned int m=0;m<layouts.size();m++)
+        {
+            char layoutName[100];
+            sprintf(layoutName, "modelVertices_%d", m);
+            cv::write(GHstorage, layoutName, layouts[m]);
+        }
         mGH.saveToFileStorage(GHstorage);
     }
-    delete[] projPoints;
+    for(unsigned int m=0;m<projPoints.size();m++)
+        delete[] projPoints[m];
     
     //loop to switch from one cam to the next, 
     //for viewing purpose only: press any key except ESC, 
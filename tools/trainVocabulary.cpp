@@ -0,0 +1,62 @@
+/*
+
+train the vocabulary of binary words on the descriptors of the landmarks, the output file is loaded by ThymioTracker
+if it is added to the config file as vocabularyFile, and then only the landmarks which share words with the image
+are matched
+
+*/
+
+#include "Vocabulary.hpp"
+#include <opencv2/core.hpp>
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+
+void print_usage(const char* command)
+{
+    std::cerr << "Usage :\n\t" << command << " <output file> <branching> <depth> <landmark file> [<landmark file> ...]" << std::endl;
+    std::cerr << "example :\n\t./trainVocabulary ../data/landmarks/vocabulary.xml.gz 10 3 ../data/landmarks/marker.xml.gz ../data/landmarks/marker2.xml.gz" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 5)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::string outputFilename = argv[1];
+    int branching = std::atoi(argv[2]);
+    int depth = std::atoi(argv[3]);
+
+    //stack the descriptors of all the landmarks
+    cv::Mat descriptors;
+    for(int i=4;i<argc;i++)
+    {
+        cv::FileStorage fs(argv[i], cv::FileStorage::READ);
+        if(!fs.isOpened())
+        {
+            std::cerr << "Could not open " << argv[i] << std::endl;
+            return 1;
+        }
+        cv::Mat landmarkDescriptors;
+        cv::read(fs["descriptors"], landmarkDescriptors);
+        fs.release();
+        std::cout << argv[i] << " : " << landmarkDescriptors.rows << " descriptors" << std::endl;
+        descriptors.push_back(landmarkDescriptors);
+    }
+
+    thymio_tracker::BinaryVocabulary vocabulary;
+    cv::RNG rng(0x2f1b);
+    vocabulary.train(descriptors, branching, depth, rng);
+    std::cout << "Nb words : " << vocabulary.getNbWords() << std::endl;
+
+    cv::FileStorage fs(outputFilename, cv::FileStorage::WRITE);
+    vocabulary.writeToFileStorage(fs);
+    fs.release();
+
+    return 0;
+}
@@ -0,0 +1,267 @@
+//This program looks for the best parameters of the geometric hashing table:
+//number of bins per dimension, blur radius of the table and number of neigbors used
+//to define the bases (nbPtBasis).
+//A table is trained for each configuration of the grid, the same way as trainGH does,
+//and it is then replayed against a synthetic sequence: the blob model is projected from
+//random view points with the camera calibration given, with noise on the blob positions
+//and sizes and some clutter blobs.
+//For each configuration we report the identification accuracy and recall, the time spent voting
+//and the memory used by the table. The configurations which are not beaten on all these
+//criteria at once by another one (Pareto-optimal) are marked, and the one of them with the best
+//accuracy x recall is trained again and saved: a table which returns very few points, even all
+//correct, is not a good one.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include "Models.hpp"
+#include "GHscale.hpp"
+
+
+using namespace std;
+using namespace cv;
+
+namespace tt = thymio_tracker;
+
+void print_usage(const char* command)
+{
+    std::cerr << "Usage:\n\t" << command << " <calibration file> <geo hashing outfile> [<nb test frames>]" << std::endl;
+}
+
+//parameters tuned and results of one configuration
+struct GHConfiguration
+{
+    Point3i nbBinsPerDim;
+    int blurRadius;
+    int nbPtBasis;
+
+    float accuracy;//ratio of returned matches with correct id
+    float recall;//ratio of visible model points correctly identified
+    double voteTimeMs;//average time per frame
+    size_t memory;//size of the table in bytes
+    bool paretoOptimal;
+};
+
+//one frame of the synthetic sequence: blobs with the id of the model point they come from, -1 for clutter
+struct GHTestFrame
+{
+    vector<KeyPoint> blobs;
+    vector<int> ids;
+};
+
+void createTestSequence(const tt::IntrinsicCalibration& calib, const tt::ThymioBlobModel& robot,
+                        int nbFrames, vector<GHTestFrame>& frames)
+{
+    RNG rng(0x5eed);
+    const float fx=calib.cameraMatrix.at<double>(0,0);
+    const float blobDiameter=0.008;//only the ratio between blob sizes matters to GHscale
+
+    while((int)frames.size()<nbFrames)
+    {
+        //random view point on a sphere around the robot, a bit less tilted than the training cameras,
+        //and the robot is not always centered in the image
+        float longitude=rng.uniform(0.,2.*M_PI);
+        float tilt=rng.uniform(0.,M_PI/3.);
+        float distance=rng.uniform(0.2,0.5);
+        Affine3d camPose=Affine3d().rotate(Vec3d(0.0,0.0,longitude));
+        camPose=camPose*Affine3d().rotate(Vec3d(tilt,0.0,0.0));
+        camPose=(camPose*Affine3d().translate(Vec3d(0.0,0.0,distance)))*Affine3d().rotate(Vec3d(M_PI,0,0));
+        camPose=camPose*Affine3d().rotate(Vec3d(rng.uniform(-0.15,0.15),rng.uniform(-0.15,0.15),rng.uniform(-M_PI,M_PI)));
+
+        Affine3d robotInCam=camPose.inv()*robot.pose;
+        vector<Point2f> projections;
+        projectPoints(robot.mVertices, robotInCam.rvec(), robotInCam.translation(),
+                      calib.cameraMatrix, calib.distCoeffs, projections);
+
+        GHTestFrame frame;
+        Rect imageRect(0,0,calib.imageSize.width,calib.imageSize.height);
+        for(unsigned int v=0;v<robot.mVertices.size();v++)
+        {
+            Point3f pointCam=robotInCam*robot.mVertices[v];
+            if(pointCam.z<=0 || !imageRect.contains(projections[v]))
+                continue;
+
+            KeyPoint blob;
+            blob.pt=projections[v]+Point2f(rng.gaussian(0.5),rng.gaussian(0.5));
+            blob.size=fx*blobDiameter/pointCam.z*(1.+rng.gaussian(0.05));
+            frame.blobs.push_back(blob);
+            frame.ids.push_back(v);
+        }
+
+        //not enough blobs to have a chance to find the robot
+        if(frame.blobs.size()<4)
+            continue;
+
+        //clutter
+        int nbClutter=rng.uniform(0,10);
+        for(int c=0;c<nbClutter;c++)
+        {
+            KeyPoint blob;
+            blob.pt=Point2f(rng.uniform(0.f,(float)calib.imageSize.width),rng.uniform(0.f,(float)calib.imageSize.height));
+            blob.size=fx*blobDiameter/rng.uniform(0.2f,0.5f);
+            frame.blobs.push_back(blob);
+            frame.ids.push_back(-1);
+        }
+        frames.push_back(frame);
+    }
+}
+
+void trainGH(tt::GHscale& mGH, const GHConfiguration& config, const tt::ThymioBlobModel& robot,
+             const vector<tt::Camera3dModel>& vCams)
+{
+    vector<Point3f> *projPoints=new vector<Point3f>[vCams.size()];
+    for(unsigned int p=0;p<vCams.size();p++)
+    {
+        Affine3d poseComb=vCams[p].pose.inv() * robot.pose;
+        for(unsigned int v=0;v<robot.mVertices.size();v++)
+        {
+            Point3f pointCam=poseComb*robot.mVertices[v];
+            projPoints[p].push_back(Point3f(pointCam.x/pointCam.z,pointCam.y/pointCam.z,1./pointCam.z));
+        }
+    }
+
+    mGH.setNbPtBasis(config.nbPtBasis);
+    mGH.initHashTable(robot.mVertices.size(),config.nbBinsPerDim);
+    mGH.setModel(projPoints,vCams.size());
+    mGH.blurHashTable(config.blurRadius);
+    //same settings as the tracker
+    mGH.setEarlyExit(true);
+
+    delete[] projPoints;
+}
+
+void evaluateGH(const tt::GHscale& mGH, const vector<GHTestFrame>& frames, GHConfiguration& config)
+{
+    int nbMatches=0;
+    int nbCorrect=0;
+    int nbVisible=0;
+    int64 ticks=0;
+
+    tt::GHscaleWorkspace workspace;
+    vector<tt::DetectionGH> matches;
+    for(unsigned int f=0;f<frames.size();f++)
+    {
+        int64 start=getTickCount();
+        mGH.getModelPointsFromImage(frames[f].blobs, matches, workspace);
+        ticks+=getTickCount()-start;
+
+        //matches keep the position of the blob, get back the ground truth from it
+        for(unsigned int m=0;m<matches.size();m++)
+            for(unsigned int b=0;b<frames[f].blobs.size();b++)
+                if(frames[f].blobs[b].pt==matches[m].position)
+                {
+                    if(frames[f].ids[b]==matches[m].id)
+                        nbCorrect++;
+                    break;
+                }
+        nbMatches+=matches.size();
+
+        for(unsigned int b=0;b<frames[f].ids.size();b++)
+            if(frames[f].ids[b]>=0)
+                nbVisible++;
+    }
+
+    config.accuracy=(nbMatches>0)?(float)nbCorrect/nbMatches:0;
+    config.recall=(nbVisible>0)?(float)nbCorrect/nbVisible:0;
+    config.voteTimeMs=1000.*ticks/getTickFrequency()/frames.size();
+    config.memory=mGH.getTableSize()*sizeof(float);
+}
+
+//a dominates b if it is at least as good on all the criteria and better on one
+bool dominates(const GHConfiguration& a, const GHConfiguration& b)
+{
+    bool asGood=a.accuracy>=b.accuracy && a.recall>=b.recall && a.voteTimeMs<=b.voteTimeMs && a.memory<=b.memory;
+    bool better=a.accuracy>b.accuracy || a.recall>b.recall || a.voteTimeMs<b.voteTimeMs || a.memory<b.memory;
+    return asGood && better;
+}
+
+int main(int argc, const char * argv[])
+{
+    if(argc < 3)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    tt::IntrinsicCalibration mCalibration(argv[1]);
+    //output file, typically "../data/GHscale_Arth_Perspective.xml"
+    std::string outFilename = argv[2];
+    int nbTestFrames = (argc > 3) ? atoi(argv[3]) : 500;
+
+    tt::ThymioBlobModel mRobot;
+    vector<tt::Camera3dModel> vCams;
+    tt::createTrainingCameras(vCams);
+
+    vector<GHTestFrame> frames;
+    createTestSequence(mCalibration, mRobot, nbTestFrames, frames);
+
+    //grid of parameters
+    const Point2i binsXY[] = {Point2i(20,20), Point2i(30,30), Point2i(40,40), Point2i(60,60)};
+    const int binsScale[] = {3, 5, 8};
+    const int blurRadius[] = {0, 1, 2, 5};
+    const int nbPtBasis[] = {2, 3};
+
+    vector<GHConfiguration> configs;
+    for(unsigned int i=0;i<sizeof(binsXY)/sizeof(binsXY[0]);i++)
+        for(unsigned int j=0;j<sizeof(binsScale)/sizeof(binsScale[0]);j++)
+            for(unsigned int k=0;k<sizeof(blurRadius)/sizeof(blurRadius[0]);k++)
+                for(unsigned int n=0;n<sizeof(nbPtBasis)/sizeof(nbPtBasis[0]);n++)
+                {
+                    GHConfiguration config;
+                    config.nbBinsPerDim=Point3i(binsXY[i].x,binsXY[i].y,binsScale[j]);
+                    config.blurRadius=blurRadius[k];
+                    config.nbPtBasis=nbPtBasis[n];
+
+                    tt::GHscale mGH(&mCalibration);
+                    trainGH(mGH, config, mRobot, vCams);
+                    evaluateGH(mGH, frames, config);
+                    configs.push_back(config);
+
+                    std::cerr << "." << std::flush;
+                }
+    std::cerr << std::endl;
+
+    //Pareto front
+    for(unsigned int c=0;c<configs.size();c++)
+    {
+        configs[c].paretoOptimal=true;
+        for(unsigned int c2=0;c2<configs.size();c2++)
+            if(dominates(configs[c2],configs[c]))
+                configs[c].paretoOptimal=false;
+    }
+
+    //report, Pareto-optimal configurations are marked with a *
+    int idBest=-1;
+    printf("  bins (x,y,s)  blur  nbPtBasis  accuracy  recall  vote time (ms)  memory (kB)\n");
+    for(unsigned int c=0;c<configs.size();c++)
+    {
+        const GHConfiguration& config=configs[c];
+        printf("%c %4d,%3d,%3d  %4d  %9d  %8.3f  %6.3f  %14.3f  %11.1f\n",
+               config.paretoOptimal?'*':' ',
+               config.nbBinsPerDim.x, config.nbBinsPerDim.y, config.nbBinsPerDim.z,
+               config.blurRadius, config.nbPtBasis,
+               config.accuracy, config.recall, config.voteTimeMs, config.memory/1024.);
+
+        //keep the one of the front which identifies the most points correctly, the fastest one if equal
+        float score=config.accuracy*config.recall;
+        float bestScore=(idBest==-1)?-1.f:configs[idBest].accuracy*configs[idBest].recall;
+        if(config.paretoOptimal && (score>bestScore || (score==bestScore && config.voteTimeMs<configs[idBest].voteTimeMs)))
+            idBest=c;
+    }
+
+    const GHConfiguration& best=configs[idBest];
+    printf("\nsaved: bins %d,%d,%d blur %d nbPtBasis %d to %s\n",
+           best.nbBinsPerDim.x, best.nbBinsPerDim.y, best.nbBinsPerDim.z,
+           best.blurRadius, best.nbPtBasis, outFilename.c_str());
+
+    tt::GHscale mGH(&mCalibration);
+    trainGH(mGH, best, mRobot, vCams);
+    {
+        //save GH for later use, with the layout as trainGH does
+        cv::FileStorage GHstorage(outFilename, cv::FileStorage::WRITE);
+        cv::write(GHstorage, "modelVertices_0", mRobot.mVertices);
+        mGH.saveToFileStorage(GHstorage);
+    }
+
+    return 0;
+}